@@ -0,0 +1,468 @@
+/*
+ * Compressed dump archive: a ROM or SAVE image cut into chunks of
+ * ARCHIVE_CHUNK bytes that are compressed on their own, so they can be
+ * compressed in parallel as the dump comes in and decompressed one at a time
+ * while writing. All numbers are big endian.
+ *
+ *  header  "EMSARC01", chunk size, image size, chunk count, index offset
+ *  chunks  the compressed chunks back to back
+ *  index   per chunk: file offset, stored length, image length, CRC-32
+ *
+ * A chunk that is all 0xFF, like the padding of a ROM smaller than its bank,
+ * is stored with length 0. A chunk that doesn't get smaller is stored as is,
+ * with its stored length equal to its image length. Anything else is deflated
+ * with zlib.
+ */
+#include <err.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <zlib.h>
+
+#include "archive.h"
+#include "crc32.h"
+#include "ems.h"
+
+#define ARCHIVE_MAGIC "EMSARC01"
+#define ARCHIVE_HEADER (8 + 4 * 4)
+
+// chunk sizes a reader accepts
+#define ARCHIVE_CHUNK_MAX 0x1000000
+
+/* one chunk on its way into the archive */
+struct archive_chunk {
+    unsigned char *in;      // image bytes
+    unsigned char *out;     // stored bytes, once compressed
+    uint32_t ulen;          // image length
+    uint32_t clen;          // stored length
+    uint32_t crc;
+    int done;               // compressed, ready to be written
+    int failed;
+};
+
+struct archive_writer {
+    FILE *file;
+    uint32_t count;         // image bytes the archive will hold
+    uint32_t nchunks;
+    struct archive_chunk *chunks;
+    uint32_t *index;        // 4 words per chunk, network order
+    uint32_t filled;        // image bytes added so far
+    uint32_t queued;        // full chunks handed to the workers
+    uint32_t taken;         // chunks a worker has started on
+    uint32_t written;       // chunks written to the file
+    uint32_t pos;           // file offset of the next chunk
+    int error;
+    int stop;
+    int nworkers;
+    pthread_t workers[ARCHIVE_WORKERS];
+    pthread_mutex_t lock;
+    pthread_cond_t work;    // a chunk was queued, or the workers should stop
+    pthread_cond_t done;    // a chunk was compressed
+};
+
+struct archive_reader {
+    FILE *file;
+    uint32_t chunk;         // chunk size
+    uint32_t count;         // image bytes
+    uint32_t nchunks;
+    uint32_t *index;        // 4 words per chunk, host order
+    unsigned char *buf;     // image bytes of the current chunk
+    unsigned char *in;      // stored bytes of the current chunk
+    uint32_t next;          // next chunk to load
+    uint32_t have;          // bytes in buf
+    uint32_t used;          // bytes of buf handed out
+};
+
+/**
+ * Does file start with an archive header? Leaves file rewound.
+ */
+int archive_is(FILE *file) {
+    char magic[8];
+    int r;
+
+    rewind(file);
+    r = fread(magic, sizeof(magic), 1, file) == 1 && memcmp(magic, ARCHIVE_MAGIC, sizeof(magic)) == 0;
+    rewind(file);
+    return r;
+}
+
+/**
+ * Write the archive header at the start of file.
+ */
+static int archive_header(FILE *file, uint32_t chunk, uint32_t count, uint32_t nchunks, uint32_t index) {
+    uint32_t words[4] = { htonl(chunk), htonl(count), htonl(nchunks), htonl(index) };
+
+    rewind(file);
+    return fwrite(ARCHIVE_MAGIC, 8, 1, file) == 1 && fwrite(words, sizeof(words), 1, file) == 1 ? 0 : -1;
+}
+
+/**
+ * Hash and compress one chunk.
+ */
+static void archive_compress(struct archive_chunk *c) {
+    uLongf len;
+
+    c->crc = crc32_update(0, c->in, c->ulen);
+
+    if (ems_erased(c->in, c->ulen)) {
+        c->clen = 0;
+        return;
+    }
+
+    len = compressBound(c->ulen);
+    c->out = malloc(len);
+    if (c->out == NULL) {
+        c->failed = 1;
+        return;
+    }
+
+    if (compress2(c->out, &len, c->in, c->ulen, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        c->failed = 1;
+    } else if (len >= c->ulen) {
+        // doesn't shrink, keep it as it is
+        memcpy(c->out, c->in, c->ulen);
+        c->clen = c->ulen;
+    } else {
+        c->clen = len;
+    }
+}
+
+/**
+ * Worker thread: compress chunks as they are queued.
+ */
+static void *archive_worker(void *arg) {
+    archive_writer_t *a = arg;
+    struct archive_chunk *c;
+
+    pthread_mutex_lock(&a->lock);
+    while (1) {
+        while (a->taken == a->queued && !a->stop)
+            pthread_cond_wait(&a->work, &a->lock);
+        if (a->taken == a->queued)
+            break;
+
+        c = &a->chunks[a->taken++];
+        pthread_mutex_unlock(&a->lock);
+
+        archive_compress(c);
+
+        pthread_mutex_lock(&a->lock);
+        c->done = 1;
+        pthread_cond_broadcast(&a->done);
+    }
+    pthread_mutex_unlock(&a->lock);
+
+    return NULL;
+}
+
+/**
+ * Write the compressed chunks that are next in line. With wait, wait for
+ * every queued chunk; otherwise stop at the first one still being worked on.
+ */
+static void archive_drain(archive_writer_t *a, int wait) {
+    struct archive_chunk *c;
+    uint32_t *entry;
+
+    pthread_mutex_lock(&a->lock);
+    while (a->written < a->queued) {
+        c = &a->chunks[a->written];
+        if (!c->done) {
+            if (!wait)
+                break;
+            pthread_cond_wait(&a->done, &a->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&a->lock);
+
+        if (c->failed) {
+            warnx("Can't compress chunk %u of the archive", a->written);
+            a->error = -1;
+        } else if (c->clen > 0 && fwrite(c->out, c->clen, 1, a->file) != 1) {
+            warn("Can't write chunk %u of the archive", a->written);
+            a->error = -1;
+        }
+
+        entry = &a->index[a->written * 4];
+        entry[0] = htonl(a->pos);
+        entry[1] = htonl(c->clen);
+        entry[2] = htonl(c->ulen);
+        entry[3] = htonl(c->crc);
+        a->pos += c->clen;
+
+        free(c->in);
+        free(c->out);
+        c->in = c->out = NULL;
+
+        pthread_mutex_lock(&a->lock);
+        ++a->written;
+    }
+    pthread_mutex_unlock(&a->lock);
+}
+
+/**
+ * Start an archive of a count byte image in file, and the threads that
+ * compress its chunks.
+ *
+ * Returns:
+ *  the archive, or NULL if it can't be set up (already reported)
+ */
+archive_writer_t *archive_create(FILE *file, uint32_t count) {
+    archive_writer_t *a;
+    long cpus;
+    int i;
+
+    a = calloc(1, sizeof(*a));
+    if (a == NULL)
+        err(1, "malloc");
+
+    a->file = file;
+    a->count = count;
+    a->nchunks = (count + ARCHIVE_CHUNK - 1) / ARCHIVE_CHUNK;
+    a->chunks = calloc(a->nchunks + 1, sizeof(*a->chunks));
+    a->index = calloc(a->nchunks + 1, 4 * sizeof(*a->index));
+    if (a->chunks == NULL || a->index == NULL)
+        err(1, "malloc");
+    a->pos = ARCHIVE_HEADER;
+
+    if (archive_header(file, ARCHIVE_CHUNK, count, a->nchunks, 0) < 0) {
+        warn("Can't write the archive header");
+        free(a->chunks);
+        free(a->index);
+        free(a);
+        return NULL;
+    }
+
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->work, NULL);
+    pthread_cond_init(&a->done, NULL);
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    a->nworkers = cpus < 1 ? 1 : cpus > ARCHIVE_WORKERS ? ARCHIVE_WORKERS : cpus;
+    for (i = 0; i < a->nworkers; ++i)
+        if (pthread_create(&a->workers[i], NULL, archive_worker, a) != 0)
+            err(1, "pthread_create");
+
+    return a;
+}
+
+/**
+ * Add the next len bytes of the image. Every chunk that fills up goes to the
+ * workers, finished ones are written out on the way.
+ *
+ * Returns:
+ *  0       success
+ *  -1      more than the image size, or an earlier chunk couldn't be written
+ */
+int archive_add(archive_writer_t *a, const unsigned char *data, size_t len) {
+    struct archive_chunk *c;
+    uint32_t part, at;
+
+    if (len > a->count - a->filled)
+        return -1;
+
+    while (len > 0) {
+        c = &a->chunks[a->filled / ARCHIVE_CHUNK];
+        at = a->filled % ARCHIVE_CHUNK;
+        if (c->in == NULL) {
+            c->ulen = a->count - a->filled < ARCHIVE_CHUNK ? a->count - a->filled : ARCHIVE_CHUNK;
+            c->in = malloc(c->ulen);
+            if (c->in == NULL)
+                err(1, "malloc");
+        }
+
+        part = c->ulen - at < len ? c->ulen - at : len;
+        memcpy(c->in + at, data, part);
+        data += part;
+        len -= part;
+        a->filled += part;
+
+        if (at + part == c->ulen) {
+            pthread_mutex_lock(&a->lock);
+            ++a->queued;
+            pthread_cond_signal(&a->work);
+            pthread_mutex_unlock(&a->lock);
+        }
+    }
+
+    archive_drain(a, 0);
+    return a->error;
+}
+
+/**
+ * Write the remaining chunks and the index, and free the archive. An archive
+ * that didn't get its whole image is left without an index, which readers
+ * refuse.
+ *
+ * Returns:
+ *  0       success
+ *  -1      the image is incomplete or the file couldn't be written
+ */
+int archive_finish(archive_writer_t *a) {
+    uint32_t i, index;
+    int r;
+
+    archive_drain(a, 1);
+    index = a->pos;
+
+    pthread_mutex_lock(&a->lock);
+    a->stop = 1;
+    pthread_cond_broadcast(&a->work);
+    pthread_mutex_unlock(&a->lock);
+    for (i = 0; i < (uint32_t)a->nworkers; ++i)
+        pthread_join(a->workers[i], NULL);
+
+    r = a->error;
+    if (r == 0 && a->filled != a->count)
+        r = -1;
+    if (r == 0 && a->nchunks > 0 && fwrite(a->index, 4 * sizeof(*a->index), a->nchunks, a->file) != a->nchunks)
+        r = -1;
+    if (r == 0 && archive_header(a->file, ARCHIVE_CHUNK, a->count, a->nchunks, index) < 0)
+        r = -1;
+    if (r == 0 && fflush(a->file) != 0)
+        r = -1;
+    if (r < 0 && a->error == 0 && a->filled == a->count)
+        warn("Can't write the archive index");
+
+    for (i = 0; i < a->nchunks; ++i) {
+        free(a->chunks[i].in);
+        free(a->chunks[i].out);
+    }
+    pthread_mutex_destroy(&a->lock);
+    pthread_cond_destroy(&a->work);
+    pthread_cond_destroy(&a->done);
+    free(a->chunks);
+    free(a->index);
+    free(a);
+
+    return r;
+}
+
+/**
+ * Open the archive in file for reading, as checked by archive_is.
+ *
+ * Returns:
+ *  the archive, or NULL if it is damaged or incomplete (already reported)
+ */
+archive_reader_t *archive_open(FILE *file) {
+    archive_reader_t *a;
+    uint32_t words[4], i;
+    char magic[8];
+
+    a = calloc(1, sizeof(*a));
+    if (a == NULL)
+        err(1, "malloc");
+    a->file = file;
+
+    rewind(file);
+    if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, ARCHIVE_MAGIC, sizeof(magic)) != 0 ||
+            fread(words, sizeof(words), 1, file) != 1)
+        goto bad;
+
+    a->chunk = ntohl(words[0]);
+    a->count = ntohl(words[1]);
+    a->nchunks = ntohl(words[2]);
+    if (a->chunk == 0 || a->chunk > ARCHIVE_CHUNK_MAX || ntohl(words[3]) == 0 ||
+            a->nchunks != (a->count + (uint64_t)a->chunk - 1) / a->chunk)
+        goto bad;
+
+    a->index = calloc(a->nchunks + 1, 4 * sizeof(*a->index));
+    a->buf = malloc(a->chunk);
+    a->in = malloc(a->chunk);
+    if (a->index == NULL || a->buf == NULL || a->in == NULL)
+        err(1, "malloc");
+
+    if (fseek(file, ntohl(words[3]), SEEK_SET) != 0 ||
+            fread(a->index, 4 * sizeof(*a->index), a->nchunks, file) != a->nchunks)
+        goto bad;
+    for (i = 0; i < a->nchunks * 4; ++i)
+        a->index[i] = ntohl(a->index[i]);
+
+    return a;
+
+bad:
+    warnx("Damaged or incomplete archive");
+    archive_close(a);
+    return NULL;
+}
+
+/**
+ * Size of the image in an archive.
+ */
+uint32_t archive_size(archive_reader_t *a) {
+    return a->count;
+}
+
+/**
+ * Load the next chunk into buf and check it against its CRC.
+ */
+static int archive_load(archive_reader_t *a) {
+    uint32_t *entry = &a->index[a->next * 4];
+    uint32_t clen = entry[1], ulen = entry[2];
+    uLongf len = ulen;
+
+    if (ulen > a->chunk || clen > ulen)
+        goto bad;
+
+    if (clen == 0) {
+        memset(a->buf, 0xff, ulen);
+    } else {
+        if (fseek(a->file, entry[0], SEEK_SET) != 0 || fread(a->in, clen, 1, a->file) != 1)
+            goto bad;
+        if (clen == ulen)
+            memcpy(a->buf, a->in, ulen);
+        else if (uncompress(a->buf, &len, a->in, clen) != Z_OK || len != ulen)
+            goto bad;
+    }
+
+    if (crc32_update(0, a->buf, ulen) != entry[3])
+        goto bad;
+
+    a->have = ulen;
+    a->used = 0;
+    ++a->next;
+    return 0;
+
+bad:
+    warnx("Chunk %u of the archive is damaged", a->next);
+    return -1;
+}
+
+/**
+ * Read the next len bytes of the image.
+ *
+ * Returns:
+ *  >= 0    bytes read, less than len at the end of the image
+ *  -1      a damaged chunk (already reported)
+ */
+int archive_read(archive_reader_t *a, unsigned char *buf, size_t len) {
+    size_t done = 0, part;
+
+    while (done < len) {
+        if (a->used == a->have) {
+            if (a->next == a->nchunks)
+                break;
+            if (archive_load(a) < 0)
+                return -1;
+        }
+
+        part = a->have - a->used < len - done ? a->have - a->used : len - done;
+        memcpy(buf + done, a->buf + a->used, part);
+        a->used += part;
+        done += part;
+    }
+
+    return done;
+}
+
+/**
+ * Free an archive opened with archive_open. The file stays open.
+ */
+void archive_close(archive_reader_t *a) {
+    free(a->index);
+    free(a->buf);
+    free(a->in);
+    free(a);
+}
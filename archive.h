@@ -0,0 +1,28 @@
+#ifndef __ARCHIVE_H__
+#define __ARCHIVE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+// uncompressed bytes per archive chunk
+#define ARCHIVE_CHUNK 65536
+
+// most threads compressing the chunks of one archive
+#define ARCHIVE_WORKERS 8
+
+typedef struct archive_writer archive_writer_t;
+typedef struct archive_reader archive_reader_t;
+
+int archive_is(FILE *file);
+
+archive_writer_t *archive_create(FILE *file, uint32_t count);
+int archive_add(archive_writer_t *a, const unsigned char *data, size_t len);
+int archive_finish(archive_writer_t *a);
+
+archive_reader_t *archive_open(FILE *file);
+uint32_t archive_size(archive_reader_t *a);
+int archive_read(archive_reader_t *a, unsigned char *buf, size_t len);
+void archive_close(archive_reader_t *a);
+
+#endif /* __ARCHIVE_H__ */
+// vim: ft=c
@@ -0,0 +1,364 @@
+#include <err.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ems.h"
+
+#define SRAM_SIZE 0x020000
+
+// bytes of protocol header in front of every command
+#define CMD_SIZE 9
+
+#define MAX_GRID 32
+
+// output formats
+#define FORMAT_TABLE 0
+#define FORMAT_CSV   1
+#define FORMAT_JSON  2
+
+/* options */
+typedef struct _options_t {
+    char *device;
+    int sizes[MAX_GRID];
+    int nsizes;
+    int depths[MAX_GRID];
+    int ndepths;
+    int bytes;
+    int format;
+    int write;
+} options_t;
+
+// defaults
+options_t opts = {
+    .device     = NULL,
+    .sizes      = { 32, 64, 256, 1024, 4096, 16384 },
+    .nsizes     = 6,
+    .depths     = { 1, 2, 4, 8, 16 },
+    .ndepths    = 5,
+    .bytes      = 0x10000,
+    .format     = FORMAT_TABLE,
+    .write      = 1,
+};
+
+/* one cell of the grid */
+typedef struct _result_t {
+    const char *op;             // "read" or "write"
+    const char *mode;           // "sync" or "async"
+    int blocksize;
+    int depth;
+    int bytes;
+    int error;                  // libusb error, 0 on success
+    double seconds;
+    double p50, p90, p99, max;  // per block latency in microseconds
+} result_t;
+
+/* per block timestamps, filled by the block callback */
+typedef struct _timing_t {
+    double *lat;
+    int nblocks;
+    double last;
+} timing_t;
+
+/**
+ * Usage
+ */
+void usage(char *name) {
+    printf("Usage: %s [options]\n", name);
+    printf("Benchmarks transfers to and from the EMS cart's SRAM. SRAM is backed up\n");
+    printf("first and restored afterwards, flash is never touched.\n\n");
+    printf("Options:\n");
+    printf("    --device <id>           cart at <bus:port> or with serial <id>, sim for a simulated one\n");
+    printf("    --sizes <n,n,...>       block sizes (default: 32,64,256,1024,4096,16384)\n");
+    printf("    --depths <n,n,...>      async queue depths (default: 1,2,4,8,16)\n");
+    printf("    --bytes <num>           bytes transferred per run (default: 65536)\n");
+    printf("    --no-write              only benchmark reads\n");
+    printf("    --csv                   comma separated output\n");
+    printf("    --json                  one JSON object per line\n");
+    exit(1);
+}
+
+/**
+ * Parse a comma separated list of positive numbers.
+ *
+ * Returns:
+ *  number of entries, exits on a malformed list
+ */
+int parse_list(char *name, const char *arg, int *list) {
+    const char *p = arg;
+    char *end;
+    int n = 0;
+
+    while (*p != '\0') {
+        long v = strtol(p, &end, 0);
+        if (end == p || v <= 0 || n == MAX_GRID || (*end != ',' && *end != '\0')) {
+            printf("Error: bad list '%s'\n", arg);
+            usage(name);
+        }
+        list[n++] = v;
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    return n;
+}
+
+/**
+ * Get the options to the binary. Options are stored in the global "opts".
+ */
+void get_options(int argc, char **argv) {
+    int c;
+
+    while (1) {
+        int option_index = 0;
+        static struct option long_options[] = {
+            {"help", 0, 0, 'h'},
+            {"device", 1, 0, 'i'},
+            {"sizes", 1, 0, 's'},
+            {"depths", 1, 0, 'd'},
+            {"bytes", 1, 0, 'n'},
+            {"no-write", 0, 0, 'W'},
+            {"csv", 0, 0, 'C'},
+            {"json", 0, 0, 'J'},
+            {0, 0, 0, 0}
+        };
+
+        c = getopt_long(argc, argv, "h", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'i':
+                opts.device = optarg;
+                break;
+            case 's':
+                opts.nsizes = parse_list(argv[0], optarg, opts.sizes);
+                break;
+            case 'd':
+                opts.ndepths = parse_list(argv[0], optarg, opts.depths);
+                break;
+            case 'n':
+                opts.bytes = atoi(optarg);
+                if (opts.bytes <= 0 || opts.bytes > SRAM_SIZE) {
+                    printf("Error: bytes must be between 1 and %d\n", SRAM_SIZE);
+                    usage(argv[0]);
+                }
+                break;
+            case 'W':
+                opts.write = 0;
+                break;
+            case 'C':
+                opts.format = FORMAT_CSV;
+                break;
+            case 'J':
+                opts.format = FORMAT_JSON;
+                break;
+            default:
+                usage(argv[0]);
+                break;
+        }
+    }
+}
+
+/**
+ * Monotonic clock in seconds.
+ */
+double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Block callback: time since the previous block finished. With several
+ * blocks in flight this is the cost per block the pipeline achieves.
+ */
+int time_block(uint32_t offset, unsigned char *buf, size_t count, void *arg) {
+    timing_t *t = arg;
+    double tn = now();
+
+    t->lat[t->nblocks++] = (tn - t->last) * 1e6;
+    t->last = tn;
+    return 0;
+}
+
+int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Fill in the latency percentiles of a run.
+ */
+void percentiles(result_t *res, timing_t *t) {
+    if (t->nblocks == 0)
+        return;
+
+    qsort(t->lat, t->nblocks, sizeof(double), cmp_double);
+    res->p50 = t->lat[t->nblocks * 50 / 100];
+    res->p90 = t->lat[t->nblocks * 90 / 100];
+    res->p99 = t->lat[t->nblocks * 99 / 100];
+    res->max = t->lat[t->nblocks - 1];
+}
+
+/**
+ * Run one grid cell. Sync runs issue one ems_read/ems_write per block, async
+ * runs go through the pipelined calls at the given depth.
+ */
+void run(ems_dev_t *dev, result_t *res, unsigned char *buf, unsigned char *pattern) {
+    int bs = res->blocksize, pos, len, r = 0;
+    int nblocks = (res->bytes + bs - 1) / bs;
+    timing_t t;
+
+    t.lat = malloc(nblocks * sizeof(double));
+    if (t.lat == NULL)
+        err(1, "malloc");
+    t.nblocks = 0;
+
+    res->seconds = t.last = now();
+    if (strcmp(res->mode, "sync") == 0) {
+        for (pos = 0; pos < res->bytes && r >= 0; pos += len) {
+            len = res->bytes - pos < bs ? res->bytes - pos : bs;
+            if (strcmp(res->op, "read") == 0)
+                r = ems_read(dev, FROM_SRAM, pos, buf + pos, len);
+            else
+                r = ems_write(dev, TO_SRAM, pos, pattern + pos, len);
+            if (r >= 0)
+                time_block(pos, buf + pos, len, &t);
+        }
+    } else if (strcmp(res->op, "read") == 0) {
+        r = ems_read_async(dev, FROM_SRAM, 0, buf, res->bytes, bs, res->depth, time_block, &t);
+    } else {
+        r = ems_write_pool(dev, res->depth, bs);
+        if (r >= 0)
+            r = ems_write_async(dev, TO_SRAM, 0, pattern, res->bytes, bs, time_block, &t);
+    }
+    res->seconds = now() - res->seconds;
+    res->error = r < 0 ? r : 0;
+
+    percentiles(res, &t);
+    free(t.lat);
+}
+
+/**
+ * Print one result in the selected format.
+ */
+void report(result_t *res) {
+    int nblocks = (res->bytes + res->blocksize - 1) / res->blocksize;
+    double mbs = res->bytes / res->seconds / 1e6;
+    // command header bytes on the wire per payload byte
+    double overhead = (double)nblocks * CMD_SIZE / res->bytes * 100;
+    int transfers = nblocks * (strcmp(res->op, "read") == 0 ? 2 : 1);
+
+    switch (opts.format) {
+        case FORMAT_CSV:
+            printf("%s,%s,%d,%d,%d,%d,%.6f,%.3f,%.1f,%.1f,%.1f,%.1f,%d,%.2f\n",
+                    res->op, res->mode, res->blocksize, res->depth, res->bytes,
+                    res->error, res->seconds, mbs, res->p50, res->p90, res->p99,
+                    res->max, transfers, overhead);
+            break;
+        case FORMAT_JSON:
+            printf("{\"op\":\"%s\",\"mode\":\"%s\",\"blocksize\":%d,\"depth\":%d,"
+                    "\"bytes\":%d,\"error\":%d,\"seconds\":%.6f,\"mbps\":%.3f,"
+                    "\"latency_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f},"
+                    "\"transfers\":%d,\"overhead_pct\":%.2f}\n",
+                    res->op, res->mode, res->blocksize, res->depth, res->bytes,
+                    res->error, res->seconds, mbs, res->p50, res->p90, res->p99,
+                    res->max, transfers, overhead);
+            break;
+        default:
+            if (res->error != 0) {
+                printf("%-5s %-5s %6d %5d  error %d\n", res->op, res->mode,
+                        res->blocksize, res->depth, res->error);
+                break;
+            }
+            printf("%-5s %-5s %6d %5d %9.3f %9.1f %9.1f %9.1f %9d %8.2f%%\n",
+                    res->op, res->mode, res->blocksize, res->depth, mbs,
+                    res->p50, res->p90, res->p99, transfers, overhead);
+            break;
+    }
+}
+
+/**
+ * Print the column names.
+ */
+void report_header(void) {
+    if (opts.format == FORMAT_CSV)
+        printf("op,mode,blocksize,depth,bytes,error,seconds,mbps,p50_us,p90_us,p99_us,max_us,transfers,overhead_pct\n");
+    else if (opts.format == FORMAT_TABLE)
+        printf("%-5s %-5s %6s %5s %9s %9s %9s %9s %9s %9s\n", "op", "mode",
+                "block", "depth", "MB/s", "p50 us", "p90 us", "p99 us", "xfers", "overhead");
+}
+
+/**
+ * Main
+ */
+int main(int argc, char **argv) {
+    unsigned char *backup, *buf, *pattern;
+    int i, j, k, r, ops;
+    result_t res;
+
+    get_options(argc, argv);
+
+    r = ems_init();
+    if (r < 0)
+        errx(1, "Can't initialize libusb: %s", ems_strerror(r));
+    atexit(ems_exit);
+
+    ems_dev_t *dev;
+    r = ems_open(opts.device, &dev);
+    if (r < 0)
+        errx(1, "Could not find/open device (%s), is it plugged in?", ems_strerror(r));
+
+    backup = malloc(SRAM_SIZE);
+    buf = malloc(SRAM_SIZE);
+    pattern = malloc(SRAM_SIZE);
+    if (backup == NULL || buf == NULL || pattern == NULL)
+        err(1, "malloc");
+
+    r = ems_read_async(dev, FROM_SRAM, 0, backup, SRAM_SIZE, 4096, EMS_QUEUE_DEPTH, NULL, NULL);
+    if (r != SRAM_SIZE)
+        errx(1, "Can't back up SRAM");
+    for (i = 0; i < SRAM_SIZE; ++i)
+        pattern[i] = ~backup[i];
+
+    report_header();
+
+    ops = opts.write ? 2 : 1;
+    for (k = 0; k < ops; ++k) {
+        for (i = 0; i < opts.nsizes; ++i) {
+            memset(&res, 0, sizeof(res));
+            res.op = k == 0 ? "read" : "write";
+            res.blocksize = opts.sizes[i];
+            res.bytes = opts.bytes;
+
+            // sync once per size, then async at every depth
+            res.mode = "sync";
+            res.depth = 1;
+            run(dev, &res, buf, pattern);
+            report(&res);
+
+            for (j = 0; j < opts.ndepths; ++j) {
+                res.mode = "async";
+                res.depth = opts.depths[j];
+                run(dev, &res, buf, pattern);
+                report(&res);
+            }
+        }
+    }
+
+    if (opts.write) {
+        r = ems_write_async(dev, TO_SRAM, 0, backup, SRAM_SIZE, 32, NULL, NULL);
+        if (r == SRAM_SIZE)
+            r = ems_read_async(dev, FROM_SRAM, 0, buf, SRAM_SIZE, 4096, EMS_QUEUE_DEPTH, NULL, NULL);
+        if (r != SRAM_SIZE || memcmp(buf, backup, SRAM_SIZE) != 0)
+            errx(1, "Couldn't restore SRAM!");
+    }
+
+    free(backup);
+    free(buf);
+    free(pattern);
+    return 0;
+}
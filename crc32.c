@@ -0,0 +1,63 @@
+#include <pthread.h>
+
+#include "crc32.h"
+
+// reflected CRC-32 polynomial, as used by zip, PNG and zlib
+#define CRC32_POLY 0xEDB88320
+
+/*
+ * Slicing-by-8 tables: crc_table[0] is the classic byte table, crc_table[k]
+ * advances a byte through k more zero bytes. Eight bytes are then folded in
+ * with eight independent lookups instead of a serial chain of eight.
+ */
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init(void) {
+    uint32_t c;
+    int i, j, k;
+
+    for (i = 0; i < 256; ++i) {
+        c = i;
+        for (j = 0; j < 8; ++j)
+            c = c & 1 ? (c >> 1) ^ CRC32_POLY : c >> 1;
+        crc_table[0][i] = c;
+    }
+
+    for (i = 0; i < 256; ++i)
+        for (k = 1; k < 8; ++k)
+            crc_table[k][i] = (crc_table[k - 1][i] >> 8) ^ crc_table[0][crc_table[k - 1][i] & 0xff];
+}
+
+/**
+ * Add len bytes to a running CRC-32. Start with crc 0; the result of one call
+ * is the crc for the next, so data can be hashed in pieces as it arrives.
+ * Same values as zlib's crc32().
+ */
+uint32_t crc32_update(uint32_t crc, const unsigned char *buf, size_t len) {
+    uint32_t lo, hi;
+
+    pthread_once(&crc_once, crc32_init);
+
+    crc = ~crc;
+
+    while (len >= 8) {
+        // assembled bytewise, so any alignment and host byte order works
+        lo = buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t)buf[3] << 24;
+        hi = buf[4] | buf[5] << 8 | buf[6] << 16 | (uint32_t)buf[7] << 24;
+        lo ^= crc;
+        crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+              crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+              crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+        buf += 8;
+        len -= 8;
+    }
+
+    while (len > 0) {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *buf++) & 0xff];
+        --len;
+    }
+
+    return ~crc;
+}
@@ -0,0 +1,10 @@
+#ifndef __CRC32_H__
+#define __CRC32_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t crc32_update(uint32_t crc, const unsigned char *buf, size_t len);
+
+#endif /* __CRC32_H__ */
+// vim: ft=c
@@ -0,0 +1,264 @@
+/*
+ * Socket protocol between ems-flasher --serve, which keeps a cart claimed,
+ * and ems-flasher --connect, which hands it jobs.
+ *
+ * A client sends its working directory, the number of its arguments in
+ * decimal and then the arguments, each as a NUL terminated string, so an
+ * argument can be empty. The daemon runs the job as if it had been started
+ * with those arguments in that directory and sends back everything it
+ * prints, followed by a NUL byte and the job's exit status as one more
+ * byte. Files are opened by the daemon itself, so ROM images never travel
+ * over the socket.
+ *
+ * Jobs run with the daemon's rights, so the socket is only open to its
+ * owner and clients running as anyone else are turned away.
+ */
+#define _GNU_SOURCE     // struct ucred
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+
+/**
+ * Fill in the address of the socket at path.
+ *
+ * Returns:
+ *  0 on success, -1 if path is too long
+ */
+static int daemon_addr(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        warnx("Socket path %s is too long", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/**
+ * Write all of len bytes.
+ */
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    ssize_t r;
+
+    while (len > 0) {
+        r = write(fd, p, len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+/**
+ * Uid of the process at the other end of conn.
+ *
+ * Returns:
+ *  0 on success, -1 if the system won't tell
+ */
+static int daemon_peer_uid(int conn, uid_t *uid) {
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+        return -1;
+    *uid = cred.uid;
+    return 0;
+#else
+    gid_t gid;
+
+    return getpeereid(conn, uid, &gid);
+#endif
+}
+
+/**
+ * Create the daemon's listening socket at path, only open to the user
+ * running it, replacing a stale one. Anything at path that isn't a socket
+ * is left alone.
+ *
+ * Returns:
+ *  socket fd, -1 on failure (already reported)
+ */
+int daemon_listen(const char *path) {
+    struct sockaddr_un addr;
+    struct stat st;
+    mode_t mask;
+    int sock, r;
+
+    if (daemon_addr(&addr, path) < 0)
+        return -1;
+
+    if (lstat(path, &st) == 0 && !S_ISSOCK(st.st_mode)) {
+        warnx("%s exists and isn't a socket, not replacing it", path);
+        return -1;
+    }
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        warn("socket");
+        return -1;
+    }
+
+    unlink(path);
+    mask = umask(0177);
+    r = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (r < 0 || chmod(path, 0600) < 0 || listen(sock, 8) < 0) {
+        warn("Can't listen on %s", path);
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/**
+ * Receive a job from a freshly accepted client, which has to be running as
+ * the same user as the daemon. A client that doesn't send it all within
+ * DAEMON_TIMEOUT seconds is given up on, so it can't hold up the daemon.
+ *
+ * Returns:
+ *  0 on success, -1 on a short, late or malformed request or another user's
+ */
+int daemon_read_job(int conn, daemon_job_t *job) {
+    struct timeval tv = { DAEMON_TIMEOUT, 0 };
+    size_t len = 0, scanned = 0, strings = 0, want = 3;
+    long argc;
+    ssize_t r;
+    char *p, *end;
+    uid_t uid;
+
+    if (daemon_peer_uid(conn, &uid) < 0 || uid != geteuid()) {
+        warnx("Turning away a client that isn't running as this user");
+        return -1;
+    }
+    if (setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+        return -1;
+
+    // read until the last argument the count promised, there is at least one
+    while (strings < want) {
+        if (len == sizeof(job->buf))
+            return -1;
+        r = read(conn, job->buf + len, sizeof(job->buf) - len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        len += r;
+
+        for (; scanned < len; ++scanned) {
+            if (job->buf[scanned] != '\0' || ++strings != 2)
+                continue;
+            p = job->buf + strlen(job->buf) + 1;
+            argc = strtol(p, &end, 10);
+            if (*p == '\0' || *end != '\0' || argc < 1 || argc > DAEMON_MAX_ARGS)
+                return -1;
+            want = 2 + argc;
+        }
+    }
+    if (strings > want)
+        return -1;
+
+    job->cwd = job->buf;
+    p = job->cwd + strlen(job->cwd) + 1;
+    job->argc = strtol(p, NULL, 10);
+    for (argc = 0; argc < job->argc; ++argc) {
+        p += strlen(p) + 1;
+        job->argv[argc] = p;
+    }
+    job->argv[job->argc] = NULL;
+
+    return 0;
+}
+
+/**
+ * Tell the client the job is done and how it went.
+ */
+void daemon_finish_job(int conn, int status) {
+    unsigned char end[2] = { 0, status };
+
+    write_all(conn, end, sizeof(end));
+}
+
+/**
+ * Client side: run a job on the daemon at path and copy its output to
+ * stdout.
+ *
+ * Returns:
+ *  the job's exit status, 1 if the daemon can't be reached
+ */
+int daemon_submit(const char *path, int argc, char **argv) {
+    struct sockaddr_un addr;
+    char cwd[PATH_MAX], buf[4096], count[16], *end;
+    int sock, i;
+    ssize_t r;
+
+    if (daemon_addr(&addr, path) < 0)
+        return 1;
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        warn("getcwd");
+        return 1;
+    }
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        warn("Can't connect to daemon at %s", path);
+        if (sock >= 0)
+            close(sock);
+        return 1;
+    }
+
+    snprintf(count, sizeof(count), "%d", argc);
+    r = write_all(sock, cwd, strlen(cwd) + 1);
+    if (r == 0)
+        r = write_all(sock, count, strlen(count) + 1);
+    for (i = 0; r == 0 && i < argc; ++i)
+        r = write_all(sock, argv[i], strlen(argv[i]) + 1);
+    if (r < 0) {
+        warn("Can't send job to daemon");
+        close(sock);
+        return 1;
+    }
+
+    while ((r = read(sock, buf, sizeof(buf))) > 0 || (r < 0 && errno == EINTR)) {
+        if (r < 0)
+            continue;
+
+        end = memchr(buf, '\0', r);
+        fwrite(buf, 1, end != NULL ? end - buf : r, stdout);
+        if (end == NULL)
+            continue;
+
+        // the status byte may come in the next read
+        if (end + 1 < buf + r) {
+            i = (unsigned char)end[1];
+        } else if (read(sock, buf, 1) == 1) {
+            i = (unsigned char)buf[0];
+        } else {
+            break;
+        }
+        close(sock);
+        return i;
+    }
+
+    warnx("Daemon hung up before the job was done");
+    close(sock);
+    return 1;
+}
@@ -0,0 +1,27 @@
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+// largest job request, working directory and arguments included
+#define DAEMON_MAX_JOB 65536
+
+// most arguments a job can have
+#define DAEMON_MAX_ARGS 256
+
+// seconds a client has to send its whole job
+#define DAEMON_TIMEOUT 2
+
+/* one job as handed over by a client */
+typedef struct _daemon_job_t {
+    char *cwd;                  // client's working directory
+    int argc;
+    char *argv[DAEMON_MAX_ARGS + 1];
+    char buf[DAEMON_MAX_JOB];   // the strings above point in here
+} daemon_job_t;
+
+int daemon_listen(const char *path);
+int daemon_read_job(int conn, daemon_job_t *job);
+void daemon_finish_job(int conn, int status);
+int daemon_submit(const char *path, int argc, char **argv);
+
+#endif /* __DAEMON_H__ */
+// vim: ft=c
@@ -1,154 +1,1545 @@
 #include <assert.h>
-#include <err.h>
 #include <errno.h>
+#include <pthread.h>
 #include <signal.h>
-#include <stdio.h> // FIXME this will (probably) go away with error coes
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h> /* for htonl */
 
 #include <libusb.h>
 
 #include "ems.h"
+#include "transport.h"
 
 /* magic numbers! */
 #define EMS_VID 0x4670
 #define EMS_PID 0x9394
 
+// endpoints used when the descriptors don't name bulk endpoints
 #define EMS_EP_SEND (2 | LIBUSB_ENDPOINT_OUT)
 #define EMS_EP_RECV (1 | LIBUSB_ENDPOINT_IN)
 
-enum {
-    CMD_READ    = 0xff,
-    CMD_WRITE   = 0x57,
-    CMD_READ_SRAM   = 0x6d,
-    CMD_WRITE_SRAM  = 0x4d,
+// ems_probe tries reads from EMS_PROBE_MIN, known to work, doubling up to
+// EMS_PROBE_MAX; one the firmware ignores times out after EMS_PROBE_TIMEOUT ms
+#define EMS_PROBE_MIN       4096
+#define EMS_PROBE_MAX       65536
+#define EMS_PROBE_TIMEOUT   200
+
+// a read error within this many blocks of the previous one halves the blocksize
+#define EMS_ERROR_CLUSTER 32
+
+// after an error, stale read data is drained in reads of this size until
+// none arrives for EMS_DRAIN_TIMEOUT ms, at most EMS_DRAIN_MAX times
+#define EMS_DRAIN_SIZE      65536
+#define EMS_DRAIN_TIMEOUT   20
+#define EMS_DRAIN_MAX       64
+
+struct ems_queue;
+
+/**
+ * One block of a pipelined transfer. Reads use both transfers (command out,
+ * data in), writes only send the command+payload in cmd.
+ */
+struct ems_slot {
+    struct ems_queue *q;    // queue this slot belongs to
+    struct libusb_transfer *cmd;
+    struct libusb_transfer *data;
+    unsigned char *buf;     // command buffer, 9 + blocksize bytes for writes
+    uint32_t offset;        // cart address of this block
+    unsigned char *dst;     // reads only: where the block's data lands
+    int extent;             // reads only: extent the block belongs to
+    size_t len;             // length of this block's payload, for writes of
+                            // every command+payload record packed into buf
+    int outstanding;        // transfers submitted but not yet completed
+    int done;               // set once every transfer of this block is back
+    int status;             // 0 or libusb error code
+    int retries;            // times this block was sent before
+    ems_block_cb cb;        // write pool only: called when the slot retires
+    void *arg;
+    uint64_t start[2];      // submit time of cmd and data, when tracing
+};
+
+/**
+ * State shared by all slots of a pipelined transfer.
+ */
+struct ems_queue {
+    ems_dev_t *dev;
+    struct ems_slot *slots;
+    int depth;
+    size_t blocksize;       // largest payload a slot can hold
+    int inflight;           // total transfers submitted but not completed
+    int error;              // first error seen, stops further submissions
+    size_t head;            // write pool only: next slot to hand out
+    size_t tail;            // write pool only: oldest slot not yet retired
+    size_t fill;            // write pool only: bytes packed into the head
+                            // slot that haven't been sent yet
+};
+
+/**
+ * Trace state of a device, only allocated while tracing is enabled.
+ */
+struct ems_trace {
+    ems_trace_event_t *ring;
+    size_t size;            // capacity of ring, may be 0 with a callback
+    size_t head;            // next slot to record into
+    size_t count;           // events in ring not drained yet
+    ems_trace_cb cb;
+    void *arg;
+    ems_stats_t stats;
+};
+
+/**
+ * An open, claimed cart.
+ */
+struct ems_dev {
+    struct libusb_device_handle *devh;  // NULL for a simulated cart
+    const ems_transport_t *transport;
+    void *link;             // the transport's own state
+    ems_devinfo_t info;
+
+    /*
+     * Write pool: a ring of command+payload buffers, each with the 9 byte
+     * command header slot in front of the payload. Callers fill the payload
+     * in place, so the write path never allocates or copies per block.
+     */
+    struct ems_queue wpool;
+    size_t batch;           // bytes packed into one bulk write, 0 for none
+
+    struct ems_trace *trace; // NULL unless tracing
+    ems_policy_t policy;
+    ems_caps_t caps;
+
+    struct ems_dev *next;   // list of open devices, closed by the last ems_exit
 };
 
-static struct libusb_device_handle *devh = NULL;
-static int claimed = 0;
+/**
+ * One ems_hotplug registration, libusb hands it back to ems_hotplug_event.
+ */
+struct ems_hotplug {
+    ems_hotplug_cb cb;
+    void *arg;
+    struct ems_hotplug *next; // list of registrations, freed by the last ems_exit
+};
+
+// the library may be used from several threads, open_lock guards these
+static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ems_dev *open_devs = NULL;
+static struct ems_hotplug *hotplugs = NULL;
+static int init_count = 0;
+
+static const ems_policy_t ems_default_policy = {
+    .command_timeout    = EMS_TIMEOUT_COMMAND,
+    .data_timeout       = EMS_TIMEOUT_DATA,
+    .retries            = EMS_RETRIES,
+    .backoff            = EMS_BACKOFF,
+    .min_blocksize      = EMS_MIN_BLOCKSIZE,
+};
+
+static void ems_pool_free(ems_dev_t *dev);
+
+static int usb_bulk(void *link, unsigned char ep, unsigned char *buf, int len,
+        int *transferred, unsigned int timeout) {
+    return libusb_bulk_transfer(link, ep, buf, len, transferred, timeout);
+}
+
+static int usb_submit(void *link, struct libusb_transfer *xfer) {
+    return libusb_submit_transfer(xfer);
+}
+
+static int usb_cancel(void *link, struct libusb_transfer *xfer) {
+    return libusb_cancel_transfer(xfer);
+}
+
+static int usb_wait(void *link, int *completed) {
+    return completed != NULL ? libusb_handle_events_completed(NULL, completed) : libusb_handle_events(NULL);
+}
+
+static int usb_clear_halt(void *link, unsigned char ep) {
+    return libusb_clear_halt(link, ep);
+}
+
+static void usb_close(void *link) {
+    libusb_release_interface(link, 0);
+    libusb_close(link);
+}
+
+/* a cart on the bus */
+static const ems_transport_t usb_transport = {
+    .bulk       = usb_bulk,
+    .submit     = usb_submit,
+    .cancel     = usb_cancel,
+    .wait       = usb_wait,
+    .clear_halt = usb_clear_halt,
+    .close      = usb_close,
+};
+
+/**
+ * Fill in what identifies a cart on the bus. The serial number needs the
+ * device opened, so it stays empty when handle is NULL.
+ */
+static void ems_describe(libusb_device *device, libusb_device_handle *handle,
+        struct libusb_device_descriptor *desc, ems_devinfo_t *info) {
+    memset(info, 0, sizeof(*info));
+    info->bus = libusb_get_bus_number(device);
+    info->port = libusb_get_port_number(device);
+    info->address = libusb_get_device_address(device);
+
+    if (handle != NULL && desc->iSerialNumber != 0)
+        libusb_get_string_descriptor_ascii(handle, desc->iSerialNumber,
+                (unsigned char *)info->serial, sizeof(info->serial));
+}
+
+/**
+ * Does a cart match the id given to ems_open? The id is either "bus:port" or
+ * a serial number. NULL matches any cart.
+ */
+static int ems_match(const ems_devinfo_t *info, const char *id) {
+    unsigned int bus, port;
+    char end;
+
+    if (id == NULL)
+        return 1;
+    if (sscanf(id, "%u:%u%c", &bus, &port, &end) == 2)
+        return info->bus == bus && info->port == port;
+    return info->serial[0] != '\0' && strcmp(info->serial, id) == 0;
+}
+
+/**
+ * Walk the bus for EMS carts by vid/pid. If want is not NULL, open and claim
+ * the first cart matching it.
+ *
+ * Returns:
+ *  >= 0    number of carts seen
+ *  < 0     failure enumerating the bus
+ */
+static int ems_scan(ems_devinfo_t *infos, int max, const char *want, ems_dev_t **found) {
+    libusb_device **list;
+    ssize_t n, i;
+    int count = 0;
+
+    n = libusb_get_device_list(NULL, &list);
+    if (n < 0)
+        return n;
+
+    for (i = 0; i < n; ++i) {
+        struct libusb_device_descriptor desc;
+        libusb_device_handle *handle = NULL;
+        ems_devinfo_t info;
+
+        if (libusb_get_device_descriptor(list[i], &desc) < 0 ||
+                desc.idVendor != EMS_VID || desc.idProduct != EMS_PID)
+            continue;
+
+        if (libusb_open(list[i], &handle) < 0)
+            handle = NULL;
+        ems_describe(list[i], handle, &desc, &info);
+
+        if (count < max)
+            infos[count] = info;
+        ++count;
+
+        if (found != NULL && *found == NULL && handle != NULL && ems_match(&info, want)) {
+            ems_dev_t *dev = calloc(1, sizeof(*dev));
+            if (dev != NULL) {
+                dev->devh = handle;
+                dev->info = info;
+                dev->policy = ems_default_policy;
+                *found = dev;
+                continue;
+            }
+        }
+
+        if (handle != NULL)
+            libusb_close(handle);
+    }
+
+    libusb_free_device_list(list, 1);
+    return count;
+}
+
+/**
+ * Init the library. Every user of it calls this once, and ems_exit when done
+ * with it, so a program and a library it links can both use carts.
+ *
+ * Returns:
+ *  0       Success
+ *  < 0     libusb error, libusb can't be initialized
+ */
+int ems_init(void) {
+    int r = 0;
+
+    // libusb is set up by the first user and torn down by the last
+    pthread_mutex_lock(&open_lock);
+    if (init_count == 0)
+        r = libusb_init(NULL);
+    if (r == 0)
+        ++init_count;
+    pthread_mutex_unlock(&open_lock);
+    return r;
+}
+
+/**
+ * Done with the library. The last ems_exit releases every cart still open
+ * and libusb; one without a successful ems_init does nothing.
+ */
+void ems_exit(void) {
+    int last;
+
+    pthread_mutex_lock(&open_lock);
+    last = init_count > 0 && --init_count == 0;
+    pthread_mutex_unlock(&open_lock);
+
+    if (!last)
+        return;
+
+    while (open_devs != NULL)
+        ems_close(open_devs);
+
+    libusb_exit(NULL);
+
+    // libusb is gone, and with it the callbacks that pointed at these
+    while (hotplugs != NULL) {
+        struct ems_hotplug *reg = hotplugs;
+
+        hotplugs = reg->next;
+        free(reg);
+    }
+}
+
+/**
+ * Describe an error code returned by the library.
+ */
+const char *ems_strerror(int error) {
+    return libusb_error_name(error);
+}
+
+/**
+ * List the EMS carts attached to the system.
+ *
+ * Params:
+ *  info    filled with up to max entries
+ *  max     size of info
+ *
+ * Returns:
+ *  >= 0    number of carts found, may be more than max
+ *  < 0     failure enumerating the bus
+ */
+int ems_list(ems_devinfo_t *info, int max) {
+    return ems_scan(info, max, NULL, NULL);
+}
+
+/**
+ * Is dev the cart id names? id is "bus:port" or a serial number as given to
+ * ems_open, NULL matches any cart.
+ */
+int ems_is(ems_dev_t *dev, const char *id) {
+    return ems_match(&dev->info, id);
+}
+
+/**
+ * libusb hotplug callback: describe the cart and pass the event on. The device
+ * isn't opened here, so the serial number is left empty.
+ */
+static int LIBUSB_CALL ems_hotplug_event(libusb_context *ctx, libusb_device *device,
+        libusb_hotplug_event event, void *arg) {
+    struct ems_hotplug *reg = arg;
+    struct libusb_device_descriptor desc;
+    ems_devinfo_t info;
+
+    if (libusb_get_device_descriptor(device, &desc) < 0)
+        return 0;
+    ems_describe(device, NULL, &desc, &info);
+
+    reg->cb(&info, event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, reg->arg);
+    return 0;
+}
+
+/**
+ * Get told about carts being plugged in and unplugged. Carts attached
+ * already are reported as arrived right away. Later events are delivered
+ * from whatever thread handles libusb events, see ems_handle_events.
+ *
+ * Params:
+ *  cb      called with arrived 1 for a new cart, 0 for one that went away
+ *  arg     passed to cb
+ *
+ * Returns:
+ *  0       success
+ *  < 0     libusb error, LIBUSB_ERROR_NOT_SUPPORTED without hotplug support
+ */
+int ems_hotplug(ems_hotplug_cb cb, void *arg) {
+    struct ems_hotplug *reg;
+    int r;
+
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+        return LIBUSB_ERROR_NOT_SUPPORTED;
+
+    reg = malloc(sizeof(*reg));
+    if (reg == NULL)
+        return LIBUSB_ERROR_NO_MEM;
+    reg->cb = cb;
+    reg->arg = arg;
+
+    // carts attached already are reported from in here, reg has to be set
+    r = libusb_hotplug_register_callback(NULL,
+            LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+            LIBUSB_HOTPLUG_ENUMERATE, EMS_VID, EMS_PID, LIBUSB_HOTPLUG_MATCH_ANY,
+            ems_hotplug_event, reg, NULL);
+    if (r < 0) {
+        free(reg);
+        return r;
+    }
+
+    pthread_mutex_lock(&open_lock);
+    reg->next = hotplugs;
+    hotplugs = reg;
+    pthread_mutex_unlock(&open_lock);
+    return 0;
+}
+
+/**
+ * Handle pending libusb events, hotplug events among them, waiting up to
+ * timeout_ms for one to come in.
+ *
+ * Returns:
+ *  0 or a libusb error code
+ */
+int ems_handle_events(int timeout_ms) {
+    struct timeval tv = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+
+    return libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+}
+
+/**
+ * Find what the link of a freshly opened cart can do: its speed, and the
+ * bulk endpoints of the interface and their packet sizes.
+ */
+static void ems_discover(ems_dev_t *dev) {
+    libusb_device *device = libusb_get_device(dev->devh);
+    struct libusb_config_descriptor *config;
+    const struct libusb_interface_descriptor *alt;
+    const struct libusb_endpoint_descriptor *ep;
+    int i;
+
+    dev->caps.ep_out = EMS_EP_SEND;
+    dev->caps.ep_in = EMS_EP_RECV;
+    dev->caps.sector = EMS_SECTOR;
+
+    switch (libusb_get_device_speed(device)) {
+        case LIBUSB_SPEED_LOW:   dev->caps.speed = 1500; break;
+        case LIBUSB_SPEED_FULL:  dev->caps.speed = 12000; break;
+        case LIBUSB_SPEED_HIGH:  dev->caps.speed = 480000; break;
+        case LIBUSB_SPEED_SUPER: dev->caps.speed = 5000000; break;
+        default:                 dev->caps.speed = 0; break;
+    }
+
+    if (libusb_get_active_config_descriptor(device, &config) < 0)
+        return;
+
+    if (config->bNumInterfaces > 0 && config->interface[0].num_altsetting > 0) {
+        alt = &config->interface[0].altsetting[0];
+        for (i = 0; i < alt->bNumEndpoints; ++i) {
+            ep = &alt->endpoint[i];
+            if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_BULK)
+                continue;
+
+            // the low 11 bits are the packet size, the rest is for high
+            // bandwidth isochronous endpoints
+            if ((ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN &&
+                    dev->caps.packet_in == 0) {
+                dev->caps.ep_in = ep->bEndpointAddress;
+                dev->caps.packet_in = ep->wMaxPacketSize & 0x7ff;
+            } else if ((ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT &&
+                    dev->caps.packet_out == 0) {
+                dev->caps.ep_out = ep->bEndpointAddress;
+                dev->caps.packet_out = ep->wMaxPacketSize & 0x7ff;
+            }
+        }
+    }
+
+    libusb_free_config_descriptor(config);
+}
+
+/**
+ * What the link of a cart can do, as found and probed when it was opened.
+ */
+void ems_get_caps(ems_dev_t *dev, ems_caps_t *caps) {
+    *caps = dev->caps;
+}
+
+/**
+ * Open a simulated cart, see sim.c, and add it to the open devices.
+ */
+static int ems_open_sim(const char *id, ems_dev_t **devp) {
+    const char *spec = id[strlen(EMS_SIM)] == ':' ? id + strlen(EMS_SIM) + 1 : "";
+    ems_dev_t *dev = calloc(1, sizeof(*dev));
+    int r;
+
+    if (dev == NULL)
+        return LIBUSB_ERROR_NO_MEM;
+
+    r = sim_open(spec, &dev->link);
+    if (r < 0) {
+        free(dev);
+        return r;
+    }
+    dev->transport = &sim_transport;
+    dev->policy = ems_default_policy;
+    snprintf(dev->info.serial, sizeof(dev->info.serial), "%s", EMS_SIM);
+    sim_caps(dev->link, &dev->caps);
+    ems_probe(dev);
+
+    pthread_mutex_lock(&open_lock);
+    dev->next = open_devs;
+    open_devs = dev;
+    pthread_mutex_unlock(&open_lock);
+
+    *devp = dev;
+    return 0;
+}
+
+/**
+ * Open and claim a cart.
+ *
+ * Params:
+ *  id      "bus:port" or serial number of the cart, NULL for the first one,
+ *          "sim" or "sim:<settings>" for a simulated cart, see sim.c
+ *  devp    set to the device
+ *
+ * Returns:
+ *  0       success
+ *  < 0     libusb error, LIBUSB_ERROR_NOT_FOUND if no such cart is attached
+ */
+int ems_open(const char *id, ems_dev_t **devp) {
+    ems_dev_t *dev = NULL;
+    int r;
+
+    if (id != NULL && strncmp(id, EMS_SIM, strlen(EMS_SIM)) == 0 &&
+            (id[strlen(EMS_SIM)] == '\0' || id[strlen(EMS_SIM)] == ':'))
+        return ems_open_sim(id, devp);
+
+    r = ems_scan(NULL, 0, id, &dev);
+    if (r < 0)
+        return r;
+    if (dev == NULL)
+        return LIBUSB_ERROR_NOT_FOUND;
+
+    r = libusb_claim_interface(dev->devh, 0);
+    if (r < 0) {
+        libusb_close(dev->devh);
+        free(dev);
+        return r;
+    }
+    dev->transport = &usb_transport;
+    dev->link = dev->devh;
+    ems_discover(dev);
+    ems_probe(dev);
+
+    pthread_mutex_lock(&open_lock);
+    dev->next = open_devs;
+    open_devs = dev;
+    pthread_mutex_unlock(&open_lock);
+
+    *devp = dev;
+    return 0;
+}
+
+/**
+ * Flush outstanding writes, release and close a cart.
+ */
+void ems_close(ems_dev_t *dev) {
+    ems_dev_t **p;
+
+    pthread_mutex_lock(&open_lock);
+    for (p = &open_devs; *p != NULL; p = &(*p)->next) {
+        if (*p == dev) {
+            *p = dev->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&open_lock);
+
+    ems_pool_free(dev);
+    ems_trace_enable(dev, 0, NULL, NULL);
+
+    dev->transport->close(dev->link);
+    free(dev);
+}
+
+/**
+ * Set how the transfers of a cart time out and are retried.
+ *
+ * Params:
+ *  policy  the new policy, NULL for the defaults
+ */
+void ems_set_policy(ems_dev_t *dev, const ems_policy_t *policy) {
+    dev->policy = policy != NULL ? *policy : ems_default_policy;
+}
+
+/**
+ * Get the transfer policy of a cart.
+ */
+void ems_get_policy(ems_dev_t *dev, ems_policy_t *policy) {
+    *policy = dev->policy;
+}
+
+/**
+ * Whether buf is what erased flash reads as, all 0xFF. Words are ANDed 64
+ * bytes at a time, which compilers turn into vector instructions.
+ */
+int ems_erased(const unsigned char *buf, size_t len) {
+    uint64_t acc = ~0ull, w;
+    size_t i = 0, j;
+
+    for (; len - i >= 64; i += 64) {
+        for (j = 0; j < 64; j += 8) {
+            memcpy(&w, buf + i + j, 8);
+            acc &= w;
+        }
+        if (acc != ~0ull)
+            return 0;
+    }
+    for (; i < len; ++i)
+        if (buf[i] != 0xff)
+            return 0;
+
+    return 1;
+}
+
+/**
+ * Bus position and serial number of an open cart.
+ */
+const ems_devinfo_t *ems_info(ems_dev_t *dev) {
+    return &dev->info;
+}
+
+/**
+ * Monotonic clock in nanoseconds, for trace timestamps.
+ */
+static uint64_t ems_clock(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Turn tracing of a device on or off. While on, every command and data phase
+ * is timestamped and counted; each event goes to cb if given and into a ring
+ * of ring_size events that ems_trace_drain empties. Off, the transfer paths
+ * only test a NULL pointer.
+ *
+ * Params:
+ *  ring_size   events kept for ems_trace_drain, 0 with neither ring nor cb
+ *              disables tracing
+ *  cb          called for every event as it completes, may be NULL
+ *  arg         passed to cb
+ *
+ * Returns:
+ *  0       success
+ *  < 0     out of memory
+ */
+int ems_trace_enable(ems_dev_t *dev, size_t ring_size, ems_trace_cb cb, void *arg) {
+    struct ems_trace *trace;
+
+    if (dev->trace != NULL) {
+        free(dev->trace->ring);
+        free(dev->trace);
+        dev->trace = NULL;
+    }
+
+    if (ring_size == 0 && cb == NULL)
+        return 0;
+
+    trace = calloc(1, sizeof(*trace));
+    if (trace == NULL)
+        return LIBUSB_ERROR_NO_MEM;
+
+    if (ring_size > 0) {
+        trace->ring = calloc(ring_size, sizeof(*trace->ring));
+        if (trace->ring == NULL) {
+            free(trace);
+            return LIBUSB_ERROR_NO_MEM;
+        }
+    }
+    trace->size = ring_size;
+    trace->cb = cb;
+    trace->arg = arg;
+
+    dev->trace = trace;
+    return 0;
+}
+
+/**
+ * Record one finished phase. Only called while tracing.
+ */
+static void ems_trace_record(ems_dev_t *dev, int phase, int space,
+        uint32_t offset, uint32_t bytes, uint64_t start, int status, int retries) {
+    struct ems_trace *trace = dev->trace;
+    ems_trace_event_t ev;
+
+    ev.phase = phase;
+    ev.space = space;
+    ev.status = status;
+    ev.retries = retries;
+    ev.offset = offset;
+    ev.bytes = bytes;
+    ev.start_ns = start;
+    ev.end_ns = ems_clock();
+
+    ++trace->stats.transfers;
+    if (phase == EMS_TRACE_DATA)
+        trace->stats.bytes_in += bytes;
+    else
+        trace->stats.bytes_out += bytes;
+    if (status < 0)
+        ++trace->stats.errors;
+
+    if (trace->cb != NULL)
+        trace->cb(&ev, trace->arg);
+
+    if (trace->size > 0) {
+        trace->ring[trace->head] = ev;
+        trace->head = (trace->head + 1) % trace->size;
+        if (trace->count == trace->size)
+            ++trace->stats.dropped; // overwrote the oldest event
+        else
+            ++trace->count;
+    }
+}
+
+/**
+ * Take the oldest events out of the trace ring.
+ *
+ * Params:
+ *  out     filled with up to max events, oldest first
+ *  max     size of out
+ *
+ * Returns:
+ *  number of events copied
+ */
+size_t ems_trace_drain(ems_dev_t *dev, ems_trace_event_t *out, size_t max) {
+    struct ems_trace *trace = dev->trace;
+    size_t n = 0;
+
+    if (trace == NULL)
+        return 0;
+
+    while (n < max && trace->count > 0) {
+        size_t oldest = (trace->head + trace->size - trace->count) % trace->size;
+        out[n++] = trace->ring[oldest];
+        --trace->count;
+    }
+
+    return n;
+}
+
+/**
+ * Counters accumulated since tracing was enabled. All zero when it isn't.
+ */
+void ems_trace_stats(ems_dev_t *dev, ems_stats_t *stats) {
+    if (dev->trace != NULL)
+        *stats = dev->trace->stats;
+    else
+        memset(stats, 0, sizeof(*stats));
+}
+
+/**
+ * Initialize a command buffer. Commands are a 1 byte command code followed by
+ * a 4 byte address and a 4 byte value.
+ *
+ * buf must point to a memory chunk of size >= 9 bytes
+ */
+static void ems_command_init(
+        unsigned char *buf, // buffer to init
+        unsigned char cmd,  // command to run
+        uint32_t addr,      // address
+        uint32_t val        // value
+) {
+    buf[0] = cmd;
+    *(uint32_t *)(buf + 1) = htonl(addr);
+    *(uint32_t *)(buf + 5) = htonl(val);
+}
+
+/**
+ * Is a failed transfer worth another try? A cart that's gone or a transfer
+ * the caller stopped isn't.
+ */
+static int ems_retryable(int r) {
+    return r == LIBUSB_ERROR_TIMEOUT || r == LIBUSB_ERROR_PIPE ||
+        r == LIBUSB_ERROR_IO || r == LIBUSB_ERROR_OVERFLOW;
+}
+
+/**
+ * Wait before retry number attempt: the policy's backoff, doubled for every
+ * retry after the first.
+ */
+static void ems_backoff(ems_dev_t *dev, int attempt) {
+    unsigned long ms = (unsigned long)dev->policy.backoff << (attempt < 10 ? attempt - 1 : 9);
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+
+    if (dev->trace != NULL)
+        ++dev->trace->stats.retries;
+    nanosleep(&ts, NULL);
+}
+
+/**
+ * Get the link back in step after a failed transfer: clear a halt on both
+ * endpoints, and throw away the data of read commands whose data phase was
+ * lost, so it can't be taken for the data of the retried block.
+ */
+static void ems_recover(ems_dev_t *dev) {
+    unsigned char *junk;
+    int i, transferred;
+
+    dev->transport->clear_halt(dev->link, dev->caps.ep_out);
+    dev->transport->clear_halt(dev->link, dev->caps.ep_in);
+
+    junk = malloc(EMS_DRAIN_SIZE);
+    if (junk == NULL)
+        return;
+    for (i = 0; i < EMS_DRAIN_MAX; ++i)
+        if (dev->transport->bulk(dev->link, dev->caps.ep_in, junk, EMS_DRAIN_SIZE,
+                    &transferred, EMS_DRAIN_TIMEOUT) < 0)
+            break;
+    free(junk);
+}
+
+/**
+ * One try of ems_read: send the command, read the data.
+ */
+static int ems_read_once(ems_dev_t *dev, int from, unsigned char *cmd_buf, uint32_t offset,
+        unsigned char *buf, size_t count, int retries) {
+    int r, transferred;
+    uint64_t start;
+
+    // send the read command
+    start = dev->trace != NULL ? ems_clock() : 0;
+    r = dev->transport->bulk(dev->link, dev->caps.ep_out, cmd_buf, 9, &transferred,
+            dev->policy.command_timeout);
+    if (dev->trace != NULL)
+        ems_trace_record(dev, EMS_TRACE_COMMAND, from, offset, 9, start, r, retries);
+    if (r < 0)
+        return r;
+
+    // read the data
+    start = dev->trace != NULL ? ems_clock() : 0;
+    r = dev->transport->bulk(dev->link, dev->caps.ep_in, buf, count, &transferred,
+            dev->policy.data_timeout);
+    if (dev->trace != NULL)
+        ems_trace_record(dev, EMS_TRACE_DATA, from, offset, r < 0 ? 0 : transferred, start, r, retries);
+    if (r < 0)
+        return r;
+
+    return transferred;
+}
+
+/**
+ * Read some bytes from the cart. A failed read is retried as the policy says.
+ *
+ * Params:
+ *  from    FROM_ROM or FROM_SRAM
+ *  offset  absolute read address from the cart
+ *  buf     buffer to read into (buffer must be at least count bytes)
+ *  count   number of bytes to read
+ *
+ * Returns:
+ *  >= 0    number of bytes read (will always == count)
+ *  < 0     error sending command or reading data
+ */
+int ems_read(ems_dev_t *dev, int from, uint32_t offset, unsigned char *buf, size_t count) {
+    int r, attempt;
+    unsigned char cmd;
+    unsigned char cmd_buf[9];
+
+    assert(from == FROM_ROM || from == FROM_SRAM);
+
+    cmd = from == FROM_ROM ? CMD_READ : CMD_READ_SRAM;
+    ems_command_init(cmd_buf, cmd, offset, count);
+
+    for (attempt = 0; ; ++attempt) {
+        r = ems_read_once(dev, from, cmd_buf, offset, buf, count, attempt);
+        if (r >= 0 || attempt >= dev->policy.retries || !ems_retryable(r))
+            return r;
+
+        ems_recover(dev);
+        ems_backoff(dev, attempt + 1);
+    }
+}
 
 /**
- * Attempt to find the EMS cart by vid/pid.
+ * Find the longest read the firmware answers, by reading from ROM offset 0
+ * with growing lengths until one gets no data. The result is kept in the
+ * caps of the cart. ems_open does this once for every cart it opens.
  *
  * Returns:
- *  0       success
- *  < 0     failure
+ *  > 0     longest read length that worked, at least EMS_PROBE_MIN
+ *  < 0     out of memory
+ */
+int ems_probe(ems_dev_t *dev) {
+    ems_policy_t saved = dev->policy;
+    unsigned char *buf;
+    size_t len;
+
+    buf = malloc(EMS_PROBE_MAX);
+    if (buf == NULL)
+        return LIBUSB_ERROR_NO_MEM;
+
+    // a read too long for the firmware only ever times out, so don't wait
+    // long for it or try it again
+    dev->policy.retries = 0;
+    dev->policy.data_timeout = EMS_PROBE_TIMEOUT;
+
+    dev->caps.max_read = EMS_PROBE_MIN;
+    for (len = 2 * EMS_PROBE_MIN; len <= EMS_PROBE_MAX; len *= 2) {
+        if (ems_read(dev, FROM_ROM, 0, buf, len) != (int)len) {
+            ems_recover(dev);
+            break;
+        }
+        dev->caps.max_read = len;
+    }
+
+    dev->policy = saved;
+    free(buf);
+    return dev->caps.max_read;
+}
+
+/**
+ * Convert a completed transfer's status into a libusb error code.
  */
-static int find_ems_device(void) {
-    devh = libusb_open_device_with_vid_pid(NULL, EMS_VID, EMS_PID);
-    return devh ? 0 : -EIO;
+static int ems_transfer_error(struct libusb_transfer *xfer) {
+    switch (xfer->status) {
+        case LIBUSB_TRANSFER_COMPLETED:
+            return xfer->actual_length == xfer->length ? 0 : LIBUSB_ERROR_IO;
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            return LIBUSB_ERROR_TIMEOUT;
+        case LIBUSB_TRANSFER_STALL:
+            return LIBUSB_ERROR_PIPE;
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            return LIBUSB_ERROR_NO_DEVICE;
+        case LIBUSB_TRANSFER_OVERFLOW:
+            return LIBUSB_ERROR_OVERFLOW;
+        case LIBUSB_TRANSFER_CANCELLED:
+            return LIBUSB_ERROR_INTERRUPTED;
+        default:
+            return LIBUSB_ERROR_IO;
+    }
 }
 
 /**
- * Init the flasher. Inits libusb and claims the device. Aborts if libusb
- * can't be initialized.
- *
- * TODO replace printed error with return code
+ * libusb completion callback for every transfer owned by a slot.
+ */
+static void LIBUSB_CALL ems_slot_complete(struct libusb_transfer *xfer) {
+    struct ems_slot *slot = xfer->user_data;
+    struct ems_queue *q = slot->q;
+    int r;
+
+    r = ems_transfer_error(xfer);
+    if (q->dev->trace != NULL) {
+        int read = slot->data != NULL;
+        int data = xfer == slot->data;
+        int space = slot->buf[0] == CMD_READ || slot->buf[0] == CMD_WRITE ? FROM_ROM : FROM_SRAM;
+
+        ems_trace_record(q->dev, data ? EMS_TRACE_DATA : read ? EMS_TRACE_COMMAND : EMS_TRACE_WRITE,
+                space, slot->offset, xfer->actual_length, slot->start[data], r, slot->retries);
+    }
+    if (r < 0 && slot->status == 0)
+        slot->status = r;
+    // reads stop submitting at once, the write pool retries a slot as it retires it
+    if (r < 0 && q->error == 0 && q != &q->dev->wpool)
+        q->error = r;
+
+    --q->inflight;
+    if (--slot->outstanding == 0)
+        slot->done = 1;
+}
+
+/**
+ * Allocate the slots of a queue. Write queues get a command+payload buffer
+ * per slot, read queues a command buffer and a second transfer for the data.
  *
  * Returns:
- *  0       Success
- *  < 0     Failure
+ *  0       success
+ *  < 0     out of memory
  */
-int ems_init(void) {
-    int r;
-    void ems_deinit(void);
+static int ems_queue_init(struct ems_queue *q, ems_dev_t *dev, int depth, size_t blocksize, int write) {
+    int i;
 
-    // call the cleanup when we're done
-    atexit(ems_deinit);
+    memset(q, 0, sizeof(*q));
+    q->dev = dev;
+    q->slots = calloc(depth, sizeof(*q->slots));
+    if (q->slots == NULL)
+        return LIBUSB_ERROR_NO_MEM;
+    q->depth = depth;
+    q->blocksize = blocksize;
 
-    r = libusb_init(NULL);
-    if (r < 0) {
-        fprintf(stderr, "failed to initialize libusb\n");
-        exit(1); // pretty much hosed
+    for (i = 0; i < depth; ++i) {
+        struct ems_slot *slot = &q->slots[i];
+
+        slot->q = q;
+        slot->buf = malloc(write ? blocksize + 9 : 9);
+        slot->cmd = libusb_alloc_transfer(0);
+        if (!write)
+            slot->data = libusb_alloc_transfer(0);
+        if (slot->buf == NULL || slot->cmd == NULL || (!write && slot->data == NULL))
+            return LIBUSB_ERROR_NO_MEM;
     }
 
-    r = find_ems_device();
-    if (r < 0) {
-        fprintf(stderr, "Could not find/open device, is it plugged in?\n");
+    return 0;
+}
+
+/**
+ * Free everything ems_queue_init allocated. No transfer may be in flight.
+ */
+static void ems_queue_free(struct ems_queue *q) {
+    int i;
+
+    assert(q->inflight == 0);
+    for (i = 0; q->slots != NULL && i < q->depth; ++i) {
+        libusb_free_transfer(q->slots[i].cmd);
+        libusb_free_transfer(q->slots[i].data);
+        free(q->slots[i].buf);
+    }
+    free(q->slots);
+    q->slots = NULL;
+}
+
+/**
+ * Submit one transfer belonging to a slot.
+ */
+static int ems_queue_submit(struct ems_queue *q, struct ems_slot *slot,
+        struct libusb_transfer *xfer) {
+    int r;
+
+    if (q->dev->trace != NULL)
+        slot->start[xfer == slot->data] = ems_clock();
+
+    r = q->dev->transport->submit(q->dev->link, xfer);
+    if (r < 0)
         return r;
+
+    ++slot->outstanding;
+    ++q->inflight;
+    return 0;
+}
+
+/**
+ * Cancel whatever is still in flight and wait until libusb hands every
+ * transfer back, so the slots can be freed. Used on error only: the cart's
+ * command stream is out of sync afterwards.
+ */
+static void ems_queue_abort(struct ems_queue *q) {
+    int i;
+
+    for (i = 0; i < q->depth; ++i) {
+        if (q->slots[i].outstanding == 0)
+            continue;
+        q->dev->transport->cancel(q->dev->link, q->slots[i].cmd);
+        if (q->slots[i].data != NULL)
+            q->dev->transport->cancel(q->dev->link, q->slots[i].data);
+    }
+
+    while (q->inflight > 0)
+        if (q->dev->transport->wait(q->dev->link, NULL) < 0)
+            break;
+}
+
+/**
+ * Run a pipelined read of every extent in turn, without draining the queue
+ * in between. Blocks land in their place in the extent's buffer, or for an
+ * extent without one in slot k % depth of a ring allocated here, which is
+ * reused as soon as cb has seen block k. Blocks are handed to cb strictly in
+ * address order.
+ *
+ * A failed block is retried as the policy says: everything still in flight
+ * is cancelled, the link is recovered and the queue starts again at the
+ * failed block. Errors close together halve the blocksize from there on.
+ */
+static int ems_pipeline(ems_dev_t *dev, unsigned char cmd, const ems_extent_t *ext, int next,
+        size_t blocksize, int depth, ems_block_cb cb, void *arg) {
+    struct ems_queue q;
+    size_t nblocks = 0, next_submit = 0, next_done = 0, delivered = 0, pos = 0;
+    size_t failed = 0, last_error = 0, size = blocksize;
+    unsigned char *ring = NULL;
+    int r, i, e = 0, stop = 0, need_ring = 0, attempts = 0, errors = 0;
+
+    assert(blocksize > 0);
+    if (depth < 1)
+        depth = 1;
+
+    for (i = 0; i < next; ++i) {
+        nblocks += (ext[i].count + blocksize - 1) / blocksize;
+        need_ring |= ext[i].buf == NULL;
     }
+    if ((size_t)depth > nblocks)
+        depth = nblocks > 0 ? nblocks : 1;
 
-    r = libusb_claim_interface(devh, 0);
+    r = ems_queue_init(&q, dev, depth, blocksize, 0);
+    if (r == 0 && need_ring && (ring = malloc(depth * blocksize)) == NULL)
+        r = LIBUSB_ERROR_NO_MEM;
     if (r < 0) {
-        fprintf(stderr, "usb_claim_interface error %d\n", r);
+        ems_queue_free(&q);
         return r;
     }
 
-    claimed = 1;
-    return 0;
+    while (1) {
+        struct ems_slot *slot;
+
+        // keep the queue full
+        while (!stop && q.error == 0 && next_submit - next_done < (size_t)depth) {
+            // next block of this extent, or the first of the next one
+            while (e < next && pos == ext[e].count) {
+                ++e;
+                pos = 0;
+            }
+            if (e == next)
+                break;
+
+            slot = &q.slots[next_submit % depth];
+            slot->offset = ext[e].offset + pos;
+            slot->len = ext[e].count - pos < size ? ext[e].count - pos : size;
+            slot->dst = ext[e].buf != NULL ? ext[e].buf + pos : ring + (next_submit % depth) * blocksize;
+            slot->extent = e;
+            slot->retries = next_submit == failed ? attempts : 0;
+            pos += slot->len;
+            slot->done = 0;
+            slot->status = 0;
+
+            ems_command_init(slot->buf, cmd, slot->offset, slot->len);
+            libusb_fill_bulk_transfer(slot->cmd, dev->devh, dev->caps.ep_out,
+                    slot->buf, 9, ems_slot_complete, slot, dev->policy.command_timeout);
+            libusb_fill_bulk_transfer(slot->data, dev->devh, dev->caps.ep_in,
+                    slot->dst, slot->len, ems_slot_complete, slot, dev->policy.data_timeout);
+            r = ems_queue_submit(&q, slot, slot->cmd);
+            if (r == 0)
+                r = ems_queue_submit(&q, slot, slot->data);
+
+            if (r < 0) {
+                q.error = r;
+                break;
+            }
+            ++next_submit;
+        }
+
+        // nothing left to wait for
+        if (next_done == next_submit)
+            break;
+
+        // blocks before a failed one still complete and are delivered
+        slot = &q.slots[next_done % depth];
+        if (!slot->done) {
+            r = dev->transport->wait(dev->link, &slot->done);
+            if (r < 0) {
+                q.error = r;
+                break;
+            }
+            continue;
+        }
+
+        if (slot->status < 0) {
+            // the same block again, or a new one failing
+            attempts = next_done == failed && attempts > 0 ? attempts + 1 : 1;
+            failed = next_done;
+            q.error = slot->status;
+            if (stop || attempts > dev->policy.retries || !ems_retryable(slot->status))
+                break;
+
+            if (errors++ > 0 && next_done - last_error < EMS_ERROR_CLUSTER &&
+                    size / 2 >= dev->policy.min_blocksize && dev->policy.min_blocksize > 0)
+                size /= 2;
+            last_error = next_done;
+
+            ems_queue_abort(&q);
+            ems_recover(dev);
+            ems_backoff(dev, attempts);
+
+            // start over at the failed block
+            e = slot->extent;
+            pos = slot->offset - ext[e].offset;
+            next_submit = next_done;
+            q.error = 0;
+            continue;
+        }
+
+        // in order: hand the block to the caller
+        if (!stop && cb != NULL && cb(slot->offset, slot->dst, slot->len, arg) != 0)
+            stop = 1;
+        if (!stop)
+            delivered += slot->len;
+        ++next_done;
+    }
+
+    r = q.error;
+    if (r < 0)
+        ems_queue_abort(&q);
+    ems_queue_free(&q);
+    free(ring);
+
+    return r < 0 ? r : (int)delivered;
 }
 
 /**
- * Cleanup / release the device. Registered with atexit.
+ * Pipelined read. Reads count bytes starting at offset into buf in blocks of
+ * blocksize, with up to depth command+data transfer pairs in flight. Each
+ * block lands directly in its place in buf.
+ *
+ * Params:
+ *  from        FROM_ROM or FROM_SRAM
+ *  offset      absolute read address from the cart
+ *  buf         buffer to read into (buffer must be at least count bytes)
+ *  count       number of bytes to read
+ *  blocksize   bytes per read command
+ *  depth       number of blocks kept in flight
+ *  cb          called in address order for each block as it completes, may
+ *              be NULL. Returning non-zero stops the read: blocks already in
+ *              flight are drained but not delivered.
+ *  arg         passed to cb
+ *
+ * Returns:
+ *  >= 0    number of bytes delivered (== count unless cb stopped early)
+ *  < 0     error sending a command or reading data
  */
-void ems_deinit(void) {
-    if (claimed)
-        libusb_release_interface(devh, 0);
+int ems_read_async(ems_dev_t *dev, int from, uint32_t offset, unsigned char *buf, size_t count,
+        size_t blocksize, int depth, ems_block_cb cb, void *arg) {
+    assert(from == FROM_ROM || from == FROM_SRAM);
 
-    libusb_close(devh);
-    libusb_exit(NULL);
+    ems_extent_t ext = { offset, buf, count };
+
+    return ems_pipeline(dev, from == FROM_ROM ? CMD_READ : CMD_READ_SRAM,
+            &ext, 1, blocksize, depth, cb, arg);
 }
 
 /**
- * Initialize a command buffer. Commands are a 1 byte command code followed by
- * a 4 byte address and a 4 byte value.
+ * Scattered read: ems_read_async of several extents as one queue, so the
+ * link doesn't idle at the end of one extent while the next one starts.
+ * Extents are read and handed to cb in the order given. An extent with a
+ * NULL buf is streamed through a ring like ems_read_stream does.
  *
- * buf must point to a memory chunk of size >= 9 bytes
+ * Returns:
+ *  >= 0    number of bytes delivered (the sum of the counts unless cb
+ *          stopped early)
+ *  < 0     error sending a command or reading data
  */
-static void ems_command_init(
-        unsigned char *buf, // buffer to init
-        unsigned char cmd,  // command to run
-        uint32_t addr,      // address
-        uint32_t val        // value
-) {
-    buf[0] = cmd;
-    *(uint32_t *)(buf + 1) = htonl(addr);
-    *(uint32_t *)(buf + 5) = htonl(val);
+int ems_read_vec(ems_dev_t *dev, int from, const ems_extent_t *ext, int n,
+        size_t blocksize, int depth, ems_block_cb cb, void *arg) {
+    assert(from == FROM_ROM || from == FROM_SRAM);
+
+    return ems_pipeline(dev, from == FROM_ROM ? CMD_READ : CMD_READ_SRAM,
+            ext, n, blocksize, depth, cb, arg);
 }
 
 /**
- * Read some bytes from the cart.
+ * Streaming read. Like ems_read_async, but the blocks land in a ring of depth
+ * buffers owned by the library instead of a caller buffer of count bytes, so
+ * any amount can be read while only depth * blocksize bytes are allocated.
  *
  * Params:
- *  from    FROM_ROM or FROM_SRAM
- *  offset  absolute read address from the cart
- *  buf     buffer to read into (buffer must be at least count bytes)
- *  count   number of bytes to read
+ *  cb          called in address order for each block. The block is only
+ *              valid until cb returns. Returning non-zero stops the read.
  *
  * Returns:
- *  >= 0    number of bytes read (will always == count)
- *  < 0     error sending command or reading data
+ *  >= 0    number of bytes delivered (== count unless cb stopped early)
+ *  < 0     error sending a command or reading data
+ */
+int ems_read_stream(ems_dev_t *dev, int from, uint32_t offset, size_t count,
+        size_t blocksize, int depth, ems_block_cb cb, void *arg) {
+    assert(from == FROM_ROM || from == FROM_SRAM);
+    ems_extent_t ext = { offset, NULL, count };
+
+    assert(cb != NULL);
+
+    return ems_pipeline(dev, from == FROM_ROM ? CMD_READ : CMD_READ_SRAM,
+            &ext, 1, blocksize, depth, cb, arg);
+}
+
+/**
+ * Wait for the oldest write in the pool to complete and retire it. A failed
+ * slot is sent again on its own as the policy says; later slots may reach
+ * the cart before it, which is fine since every record carries its address.
+ * Errors are kept in dev->wpool.error until ems_write_flush reports them.
  */
-int ems_read(int from, uint32_t offset, unsigned char *buf, size_t count) {
+static void ems_pool_retire(ems_dev_t *dev) {
+    struct ems_slot *slot = &dev->wpool.slots[dev->wpool.tail % dev->wpool.depth];
+    size_t pos, count;
+    uint64_t start;
     int r, transferred;
-    unsigned char cmd;
-    unsigned char cmd_buf[9];
 
-    assert(from == FROM_ROM || from == FROM_SRAM);
+    while (!slot->done) {
+        r = dev->transport->wait(dev->link, &slot->done);
+        if (r < 0) {
+            if (dev->wpool.error == 0)
+                dev->wpool.error = r;
+            ems_queue_abort(&dev->wpool);
+            break;
+        }
+    }
 
-    cmd = from == FROM_ROM ? CMD_READ : CMD_READ_SRAM;
-    ems_command_init(cmd_buf, cmd, offset, count);
+    while (slot->status < 0 && dev->wpool.error == 0 && ems_retryable(slot->status) &&
+            slot->retries < dev->policy.retries) {
+        ++slot->retries;
+        ems_recover(dev);
+        ems_backoff(dev, slot->retries);
 
-#ifdef DEBUG
-    int i;
-    for (i = 0; i < 9; ++i)
-        printf("%02x ", cmd_buf[i]);
-    printf("\n");
-#endif
+        start = dev->trace != NULL ? ems_clock() : 0;
+        r = dev->transport->bulk(dev->link, dev->caps.ep_out, slot->buf, slot->len, &transferred,
+                dev->policy.command_timeout);
+        if (r == 0 && transferred != (int)slot->len)
+            r = LIBUSB_ERROR_IO;
+        if (dev->trace != NULL)
+            ems_trace_record(dev, EMS_TRACE_WRITE, slot->buf[0] == CMD_WRITE ? FROM_ROM : FROM_SRAM,
+                    slot->offset, r < 0 ? 0 : transferred, start, r, slot->retries);
+        slot->status = r;
+    }
+    if (slot->status < 0 && dev->wpool.error == 0)
+        dev->wpool.error = slot->status;
 
-    // send the read command
-    r = libusb_bulk_transfer(devh, EMS_EP_SEND, cmd_buf, sizeof(cmd_buf), &transferred, 0);
-    if (r < 0)
+    // hand every record in the slot back, their headers say where they went
+    for (pos = 0; slot->status == 0 && dev->wpool.error == 0 && slot->cb != NULL &&
+            pos < slot->len; pos += 9 + count) {
+        uint32_t offset = ntohl(*(uint32_t *)(slot->buf + pos + 1));
+
+        count = ntohl(*(uint32_t *)(slot->buf + pos + 5));
+        if (slot->cb(offset, slot->buf + pos + 9, count, slot->arg) != 0)
+            dev->wpool.error = LIBUSB_ERROR_INTERRUPTED;
+    }
+
+    ++dev->wpool.tail;
+}
+
+/**
+ * Flush and free the write pool.
+ */
+static void ems_pool_free(ems_dev_t *dev) {
+    ems_write_flush(dev);
+    ems_queue_free(&dev->wpool);
+}
+
+/**
+ * Size the write pool: depth slots each holding up to blocksize bytes of
+ * payload, or with batching on as many records as fit the batch size. Waits
+ * for outstanding writes first. The pool is also created on demand by
+ * ems_write_buf, so calling this is only needed to pick the depth.
+ *
+ * Returns:
+ *  0       success
+ *  < 0     out of memory, or the error of an outstanding write
+ */
+int ems_write_pool(ems_dev_t *dev, int depth, size_t blocksize) {
+    int r;
+
+    if (depth < 1)
+        depth = 1;
+    if (dev->batch > blocksize + 9)
+        blocksize = dev->batch - 9;
+
+    r = ems_write_flush(dev);
+    if (dev->wpool.slots != NULL && dev->wpool.depth == depth && dev->wpool.blocksize >= blocksize)
         return r;
 
-    // read the data
-    r = libusb_bulk_transfer(devh, EMS_EP_RECV, buf, count, &transferred, 0);
-    if (r < 0)
+    ems_queue_free(&dev->wpool);
+    if (ems_queue_init(&dev->wpool, dev, depth, blocksize, 1) < 0) {
+        ems_queue_free(&dev->wpool);
+        return LIBUSB_ERROR_NO_MEM;
+    }
+
+    // every slot starts out retired
+    for (depth = 0; depth < dev->wpool.depth; ++depth)
+        dev->wpool.slots[depth].done = 1;
+
+    return r;
+}
+
+/**
+ * Pack up to bytes of write commands and their payloads into each bulk
+ * transfer. The cart parses the same command stream either way, but a batch
+ * of 32 byte writes costs one USB transfer instead of one each. A batch of
+ * writes of one size ends on a packet boundary whenever a run of them that
+ * does fits the batch, see ems_batch_span. Waits for outstanding writes
+ * first.
+ *
+ * Params:
+ *  bytes   size of a batched transfer, at most EMS_BATCH_MAX, rounded down
+ *          to whole packets. 0 sends every write on its own.
+ *
+ * Returns:
+ *  0       success
+ *  < 0     out of memory, or the error of an outstanding write
+ */
+int ems_write_batch(ems_dev_t *dev, size_t bytes) {
+    if (bytes > EMS_BATCH_MAX)
+        bytes = EMS_BATCH_MAX;
+    if (dev->caps.packet_out > 0 && bytes > dev->caps.packet_out)
+        bytes -= bytes % dev->caps.packet_out;
+    dev->batch = bytes;
+
+    if (dev->wpool.slots == NULL)
+        return ems_write_flush(dev);
+    return ems_write_pool(dev, dev->wpool.depth, dev->wpool.blocksize);
+}
+
+/**
+ * Bytes of records of count payload bytes each that a batch holds: the
+ * batch size cut down to the longest run of them that ends on a packet
+ * boundary, as a short packet takes a frame of its own. 32 byte writes
+ * are 41 byte records, which line up with 64 byte packets every 64 of
+ * them, so a 4096 byte batch sends 2624 bytes. If not even one such run
+ * fits, the batch is filled and ends in a short packet.
+ */
+static size_t ems_batch_span(ems_dev_t *dev, size_t count) {
+    size_t record = 9 + count, packet = dev->caps.packet_out, a, b, t, run;
+
+    if (packet == 0)
+        return dev->batch;
+
+    for (a = record, b = packet; b != 0; t = a % b, a = b, b = t)
+        ;
+    run = record / a * packet;
+    return run > dev->batch ? dev->batch : dev->batch - dev->batch % run;
+}
+
+/**
+ * Send the records packed into the head slot of the write pool.
+ */
+static int ems_pool_send(ems_dev_t *dev) {
+    struct ems_slot *slot = &dev->wpool.slots[dev->wpool.head % dev->wpool.depth];
+    int r;
+
+    slot->offset = ntohl(*(uint32_t *)(slot->buf + 1));
+    slot->len = dev->wpool.fill;
+    slot->done = 0;
+    slot->status = 0;
+    slot->retries = 0;
+    dev->wpool.fill = 0;
+
+    libusb_fill_bulk_transfer(slot->cmd, dev->devh, dev->caps.ep_out,
+            slot->buf, slot->len, ems_slot_complete, slot, dev->policy.command_timeout);
+
+    r = ems_queue_submit(&dev->wpool, slot, slot->cmd);
+    if (r < 0) {
+        slot->done = 1;
+        dev->wpool.error = r;
         return r;
+    }
 
-    return transferred;
+    ++dev->wpool.head;
+    return 0;
+}
+
+/**
+ * Get the payload area of the next free write pool slot. The 9 byte command
+ * header in front of it is filled in by ems_write_submit. With batching the
+ * area follows the records already packed into the slot, unless count
+ * doesn't fit anymore. Waits for the oldest write to complete if every slot
+ * is in flight.
+ *
+ * Params:
+ *  count   payload bytes the caller is going to put in the slot
+ *
+ * Returns:
+ *  pointer to at least count bytes of payload, NULL if out of memory
+ */
+unsigned char *ems_write_buf(ems_dev_t *dev, size_t count) {
+    struct ems_slot *slot;
+
+    if (dev->wpool.slots == NULL || dev->wpool.blocksize < count) {
+        size_t blocksize = dev->wpool.blocksize > count ? dev->wpool.blocksize : count;
+        int depth = dev->wpool.slots != NULL ? dev->wpool.depth : EMS_QUEUE_DEPTH;
+        int error = ems_write_pool(dev, depth, blocksize);
+
+        if (dev->wpool.slots == NULL)
+            return NULL;
+        dev->wpool.error = error;
+    }
+
+    slot = &dev->wpool.slots[dev->wpool.head % dev->wpool.depth];
+    if (dev->wpool.fill > 0 && dev->wpool.fill + 9 + count <= ems_batch_span(dev, count))
+        return slot->buf + dev->wpool.fill + 9;
+
+    // the packed records go out, the next slot starts a new batch
+    if (dev->wpool.fill > 0 && ems_pool_send(dev) < 0)
+        return slot->buf + 9;
+
+    if (dev->wpool.head - dev->wpool.tail == (size_t)dev->wpool.depth)
+        ems_pool_retire(dev);
+
+    slot = &dev->wpool.slots[dev->wpool.head % dev->wpool.depth];
+    return slot->buf + 9;
+}
+
+/**
+ * Add a record to the head slot of the write pool and send the slot once it
+ * can't take another record of the same size. The records are retired
+ * through cb once they have been sent.
+ */
+static int ems_pool_submit(ems_dev_t *dev, int to, uint32_t offset, unsigned char *payload,
+        size_t count, ems_block_cb cb, void *arg) {
+    struct ems_slot *slot;
+    unsigned char *record;
+
+    assert(to == TO_ROM || to == TO_SRAM);
+    assert(dev->wpool.slots != NULL && dev->wpool.head - dev->wpool.tail < (size_t)dev->wpool.depth);
+
+    slot = &dev->wpool.slots[dev->wpool.head % dev->wpool.depth];
+    record = slot->buf + dev->wpool.fill;
+    assert(payload == record + 9 && dev->wpool.fill + count <= dev->wpool.blocksize);
+
+    if (dev->wpool.error < 0)
+        return dev->wpool.error;
+
+    // every record of a slot shares the slot's callback
+    slot->cb = cb;
+    slot->arg = arg;
+
+    ems_command_init(record, to == TO_ROM ? CMD_WRITE : CMD_WRITE_SRAM, offset, count);
+    dev->wpool.fill += 9 + count;
+
+    if (dev->batch == 0 || dev->wpool.fill + 9 + count > ems_batch_span(dev, count))
+        return ems_pool_send(dev);
+    return 0;
+}
+
+/**
+ * Send the slot last returned by ems_write_buf to the cart. Returns as soon
+ * as the transfer is queued; completion is only guaranteed after
+ * ems_write_flush.
+ *
+ * Params:
+ *  to      TO_ROM or TO_SRAM
+ *  offset  address to write to
+ *  payload pointer returned by ems_write_buf, filled by the caller
+ *  count   number of payload bytes to write
+ *
+ * Returns:
+ *  0       write queued
+ *  < 0     error of this or an earlier queued write
+ */
+int ems_write_submit(ems_dev_t *dev, int to, uint32_t offset, unsigned char *payload, size_t count) {
+    return ems_pool_submit(dev, to, offset, payload, count, NULL, NULL);
+}
+
+/**
+ * Wait for every queued write to complete.
+ *
+ * Returns:
+ *  0       all writes completed
+ *  < 0     error of the first failed write since the last flush
+ */
+int ems_write_flush(ems_dev_t *dev) {
+    int r;
+
+    if (dev->wpool.fill > 0)
+        ems_pool_send(dev);
+
+    while (dev->wpool.tail != dev->wpool.head)
+        ems_pool_retire(dev);
+
+    r = dev->wpool.error;
+    dev->wpool.error = 0;
+    return r;
 }
 
 /**
@@ -164,28 +1555,62 @@ int ems_read(int from, uint32_t offset, unsigned char *buf, size_t count) {
  *  >= 0    number of bytes written (will always == count)
  *  < 0     error writing data
  */
-int ems_write(int to, uint32_t offset, unsigned char *buf, size_t count) {
-    int r, transferred;
-    unsigned char cmd;
-    unsigned char *write_buf;
+int ems_write(ems_dev_t *dev, int to, uint32_t offset, unsigned char *buf, size_t count) {
+    int r;
+    unsigned char *payload;
 
-    assert(to == TO_ROM || to == TO_SRAM);
-    cmd = to == TO_ROM ? CMD_WRITE : CMD_WRITE_SRAM;
-
-    // thx libusb for having no scatter/gather io
-    write_buf = malloc(count + 9);
-    if (write_buf == NULL)
-        err(1, "malloc");
-    
-    // set up the command buffer
-    ems_command_init(write_buf, cmd, offset, count);
-    memcpy(write_buf + 9, buf, count);
-
-    r = libusb_bulk_transfer(devh, EMS_EP_SEND, write_buf, count + 9, &transferred, 0);
+    payload = ems_write_buf(dev, count);
+    if (payload == NULL)
+        return LIBUSB_ERROR_NO_MEM;
+
+    memcpy(payload, buf, count);
+    r = ems_write_submit(dev, to, offset, payload, count);
     if (r == 0)
-        r = transferred; // return number of bytes sent on success
+        r = ems_write_flush(dev);
 
-    free(write_buf);
+    return r < 0 ? r : (int)count;
+}
 
-    return r;
+/**
+ * Pipelined write. Writes count bytes from buf to the cart starting at offset
+ * in blocks of blocksize through the write pool, so up to the pool's depth
+ * of blocks are in flight.
+ *
+ * Params:
+ *  to          TO_ROM or TO_SRAM
+ *  offset      address to write to
+ *  buf         data to write
+ *  count       number of bytes out of buf to write
+ *  blocksize   payload bytes per write command
+ *  cb          called in address order as each block is sent, may be NULL.
+ *              Returning non-zero stops the write.
+ *  arg         passed to cb
+ *
+ * Returns:
+ *  >= 0    number of bytes written (== count)
+ *  < 0     error writing data
+ */
+int ems_write_async(ems_dev_t *dev, int to, uint32_t offset, unsigned char *buf, size_t count,
+        size_t blocksize, ems_block_cb cb, void *arg) {
+    size_t pos, len;
+    unsigned char *payload;
+    int r;
+
+    assert(blocksize > 0);
+
+    for (pos = 0; pos < count; pos += len) {
+        len = count - pos < blocksize ? count - pos : blocksize;
+
+        payload = ems_write_buf(dev, len);
+        if (payload == NULL)
+            return LIBUSB_ERROR_NO_MEM;
+
+        memcpy(payload, buf + pos, len);
+        r = ems_pool_submit(dev, to, offset + pos, payload, len, cb, arg);
+        if (r < 0)
+            break;
+    }
+
+    r = ems_write_flush(dev);
+    return r < 0 ? r : (int)count;
 }
@@ -1,17 +1,150 @@
 #ifndef __EMS_H__
 #define __EMS_H__
 
+#include <stddef.h>
 #include <stdint.h>
 
+typedef struct ems_dev ems_dev_t;
+
+/* where an attached cart sits on the bus */
+typedef struct ems_devinfo {
+    uint8_t bus;
+    uint8_t port;
+    uint8_t address;
+    char serial[64];    // empty if the device couldn't be opened
+} ems_devinfo_t;
+
 int ems_init(void);
+void ems_exit(void);
+const char *ems_strerror(int error);
+
+int ems_list(ems_devinfo_t *info, int max);
+int ems_open(const char *id, ems_dev_t **dev);
+void ems_close(ems_dev_t *dev);
+const ems_devinfo_t *ems_info(ems_dev_t *dev);
+int ems_is(ems_dev_t *dev, const char *id);
+
+typedef void (*ems_hotplug_cb)(const ems_devinfo_t *info, int arrived, void *arg);
+
+int ems_hotplug(ems_hotplug_cb cb, void *arg);
+int ems_handle_events(int timeout_ms);
+
+/* how the transfers of a cart time out and are retried */
+typedef struct ems_policy {
+    unsigned int command_timeout;   // ms for a command or write to go out, 0 waits forever
+    unsigned int data_timeout;      // ms for read data to come in, 0 waits forever
+    int retries;                    // times a failed block is tried again
+    unsigned int backoff;           // ms before the first retry, doubled for every one after
+    size_t min_blocksize;           // clustered read errors halve the read blocksize down
+                                    // to this, 0 keeps it
+} ems_policy_t;
+
+void ems_set_policy(ems_dev_t *dev, const ems_policy_t *policy);
+void ems_get_policy(ems_dev_t *dev, ems_policy_t *policy);
+
+/* what the USB link of a cart can do */
+typedef struct ems_caps {
+    unsigned int speed;     // kbit/s, 0 if unknown
+    uint8_t ep_out;         // bulk endpoint commands go out on
+    uint8_t ep_in;          // bulk endpoint read data comes in on
+    size_t packet_out;      // max packet size of ep_out, 0 if unknown
+    size_t packet_in;       // max packet size of ep_in, 0 if unknown
+    size_t max_read;        // longest read the firmware answers, probed at open
+    size_t sector;          // flash erase sector writes are planned around
+} ems_caps_t;
+
+void ems_get_caps(ems_dev_t *dev, ems_caps_t *caps);
+int ems_probe(ems_dev_t *dev);
+
+int ems_erased(const unsigned char *buf, size_t len);
+
+int ems_read(ems_dev_t *dev, int from, uint32_t offset, unsigned char *buf, size_t count);
+int ems_write(ems_dev_t *dev, int to, uint32_t offset, unsigned char *buf, size_t count);
+
+/* one contiguous piece of a scattered read */
+typedef struct ems_extent {
+    uint32_t offset;        // cart address
+    unsigned char *buf;     // count bytes, NULL to stream through a ring
+    size_t count;
+} ems_extent_t;
+
+typedef int (*ems_block_cb)(uint32_t offset, unsigned char *buf, size_t count, void *arg);
 
-int ems_read(int from, uint32_t offset, unsigned char *buf, size_t count);
-int ems_write(int to, uint32_t offset, unsigned char *buf, size_t count);
+int ems_read_async(ems_dev_t *dev, int from, uint32_t offset, unsigned char *buf, size_t count,
+        size_t blocksize, int depth, ems_block_cb cb, void *arg);
+int ems_read_vec(ems_dev_t *dev, int from, const ems_extent_t *ext, int n,
+        size_t blocksize, int depth, ems_block_cb cb, void *arg);
+int ems_read_stream(ems_dev_t *dev, int from, uint32_t offset, size_t count,
+        size_t blocksize, int depth, ems_block_cb cb, void *arg);
+int ems_write_async(ems_dev_t *dev, int to, uint32_t offset, unsigned char *buf, size_t count,
+        size_t blocksize, ems_block_cb cb, void *arg);
+
+int ems_write_pool(ems_dev_t *dev, int depth, size_t blocksize);
+int ems_write_batch(ems_dev_t *dev, size_t bytes);
+unsigned char *ems_write_buf(ems_dev_t *dev, size_t count);
+int ems_write_submit(ems_dev_t *dev, int to, uint32_t offset, unsigned char *payload, size_t count);
+int ems_write_flush(ems_dev_t *dev);
+
+/* one traced transfer phase */
+typedef struct ems_trace_event {
+    uint8_t phase;      // EMS_TRACE_*
+    uint8_t space;      // FROM_ROM or FROM_SRAM
+    int16_t status;     // 0 or libusb error code
+    uint16_t retries;   // times this phase was retried
+    uint32_t offset;    // cart address
+    uint32_t bytes;     // bytes moved on the wire
+    uint64_t start_ns;  // CLOCK_MONOTONIC at submit
+    uint64_t end_ns;    // CLOCK_MONOTONIC at completion
+} ems_trace_event_t;
+
+/* counters collected while tracing */
+typedef struct ems_stats {
+    uint64_t bytes_out;
+    uint64_t bytes_in;
+    uint64_t transfers;
+    uint64_t errors;
+    uint64_t retries;
+    uint64_t dropped;   // events overwritten before they were drained
+} ems_stats_t;
+
+typedef void (*ems_trace_cb)(const ems_trace_event_t *ev, void *arg);
+
+int ems_trace_enable(ems_dev_t *dev, size_t ring_size, ems_trace_cb cb, void *arg);
+size_t ems_trace_drain(ems_dev_t *dev, ems_trace_event_t *out, size_t max);
+void ems_trace_stats(ems_dev_t *dev, ems_stats_t *stats);
 
 #define FROM_ROM    1
 #define FROM_SRAM   2
 #define TO_ROM      FROM_ROM
 #define TO_SRAM     FROM_SRAM
 
+// default number of blocks the pipelined calls keep in flight
+#define EMS_QUEUE_DEPTH 8
+
+// largest bulk transfer ems_write_batch packs writes into
+#define EMS_BATCH_MAX 65536
+
+// flash erase sector assumed for a cart's ROM, writes that skip blocks only
+// skip whole sectors so they are right on flash that erases per sector
+#define EMS_SECTOR          0x20000
+
+// default transfer policy
+#define EMS_TIMEOUT_COMMAND 1000
+#define EMS_TIMEOUT_DATA    5000
+#define EMS_RETRIES         3
+#define EMS_BACKOFF         10
+#define EMS_MIN_BLOCKSIZE   64
+
+// trace phases
+#define EMS_TRACE_COMMAND   1   // read command sent
+#define EMS_TRACE_DATA      2   // read data received
+#define EMS_TRACE_WRITE     3   // write command and payload sent
+
+// ems_open id of a simulated cart, "sim:<settings>" to set it up
+#define EMS_SIM "sim"
+
+// most carts ems_list will report
+#define EMS_MAX_DEVICES 16
+
 #endif /* __EMS_H__ */
 // vim: ft=c
@@ -0,0 +1,263 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "header.h"
+
+// NXXXXXXX logo ;)
+const char nintylogo[0x30] =
+   {0xCE, 0xED, 0x66, 0x66, 0xCC, 0x0D, 0x00, 0x0B,
+    0x03, 0x73, 0x00, 0x83, 0x00, 0x0C, 0x00, 0x0D,
+    0x00, 0x08, 0x11, 0x1F, 0x88, 0x89, 0x00, 0x0E,
+    0xDC, 0xCC, 0x6E, 0xE6, 0xDD, 0xDD, 0xD9, 0x99,
+    0xBB, 0xBB, 0x67, 0x63, 0x6E, 0x0E, 0xEC, 0xCC,
+    0xDD, 0xDC, 0x99, 0x9F, 0xBB, 0xB9, 0x33, 0x3E};
+
+/* ROM size codes at HEADER_ROMSIZE */
+static const struct {
+    unsigned char code;
+    uint32_t kb;
+} romsizes[] = {
+    { 0x00,   32 },
+    { 0x01,   64 },
+    { 0x02,  128 },
+    { 0x03,  256 },
+    { 0x04,  512 },
+    { 0x05, 1024 },
+    { 0x06, 2048 },
+    { 0x07, 4096 },
+    { 0x52, 1152 },
+    { 0x53, 1280 },
+    { 0x54, 1536 },
+};
+
+/**
+ * Decode the ROM size code of a header.
+ *
+ * Returns:
+ *  > 0     ROM size in bytes
+ *  0       unknown size code
+ */
+uint32_t header_romsize(const unsigned char *buf) {
+    size_t i;
+
+    for (i = 0; i < sizeof(romsizes) / sizeof(romsizes[0]); ++i)
+        if (romsizes[i].code == buf[HEADER_ROMSIZE])
+            return romsizes[i].kb * 1024;
+
+    return 0;
+}
+
+/**
+ * Check the header checksum over the title through the version byte.
+ *
+ * Returns:
+ *  1       checksum matches
+ *  0       it doesn't, the boot ROM will lock up
+ */
+int header_checksum_ok(const unsigned char *buf) {
+    uint8_t calculated_chk = 0;
+    int i;
+
+    for (i = HEADER_TITLE; i <= HEADER_CHKSUM; ++i) {
+        calculated_chk += buf[i];
+    }
+    calculated_chk += 25;
+
+    return calculated_chk == 0;
+}
+
+/**
+ * Compare the logo in the header against the one the boot ROM checks. The
+ * CGB boot ROM only checks the first half of it.
+ *
+ * Returns:
+ *  2       logo matches
+ *  1       only the first half matches, it will boot on CGB
+ *  0       it doesn't match
+ */
+int header_logo(const unsigned char *buf) {
+    int i;
+
+    for (i = 0; i < 0x30; ++i)
+        if ((unsigned char) nintylogo[i] != buf[HEADER_LOGO + i])
+            break;
+
+    return i == 0x30 ? 2 : i > 0x18 ? 1 : 0;
+}
+
+/**
+ * Sum of the bytes of buf. Bytes are summed eight at a time: every 16-bit
+ * lane of acc takes the sum of two bytes per word, which can't overflow for
+ * 128 words.
+ */
+static uint64_t header_sum(const unsigned char *buf, size_t len) {
+    const uint64_t lanes = 0x00FF00FF00FF00FFull;
+    uint64_t acc, w, sum = 0;
+    size_t i = 0;
+    int n;
+
+    while (len - i >= 8) {
+        acc = 0;
+        for (n = 0; n < 128 && len - i >= 8; ++n, i += 8) {
+            memcpy(&w, buf + i, 8);
+            acc += (w & lanes) + ((w >> 8) & lanes);
+        }
+        acc = (acc & 0x0000FFFF0000FFFFull) + ((acc >> 16) & 0x0000FFFF0000FFFFull);
+        sum += (acc & 0xFFFFFFFF) + (acc >> 32);
+    }
+    for (; i < len; ++i)
+        sum += buf[i];
+
+    return sum;
+}
+
+/**
+ * Add the next len bytes of a ROM image to a check, which starts out zeroed.
+ * The image comes in order from its start, in pieces of any size.
+ */
+void header_check_update(header_check_t *c, const unsigned char *buf, size_t len) {
+    size_t head = sizeof(c->head);
+
+    if (c->len < head)
+        memcpy(c->head + c->len, buf, len < head - c->len ? len : head - c->len);
+    c->sum += header_sum(buf, len);
+    c->len += len;
+}
+
+/**
+ * Whether the header of a check has come in yet, c->head holds it then.
+ */
+int header_check_ready(const header_check_t *c) {
+    return c->len >= sizeof(c->head);
+}
+
+/**
+ * Check the global checksum of the image added to a check so far, the sum of
+ * every byte of the ROM but the two of the checksum itself. Nothing checks it
+ * on real hardware, but a ROM with a bad one is most likely a bad dump.
+ *
+ * Returns:
+ *  1       checksum matches
+ *  0       it doesn't, or the image is too short to have a header
+ */
+int header_check_global(const header_check_t *c) {
+    const unsigned char *h = c->head;
+    uint64_t sum = c->sum;
+
+    if (!header_check_ready(c))
+        return 0;
+
+    sum -= h[HEADER_GLOBALCHKSUM] + h[HEADER_GLOBALCHKSUM + 1];
+    return (sum & 0xFFFF) == (uint16_t)(h[HEADER_GLOBALCHKSUM] << 8 | h[HEADER_GLOBALCHKSUM + 1]);
+}
+
+/**
+ * Check the global checksum of a whole ROM image, see header_check_global.
+ */
+int header_global_ok(const unsigned char *rom, size_t len) {
+    header_check_t c = { 0 };
+
+    header_check_update(&c, rom, len);
+    return header_check_global(&c);
+}
+
+/**
+ * Name that identifies a ROM image by its header: title, header checksum,
+ * global checksum and size, e.g. TETRIS-0a-bf6d-32k. Characters of the title
+ * that don't belong in a file name become '_'.
+ *
+ * Returns:
+ *  0       key holds the name
+ *  -1      the header is not trustworthy enough to name the image by
+ */
+int header_key(const unsigned char *buf, char *key, size_t len) {
+    char title[17];
+    int i;
+
+    if (!header_checksum_ok(buf) || header_romsize(buf) == 0)
+        return -1;
+
+    for (i = 0; i < 16 && buf[HEADER_TITLE + i] != 0; ++i)
+        title[i] = isalnum(buf[HEADER_TITLE + i]) ? buf[HEADER_TITLE + i] : '_';
+    title[i] = '\0';
+
+    if (snprintf(key, len, "%s-%02x-%02x%02x-%uk", i > 0 ? title : "NONE", buf[HEADER_CHKSUM],
+                buf[HEADER_GLOBALCHKSUM], buf[HEADER_GLOBALCHKSUM + 1],
+                header_romsize(buf) / 1024) >= (int)len)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * header_info
+ */
+void header_info(unsigned char *buf) {
+    int i;
+    int willboot = 2;
+
+    printf("\tTitle: ");
+    if(buf[HEADER_TITLE] == 0)
+        printf("NONE");
+    for(i = HEADER_TITLE; i < (HEADER_TITLE + 16); i++) {
+        if(buf[i] == 0)
+            break;
+        putchar(buf[i]);
+    }
+    printf("\n");
+
+    printf("\tNintendo logo: ");
+    i = header_logo(buf);
+    if(i == 2) {
+        printf("PASS\n");
+    } else if(i == 1) {
+        printf("FAIL, but will boot on CGB\n");
+        willboot = 1;
+    } else {
+        printf("FAIL\n");
+        willboot = 0;
+    }
+
+    printf("\tHardware support: ");
+    if ((buf[HEADER_CGBFLAG] & 128) && (buf[HEADER_CGBFLAG] & 64)) {
+        printf("CGB\n");
+    } else if ((buf[HEADER_CGBFLAG] & 128) && (buf[HEADER_CGBFLAG] & 64) && buf[HEADER_SGBFLAG] == 0x03) {
+        printf("CGB <+SGB>, not real option set\n");
+    } else if ((buf[HEADER_CGBFLAG] & 128) && buf[HEADER_SGBFLAG] == 0x03) {
+        printf("DMG <+CGB, +SGB>\n");
+    } else if ((buf[HEADER_CGBFLAG] & 128)) {
+        printf("DMG <+CGB>\n");
+    } else if (buf[HEADER_SGBFLAG] == 0x03) {
+        printf("DMG <+SGB>\n");
+    } else {
+        printf("DMG\n");
+    }
+
+    printf("\tHeader checksum: ");
+    if (!header_checksum_ok(buf)) {
+        printf("FAIL\n");
+        willboot = 0;
+    } else {
+        printf("PASS\n");
+    }
+
+    printf("\tRom size: ");
+    if (header_romsize(buf) != 0)
+        printf("%u KB ROM\n", header_romsize(buf) / 1024);
+    else
+        printf("Unknown ROM size code\n");
+
+    printf("\tBoot status: ");
+    switch(willboot) {
+        case 0:
+            printf("This game will not boot on any system.\n");
+            break;
+        case 1:
+            printf("This game will only boot on CGB.\n");
+            break;
+        default:
+            printf("This game will work on any system.\n");
+            break;
+    }   
+}
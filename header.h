@@ -0,0 +1,45 @@
+#ifndef __HEADER_H__
+#define __HEADER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+//offsets to parts of the cart header
+enum headeroffsets {
+    HEADER_LOGO = 0x104,
+    HEADER_TITLE = 0x134,
+    HEADER_CGBFLAG = 0x143,
+    HEADER_SGBFLAG = 0x146,
+    HEADER_ROMSIZE = 0x148,
+    HEADER_RAMSIZE = 0x149,
+    HEADER_REGION = 0x14A,
+    HEADER_OLDLICENSEE = 0x14B,
+    HEADER_ROMVER = 0x14C,
+    HEADER_CHKSUM = 0x14D,
+    HEADER_GLOBALCHKSUM = 0x14E,
+};
+
+// bytes read from the start of a bank to get at the header
+#define HEADER_BLOCK 512
+
+extern const char nintylogo[0x30];
+
+/* checks of a ROM image made as it comes in */
+typedef struct header_check {
+    uint64_t sum;       // of every byte so far
+    size_t len;         // bytes so far
+    unsigned char head[HEADER_GLOBALCHKSUM + 2];
+} header_check_t;
+
+uint32_t header_romsize(const unsigned char *buf);
+int header_checksum_ok(const unsigned char *buf);
+int header_logo(const unsigned char *buf);
+int header_global_ok(const unsigned char *rom, size_t len);
+void header_check_update(header_check_t *c, const unsigned char *buf, size_t len);
+int header_check_ready(const header_check_t *c);
+int header_check_global(const header_check_t *c);
+int header_key(const unsigned char *buf, char *key, size_t len);
+void header_info(unsigned char *buf);
+
+#endif /* __HEADER_H__ */
+// vim: ft=c
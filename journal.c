@@ -0,0 +1,121 @@
+/*
+ * Checkpoint journal of a read or write, so an interrupted transfer can be
+ * picked up with --resume instead of starting again from offset 0.
+ *
+ * The journal sits next to the file as FILE.CART.journal, a single line:
+ *
+ *  EMSJOURNAL1 <write> <space> <base> <count> <offset> <window> <crc>
+ *
+ * offset counts the bytes handed to the cart, or saved into the file for a
+ * read. For a write the last window bytes of that may still have been in
+ * flight when the link dropped, so a resume checks them against the cart
+ * before carrying on. crc covers the first offset bytes of the file, which
+ * tells whether it is still the file the journal was written for.
+ */
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+#define JOURNAL_MAGIC "EMSJOURNAL1"
+
+/**
+ * Set up the journal of a transfer of count bytes at base between file and
+ * the cart named cart. Nothing is read or written yet.
+ */
+void journal_init(journal_t *j, const char *file, const char *cart, int write,
+        int space, uint32_t base, uint32_t count) {
+    memset(j, 0, sizeof(*j));
+    if (snprintf(j->path, sizeof(j->path), "%s.%s.journal", file, cart) >= (int)sizeof(j->path))
+        j->failed = 1;
+    j->write = write;
+    j->space = space;
+    j->base = base;
+    j->count = count;
+}
+
+/**
+ * Load the journal left by an interrupted run of the same transfer.
+ *
+ * Returns:
+ *  0       success, offset, window and crc are filled in
+ *  -1      no journal, or one for a different transfer
+ */
+int journal_load(journal_t *j) {
+    char magic[16];
+    int write, space;
+    uint32_t base, count, offset, window, crc;
+    int r;
+
+    FILE *file = fopen(j->path, "r");
+    if (file == NULL)
+        return -1;
+
+    r = fscanf(file, "%15s %d %d %u %u %u %u %u", magic, &write, &space,
+            &base, &count, &offset, &window, &crc);
+    fclose(file);
+
+    if (r != 8 || strcmp(magic, JOURNAL_MAGIC) != 0 || write != j->write ||
+            space != j->space || base != j->base || count != j->count || offset > count)
+        return -1;
+
+    j->offset = j->saved = offset;
+    j->window = window;
+    j->crc = crc;
+    return 0;
+}
+
+/**
+ * Record that the first offset bytes are done, with crc their CRC-32. The
+ * journal is saved every JOURNAL_INTERVAL bytes; for a read, data is flushed
+ * first so the journal never claims more than the file holds.
+ */
+void journal_update(journal_t *j, uint32_t offset, uint32_t crc, FILE *data) {
+    j->offset = offset;
+    j->crc = crc;
+
+    if (offset - j->saved < JOURNAL_INTERVAL)
+        return;
+
+    if (data != NULL && fflush(data) != 0)
+        return;
+    journal_save(j);
+}
+
+/**
+ * Save the journal as it is now. A journal that can't be saved is reported
+ * once, the transfer itself goes on.
+ */
+void journal_save(journal_t *j) {
+    char tmp[PATH_MAX + 8];
+    FILE *file;
+
+    if (j->failed)
+        return;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", j->path);
+    file = fopen(tmp, "w");
+    if (file != NULL) {
+        fprintf(file, "%s %d %d %u %u %u %u %u\n", JOURNAL_MAGIC, j->write, j->space,
+                j->base, j->count, j->offset, j->window, j->crc);
+        if (fclose(file) == 0 && rename(tmp, j->path) == 0) {
+            j->saved = j->offset;
+            return;
+        }
+    }
+
+    warn("Can't save the journal %s, this transfer can't be resumed", j->path);
+    unlink(tmp);
+    j->failed = 1;
+}
+
+/**
+ * The transfer completed: drop its journal.
+ */
+void journal_remove(journal_t *j) {
+    if (unlink(j->path) < 0 && errno != ENOENT)
+        warn("Can't remove the journal %s", j->path);
+}
@@ -0,0 +1,33 @@
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// a journal is saved again once the transfer has moved this many bytes on
+#define JOURNAL_INTERVAL 0x10000
+
+/* progress of one read or write, kept next to its file until it completes */
+typedef struct _journal_t {
+    char path[PATH_MAX];
+    int write;          // to the cart, else from it
+    int space;          // FROM_ROM or FROM_SRAM
+    uint32_t base;      // cart address of the transfer
+    uint32_t count;     // bytes in the whole transfer
+    uint32_t offset;    // bytes handed to the cart, or saved into the file
+    uint32_t window;    // bytes before offset that may not have reached the cart
+    uint32_t crc;       // CRC-32 of the first offset bytes
+    uint32_t saved;     // offset when last saved
+    int failed;         // couldn't be saved, don't try again
+} journal_t;
+
+void journal_init(journal_t *j, const char *file, const char *cart, int write,
+        int space, uint32_t base, uint32_t count);
+int journal_load(journal_t *j);
+void journal_update(journal_t *j, uint32_t offset, uint32_t crc, FILE *data);
+void journal_save(journal_t *j);
+void journal_remove(journal_t *j);
+
+#endif /* __JOURNAL_H__ */
+// vim: ft=c
@@ -1,11 +1,35 @@
 #include <err.h>
+#include <errno.h>
 #include <ctype.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 
+#include "archive.h"
+#include "crc32.h"
+#include "daemon.h"
 #include "ems.h"
+#include "header.h"
+#include "journal.h"
+#include "pack.h"
+#include "progress.h"
+#include "scan.h"
+#include "snap.h"
+#include "trace.h"
 
 #define VERSION "0.05"
 
@@ -19,60 +43,194 @@ const int limits[3] = {0, BANK_SIZE, SRAM_SIZE};
 #define MODE_READ   1
 #define MODE_WRITE  2
 #define MODE_TITLE  3
+#define MODE_LIST   4
+#define MODE_CALIBRATE 5
+#define MODE_SERVE  6
+#define MODE_SYNC   7
+#define MODE_PACK   8
+#define MODE_SCAN   9
+#define MODE_BATCH  10
+#define MODE_SNAPSHOT   11
+#define MODE_RESTORE    12
+#define MODE_SNAPSHOTS  13
+
+// --bank all: both banks in one run
+#define BANK_ALL        -1
+
+// writes are packed into bulk transfers of up to this many bytes
+#define BATCH_WRITE     4096
 
 /* options */
 typedef struct _options_t {
     int verbose;
     int blocksize;
+    int depth;
+    int timeout;        // ms for every transfer, 0 for the library's default
+    int retries;        // -1 for the library's default
+    int batch;
+    int mmap;
+    int diff;
+    int verify;
+    int cache;
+    int resume;
+    int compress;
+    int global;         // --scan checks global checksums too
     int mode;
     char *file;
+    char **files;       // every file given, --all hands one to each cart
+    int nfiles;
+    char *device;
+    int all;
     int bank;
     int space;
+    char *trace;        // Chrome trace of every transfer goes here
+    char *serve;        // socket of the daemon to run
+    char *connect;      // socket of a daemon to hand the job to
+    int progress_fd;    // JSON lines of progress go here, -1 for none
+    unsigned int snapshot;  // --restore this one
+    int prefer;         // --sync-save: SYNC_CART or SYNC_FILE wins, 0 if not told
+    char cart[80];      // name of the cart this thread runs on, for progress
 } options_t;
 
-// defaults
-options_t opts = {
+// defaults. Every thread has its own copy, so jobs on different carts of a
+// station can run with different options. A new thread's copy starts out as
+// these defaults, not as its creator's, so every thread that runs part of a
+// job first copies in the options it was handed.
+__thread options_t opts = {
     .verbose            = 0,
     .blocksize          = 0,
+    .depth              = EMS_QUEUE_DEPTH,
+    .timeout            = 0,
+    .retries            = -1,
+    .batch              = BATCH_WRITE,
+    .mmap               = 0,
+    .diff               = 0,
+    .verify             = 0,
+    .cache              = 1,
+    .resume             = 0,
+    .compress           = 0,
+    .global             = 0,
     .mode               = 0,
     .file               = NULL,
+    .files              = NULL,
+    .nfiles             = 0,
+    .device             = NULL,
+    .all                = 0,
     .bank               = 0,
     .space              = 0,
+    .trace              = NULL,
+    .serve              = NULL,
+    .connect            = NULL,
+    .progress_fd        = -1,
+    .snapshot           = 0,
+    .cart               = "",
 };
 
-// NXXXXXXX logo ;)
-const char nintylogo[0x30] =
-   {0xCE, 0xED, 0x66, 0x66, 0xCC, 0x0D, 0x00, 0x0B,
-    0x03, 0x73, 0x00, 0x83, 0x00, 0x0C, 0x00, 0x0D,
-    0x00, 0x08, 0x11, 0x1F, 0x88, 0x89, 0x00, 0x0E,
-    0xDC, 0xCC, 0x6E, 0xE6, 0xDD, 0xDD, 0xD9, 0x99,
-    0xBB, 0xBB, 0x67, 0x63, 0x6E, 0x0E, 0xEC, 0xCC,
-    0xDD, 0xDC, 0x99, 0x9F, 0xBB, 0xB9, 0x33, 0x3E};
-
-//offsets to parts of the cart header
-enum headeroffsets {
-    HEADER_LOGO = 0x104,
-    HEADER_TITLE = 0x134,
-    HEADER_CGBFLAG = 0x143,
-    HEADER_SGBFLAG = 0x146,
-    HEADER_ROMSIZE = 0x148,
-    HEADER_RAMSIZE = 0x149,
-    HEADER_REGION = 0x14A,
-    HEADER_OLDLICENSEE = 0x14B,
-    HEADER_ROMVER = 0x14C,
-    HEADER_CHKSUM = 0x14D,
-};
+// set while --serve parses a job, and on a station's cart while it runs one:
+// usage errors and failures end the job, not the daemon
+__thread int serving = 0;
+__thread jmp_buf job_exit;
+
+// set while the steps of a --batch job file are parsed and run: usage errors
+// end the batch, and the ROM headers of both banks are only read once
+__thread int batching = 0;
+__thread jmp_buf batch_exit;
+__thread struct {
+    int valid;
+    unsigned char buf[HEADER_BLOCK];
+} header_cache[2];
+
+// most arguments on one line of a job file
+#define BATCH_MAX_ARGS 64
+
+// what the steps of a batch touch on the cart
+#define BATCH_BANK1 1
+#define BATCH_BANK2 2
+#define BATCH_SRAM  4
 
 // default blocksizes
 #define BLOCKSIZE_READ  4096
 #define BLOCKSIZE_WRITE 32
 
+// --calibrate tries power of two block sizes in these ranges on SRAM
+#define CALIBRATE_READ_MIN   64
+#define CALIBRATE_READ_MAX   65536
+#define CALIBRATE_WRITE_MIN  16
+#define CALIBRATE_WRITE_MAX  4096
+#define CALIBRATE_WRITE_SIZE 0x8000   // bytes written per write trial
+
+// per-user cache directory, under $HOME
+#define CACHE_DIR ".cache/ems-flasher"
+
+// per-cart block sizes measured by --calibrate, in CACHE_DIR
+#define CALIBRATION_FILE "blocksizes"
+
+// ROM dumps by header, in CACHE_DIR; a hit is checked against this many
+// blocks read from the cart
+#define DUMP_DIR "dumps"
+#define DUMP_SAMPLES 8
+
+// --pack keeps the layout last written to each bank, in CACHE_DIR
+#define LAYOUT_DIR "layouts"
+
+// --sync-save hashes SRAM in regions of this size, and keeps the hashes of
+// the last sync for each cart next to the save file
+#define SYNC_REGION 1024
+#define SYNC_MAGIC  "EMSSYNC1"
+
+// --prefer: the side --sync-save takes where it can't tell which changed
+#define SYNC_CART   1
+#define SYNC_FILE   2
+
+/**
+ * Exit with status, or while serving end the current job with it.
+ */
+void __attribute__((noreturn)) quit(int status) {
+    if (batching)
+        longjmp(batch_exit, status + 1);
+    if (serving)
+        longjmp(job_exit, status + 1);
+    exit(status);
+}
+
+/**
+ * err(3) for the failures a job can run into: report, then quit with status.
+ */
+void __attribute__((noreturn, format(printf, 2, 3))) fail(int status, const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vwarn(fmt, ap);
+    va_end(ap);
+    quit(status);
+}
+
+/**
+ * errx(3) for the failures a job can run into.
+ */
+void __attribute__((noreturn, format(printf, 2, 3))) failx(int status, const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vwarnx(fmt, ap);
+    va_end(ap);
+    quit(status);
+}
+
 /**
  * Usage
  */
 void usage(char *name) {
     printf("Usage: %s < --read | --write > <file>\n", name);
     printf("       %s --title\n", name);
+    printf("       %s --list\n", name);
+    printf("       %s --calibrate\n", name);
+    printf("       %s --sync-save <file>\n", name);
+    printf("       %s --pack <menu> <rom>...\n", name);
+    printf("       %s --scan <dir>...\n", name);
+    printf("       %s --batch <jobfile>\n", name);
+    printf("       %s --serve <socket>\n", name);
+    printf("       %s --connect <socket> < --snapshot | --restore <id> | --snapshots >\n", name);
     printf("       %s --version\n", name);
     printf("       %s --help\n", name);
     printf("Writes a ROM or SAV file to the EMS 64 Mbit USB flash cart\n\n");
@@ -80,17 +238,68 @@ void usage(char *name) {
     printf("    --read                  read entire cart into file\n");
     printf("    --write                 write ROM file to cart\n");
     printf("    --title                 title of the ROM in both banks\n");
-    printf("    --bank <num>            select cart bank (1 or 2)\n");
+    printf("    --list                  list attached carts\n");
+    printf("    --calibrate             measure the fastest block sizes using SRAM\n");
+    printf("    --sync-save             copy changed parts of SAVE file and cart both ways\n");
+    printf("    --prefer <cart|file>    side --sync-save takes on a first sync or a conflict\n");
+    printf("    --pack                  pack ROM files into one bank, behind the first one\n");
+    printf("    --scan                  check every ROM file in dirs, print a JSON catalog\n");
+    printf("    --batch                 run every line of jobfile as one step, on one cart\n");
+    printf("    --bank <num>            select cart bank (1, 2 or all)\n");
     printf("    --save                  force write to SRAM\n");
     printf("    --rom                   force write to Flash ROM\n");
+    printf("    --diff                  only write blocks that differ from the cart\n");
+    printf("    --verify                read the written range back and compare checksums\n");
+    printf("    --resume                continue an interrupted read or write from its journal\n");
+    printf("    --compress              read into a compressed archive, --write takes them as is\n");
+    printf("    --global-checksum       --scan reads each ROM whole to check its global checksum\n");
+    printf("    --device <id>           use the cart at <bus:port> or with serial <id>, or sim\n");
+    printf("    --all                   run on every attached cart at once\n");
+    printf("    --serve <socket>        keep the cart claimed and run jobs sent to socket\n");
+    printf("    --connect <socket>      run this job on the daemon listening on socket\n");
+    printf("    --snapshot              daemon keeps a copy of SRAM in memory, prints its id\n");
+    printf("    --restore <id>          daemon writes a snapshot back, only where SRAM differs\n");
+    printf("    --snapshots             list the daemon's snapshots of the cart\n");
     printf("\n");
-    printf("You MUST supply exactly one of --read, --write, or --title\n");
+    printf("You MUST supply exactly one of --read, --write, --title, --list, --calibrate, --sync-save, --pack, --scan, --batch,\n"
+           "--snapshot, --restore, --snapshots, or --serve\n");
+    printf("With --all, give one file for every cart or a single file for all of them.\n");
     printf("Reading or writing with a file ending in .sav will write to SRAM.\n");
     printf("To select between ROM and SRAM, use ONE of the --save / --rom options.\n");
     printf("\n");
     printf("Advanced options:\n");
-    printf("    --blocksize <size>      bytes per block (default: 4096 read, 32 write)\n");
-    exit(1);
+    printf("    --blocksize <size>      bytes per block (default: calibrated, else 4096 read, 32 write)\n");
+    printf("    --depth <num>           blocks kept in flight (default: %d)\n", EMS_QUEUE_DEPTH);
+    printf("    --timeout <ms>          give up on a transfer after this long (default: %d, reads %d)\n",
+            EMS_TIMEOUT_COMMAND, EMS_TIMEOUT_DATA);
+    printf("    --retries <num>         times a failed block is tried again (default: %d)\n", EMS_RETRIES);
+    printf("    --write-batch <bytes>   pack writes into transfers this large, 0 for off (default: %d)\n", BATCH_WRITE);
+    printf("    --mmap                  transfer straight from/into the mapped file\n");
+    printf("    --no-cache              always dump the whole ROM, and don't cache it\n");
+    printf("    --trace <file>          save a Chrome trace of every USB transfer\n");
+    printf("    --progress-fd <fd>      write progress as JSON lines to file descriptor fd\n");
+    quit(1);
+}
+
+/**
+ * Work out whether file goes to/from ROM or SRAM.
+ */
+int file_space(const char *file) {
+    //attempt to autodetect the file
+    //are the last four characters .sav ?
+    size_t namelen = strlen(file);
+
+    if (opts.space != 0)
+        return opts.space;
+
+    if (namelen >= 4 &&
+        file[namelen - 4] == '.' &&
+        tolower(file[namelen - 3]) == 's' &&
+        tolower(file[namelen - 2]) == 'a' &&
+        tolower(file[namelen - 1]) == 'v')
+        return FROM_SRAM;
+
+    return FROM_ROM;
 }
 
 /**
@@ -108,10 +317,37 @@ void get_options(int argc, char **argv) {
             {"read", 0, 0, 'r'},
             {"write", 0, 0, 'w'},
             {"title", 0, 0, 't'},
+            {"list", 0, 0, 'l'},
+            {"calibrate", 0, 0, 'c'},
+            {"sync-save", 0, 0, 'Y'},
+            {"prefer", 1, 0, 'p'},
+            {"pack", 0, 0, 'P'},
+            {"scan", 0, 0, 'W'},
+            {"batch", 0, 0, 'J'},
+            {"global-checksum", 0, 0, 'G'},
+            {"device", 1, 0, 'i'},
+            {"all", 0, 0, 'a'},
             {"blocksize", 1, 0, 's'},
+            {"depth", 1, 0, 'd'},
+            {"timeout", 1, 0, 'O'},
+            {"retries", 1, 0, 'e'},
+            {"write-batch", 1, 0, 'B'},
+            {"mmap", 0, 0, 'm'},
+            {"diff", 0, 0, 'D'},
+            {"verify", 0, 0, 'k'},
+            {"no-cache", 0, 0, 'N'},
+            {"resume", 0, 0, 'U'},
+            {"compress", 0, 0, 'z'},
             {"bank", 1, 0, 'b'},
             {"save", 0, 0, 'S'},
             {"rom", 0, 0, 'R'},
+            {"trace", 1, 0, 'T'},
+            {"serve", 1, 0, 'L'},
+            {"connect", 1, 0, 'C'},
+            {"progress-fd", 1, 0, 'F'},
+            {"snapshot", 0, 0, 'n'},
+            {"restore", 1, 0, 'o'},
+            {"snapshots", 0, 0, 'q'},
             {0, 0, 0, 0}
         };
 
@@ -128,7 +364,7 @@ void get_options(int argc, char **argv) {
                 break;
             case 'V':
                 printf("EMS-flasher %s\n", VERSION);
-                exit(0);
+                quit(0);
                 break;
             case 'v':
                 opts.verbose = 1;
@@ -145,6 +381,49 @@ void get_options(int argc, char **argv) {
                 if (opts.mode != 0) goto mode_error;
                 opts.mode = MODE_TITLE;
                 break;
+            case 'l':
+                if (opts.mode != 0) goto mode_error;
+                opts.mode = MODE_LIST;
+                break;
+            case 'c':
+                if (opts.mode != 0) goto mode_error;
+                opts.mode = MODE_CALIBRATE;
+                break;
+            case 'Y':
+                if (opts.mode != 0) goto mode_error;
+                opts.mode = MODE_SYNC;
+                break;
+            case 'p':
+                if (strcmp(optarg, "cart") == 0) {
+                    opts.prefer = SYNC_CART;
+                } else if (strcmp(optarg, "file") == 0) {
+                    opts.prefer = SYNC_FILE;
+                } else {
+                    printf("Error: --prefer takes cart or file\n");
+                    usage(argv[0]);
+                }
+                break;
+            case 'P':
+                if (opts.mode != 0) goto mode_error;
+                opts.mode = MODE_PACK;
+                break;
+            case 'W':
+                if (opts.mode != 0) goto mode_error;
+                opts.mode = MODE_SCAN;
+                break;
+            case 'J':
+                if (opts.mode != 0) goto mode_error;
+                opts.mode = MODE_BATCH;
+                break;
+            case 'G':
+                opts.global = 1;
+                break;
+            case 'i':
+                opts.device = optarg;
+                break;
+            case 'a':
+                opts.all = 1;
+                break;
             case 's':
                 optval = atoi(optarg);
                 if (optval <= 0) {
@@ -154,7 +433,61 @@ void get_options(int argc, char **argv) {
                 // TODO make sure it divides evenly into bank size
                 opts.blocksize = optval;
                 break;
+            case 'B':
+                optval = atoi(optarg);
+                if (optval < 0 || optval > EMS_BATCH_MAX) {
+                    printf("Error: write batch must be 0 to %d bytes\n", EMS_BATCH_MAX);
+                    usage(argv[0]);
+                }
+                opts.batch = optval;
+                break;
+            case 'd':
+                optval = atoi(optarg);
+                if (optval <= 0) {
+                    printf("Error: depth must be > 0\n");
+                    usage(argv[0]);
+                }
+                opts.depth = optval;
+                break;
+            case 'O':
+                optval = atoi(optarg);
+                if (optval <= 0) {
+                    printf("Error: timeout must be > 0\n");
+                    usage(argv[0]);
+                }
+                opts.timeout = optval;
+                break;
+            case 'e':
+                optval = atoi(optarg);
+                if (optval < 0 || (optval == 0 && strcmp(optarg, "0") != 0)) {
+                    printf("Error: retries must be >= 0\n");
+                    usage(argv[0]);
+                }
+                opts.retries = optval;
+                break;
+            case 'm':
+                opts.mmap = 1;
+                break;
+            case 'D':
+                opts.diff = 1;
+                break;
+            case 'k':
+                opts.verify = 1;
+                break;
+            case 'N':
+                opts.cache = 0;
+                break;
+            case 'U':
+                opts.resume = 1;
+                break;
+            case 'z':
+                opts.compress = 1;
+                break;
             case 'b':
+                if (strcmp(optarg, "all") == 0) {
+                    opts.bank = BANK_ALL;
+                    break;
+                }
                 optval = atoi(optarg);
                 if (optval < 1 || optval > 2) {
                     printf("Error: cart only has two banks: 1 and 2\n");
@@ -170,6 +503,43 @@ void get_options(int argc, char **argv) {
                 if (opts.space != 0) goto mode_error2;
                 opts.space = FROM_ROM;
                 break;
+            case 'T':
+                opts.trace = optarg;
+                break;
+            case 'L':
+                if (opts.mode != 0) goto mode_error;
+                opts.mode = MODE_SERVE;
+                opts.serve = optarg;
+                break;
+            case 'C':
+                opts.connect = optarg;
+                break;
+            case 'F':
+                optval = atoi(optarg);
+                if (optval < 0 || (optval == 0 && strcmp(optarg, "0") != 0)) {
+                    printf("Error: progress fd must be >= 0\n");
+                    usage(argv[0]);
+                }
+                opts.progress_fd = optval;
+                break;
+            case 'n':
+                if (opts.mode != 0) goto mode_error;
+                opts.mode = MODE_SNAPSHOT;
+                break;
+            case 'o':
+                if (opts.mode != 0) goto mode_error;
+                optval = atoi(optarg);
+                if (optval <= 0) {
+                    printf("Error: snapshot ids are > 0\n");
+                    usage(argv[0]);
+                }
+                opts.mode = MODE_RESTORE;
+                opts.snapshot = optval;
+                break;
+            case 'q':
+                if (opts.mode != 0) goto mode_error;
+                opts.mode = MODE_SNAPSHOTS;
+                break;
             default:
                 usage(argv[0]);
                 break;
@@ -180,25 +550,116 @@ void get_options(int argc, char **argv) {
     if (opts.mode == 0)
         goto mode_error;
 
-    if (opts.mode == MODE_WRITE || opts.mode == MODE_READ) {
+    if (opts.all && opts.device != NULL) {
+        printf("Error: --device and --all can't be combined\n");
+        usage(argv[0]);
+    }
+
+    if ((opts.connect != NULL || serving) && (opts.mode == MODE_SERVE || opts.all)) {
+        printf("Error: a daemon runs jobs on its own cart, without --serve or --all\n");
+        usage(argv[0]);
+    }
+
+    if (batching && (opts.mode == MODE_SERVE || opts.mode == MODE_LIST || opts.mode == MODE_SCAN ||
+                opts.mode == MODE_BATCH || opts.all || opts.connect != NULL || opts.device != NULL)) {
+        printf("Error: a batch step runs on the cart of the batch, it can't be --serve, --list,\n"
+               "--scan or --batch, nor take --all, --connect or --device\n");
+        usage(argv[0]);
+    }
+
+    if ((opts.mode == MODE_SNAPSHOT || opts.mode == MODE_RESTORE || opts.mode == MODE_SNAPSHOTS) &&
+            opts.connect == NULL && !serving) {
+        printf("Error: snapshots are kept by a daemon, use --connect\n");
+        usage(argv[0]);
+    }
+
+    if (opts.mode == MODE_BATCH && opts.all) {
+        printf("Error: --batch runs on one cart, without --all\n");
+        usage(argv[0]);
+    }
+
+    if ((opts.connect != NULL || serving) && opts.progress_fd >= 0) {
+        printf("Error: a daemon can't write to --progress-fd, that fd is not its own\n");
+        usage(argv[0]);
+    }
+
+    if (opts.mode == MODE_SCAN && (opts.all || opts.connect != NULL || serving)) {
+        printf("Error: --scan reads files, not carts, it takes no --all or daemon\n");
+        usage(argv[0]);
+    }
+
+    if (opts.global && opts.mode != MODE_SCAN) {
+        printf("Error: --global-checksum only works with --scan\n");
+        usage(argv[0]);
+    }
+
+    if (opts.prefer != 0 && opts.mode != MODE_SYNC) {
+        printf("Error: --prefer only works with --sync-save\n");
+        usage(argv[0]);
+    }
+
+    if (opts.verify && opts.mode != MODE_WRITE && opts.mode != MODE_PACK) {
+        printf("Error: --verify only works with --write or --pack\n");
+        usage(argv[0]);
+    }
+
+    if (opts.resume && ((opts.mode != MODE_READ && opts.mode != MODE_WRITE) || opts.diff)) {
+        printf("Error: --resume only works with --read or --write, without --diff\n");
+        usage(argv[0]);
+    }
+
+    if (opts.compress && (opts.mode != MODE_READ || opts.mmap || opts.resume)) {
+        printf("Error: --compress only works with --read, without --mmap or --resume\n");
+        usage(argv[0]);
+    }
+
+    if (opts.mode == MODE_WRITE || opts.mode == MODE_READ || opts.mode == MODE_SYNC ||
+            opts.mode == MODE_PACK || opts.mode == MODE_SCAN || opts.mode == MODE_BATCH) {
         // user didn't give a filename
-        if (optind >= argc) {
-            printf("Error: you must provide an %s filename\n", opts.mode == MODE_READ ? "output" : "input");
+        if (optind >= argc && opts.mode == MODE_SCAN) {
+            printf("Error: you must provide a directory to scan\n");
+            usage(argv[0]);
+        } else if (optind >= argc && opts.mode == MODE_BATCH) {
+            printf("Error: you must provide a job file\n");
+            usage(argv[0]);
+        } else if (optind >= argc) {
+            printf("Error: you must provide an %s filename\n",
+                    opts.mode == MODE_WRITE || opts.mode == MODE_PACK ? "input" : "output");
             usage(argv[0]);
         }
 
-        // extra argument: ROM file
+        // extra argument: ROM file, more of them for --all
         opts.file = argv[optind];
+        opts.files = &argv[optind];
+        opts.nfiles = argc - optind;
+    }
+
+    if (opts.mode == MODE_PACK && (opts.bank == BANK_ALL || opts.space == FROM_SRAM ||
+                opts.diff || opts.mmap)) {
+        printf("Error: --pack writes the ROM of one bank, without --diff or --mmap\n");
+        usage(argv[0]);
+    }
 
-        // set a default blocksize if the user hasn't given one
-        if (opts.blocksize == 0)
-            opts.blocksize = opts.mode == MODE_READ ? BLOCKSIZE_READ : BLOCKSIZE_WRITE;
+    if (opts.bank == BANK_ALL) {
+        if (opts.mode != MODE_READ && opts.mode != MODE_WRITE) {
+            printf("Error: --bank all only works with --read or --write\n");
+            usage(argv[0]);
+        }
+        if (opts.diff || opts.space == FROM_SRAM || file_space(opts.file) == FROM_SRAM) {
+            printf("Error: --bank all only works on the ROM, without --diff\n");
+            usage(argv[0]);
+        }
+        if (!opts.all && opts.nfiles > 2) {
+            printf("Error: --bank all takes one file per bank or one image of both\n");
+            usage(argv[0]);
+        }
     }
 
     return;
 
 mode_error:
-    printf("Error: must supply exactly one of --read, --write, or --title\n");
+    printf("Error: must supply exactly one of --read, --write, --title, --list, --calibrate, --sync-save, --pack, --scan, --batch,\n"
+           "--snapshot, --restore, --snapshots, or --serve\n");
     usage(argv[0]);
 
 mode_error2:
@@ -207,287 +668,3280 @@ mode_error2:
 }
 
 /**
- * header_info
+ * Report progress of the running transfer: a line on the terminal, skipped
+ * with --all where several carts would be drawing over each other, and JSON
+ * lines with --progress-fd. Every thread keeps its own.
  */
-void header_info(unsigned char* buf) {
-    int i;
-    int willboot = 2;
+void show_progress(const char *what, uint64_t done, uint64_t total) {
+    static __thread progress_t progress;
 
-    printf("\tTitle: ");
-    if(buf[HEADER_TITLE] == 0)
-        printf("NONE");
-    for(i = HEADER_TITLE; i < (HEADER_TITLE + 16); i++) {
-        if(buf[i] == 0)
-            break;
-        putchar(buf[i]);
-    }
-    printf("\n");
+    progress.terminal = !opts.all;
+    progress.fd = opts.progress_fd;
+    progress.cart = opts.cart[0] != '\0' ? opts.cart : NULL;
+    progress_update(&progress, what, done, total);
+}
 
-    printf("\tNintendo logo: ");
-    for(i = 0; i < 0x30; ++i) {
-        if((unsigned char) nintylogo[i] != buf[HEADER_LOGO + i])
-            break;
-    }
-    if(i == 0x30) {
-        printf("PASS\n");
-    } else if(i > 0x18) {
-        printf("FAIL, but will boot on CGB\n");
-        willboot = 1;
-    } else {
-        printf("FAIL\n");
-        willboot = 0;
-    }
-
-    printf("\tHardware support: ");
-    if ((buf[HEADER_CGBFLAG] & 128) && (buf[HEADER_CGBFLAG] & 64)) {
-        printf("CGB\n");
-    } else if ((buf[HEADER_CGBFLAG] & 128) && (buf[HEADER_CGBFLAG] & 64) && buf[HEADER_SGBFLAG] == 0x03) {
-        printf("CGB <+SGB>, not real option set\n");
-    } else if ((buf[HEADER_CGBFLAG] & 128) && buf[HEADER_SGBFLAG] == 0x03) {
-        printf("DMG <+CGB, +SGB>\n");
-    } else if ((buf[HEADER_CGBFLAG] & 128)) {
-        printf("DMG <+CGB>\n");
-    } else if (buf[HEADER_SGBFLAG] == 0x03) {
-        printf("DMG <+SGB>\n");
-    } else {
-        printf("DMG\n");
+/*
+ * State shared between the MODE_READ block callback and the thread saving
+ * the blocks. USB fills buf in order while the saver writes out whatever has
+ * arrived, so a slow disk doesn't hold up the cart or the other way round.
+ */
+typedef struct _read_state_t {
+    FILE *file;                 // NULL when reading into a mapped file
+    unsigned char *buf;         // where the transfer lands
+    uint32_t received;          // bytes in buf so far
+    uint32_t offset;            // bytes saved so far
+    uint32_t total;             // bytes in the transfer plan
+    int done;                   // no more blocks will arrive
+    int failed;                 // the file couldn't be written
+    archive_writer_t *archive;  // with --compress, blocks go here instead
+    journal_t *journal;         // checkpoints of what was saved, NULL for none
+    uint32_t resumed;           // bytes already in the file from an interrupted run
+    uint32_t crc;               // of everything saved
+    const unsigned char *expect; // header the ROM dump was planned by, NULL to not check it
+    header_check_t check;       // of the blocks so far, with expect
+    int mismatch;               // the dump's header isn't the one expected
+    const options_t *opts;      // of the reading thread
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} read_state_t;
+
+/**
+ * Called by ems_read_async for each block, in order. Hands the block to the
+ * saver, or with a mapped file just counts it.
+ */
+int read_block(uint32_t addr, unsigned char *block, size_t count, void *arg) {
+    read_state_t *st = arg;
+    int failed, early;
+
+    // a ROM is checked as it lands, not read again afterwards; a header
+    // that changed since the dump was planned stops it right away
+    if (st->expect != NULL) {
+        early = !header_check_ready(&st->check);
+        header_check_update(&st->check, block, count);
+        if (early && header_check_ready(&st->check) &&
+                memcmp(st->check.head, st->expect, sizeof(st->check.head)) != 0) {
+            st->mismatch = 1;
+            return 1;
+        }
     }
 
-    printf("\tHeader checksum: ");
-    uint8_t calculated_chk = 0;
-    for (i = HEADER_TITLE; i <= HEADER_CHKSUM; ++i) {
-        calculated_chk += buf[i];
+    if (st->file == NULL) {
+        st->offset += count;
+        st->crc = crc32_update(st->crc, block, count);
+        if (st->journal != NULL)
+            journal_update(st->journal, st->resumed + st->offset, st->crc, NULL);
+        show_progress("Saving", st->offset, st->total);
+        return 0;
     }
-    calculated_chk += 25;
 
-    if (calculated_chk != 0) {
-        printf("FAIL\n");
-        willboot = 0;
-    } else {
-        printf("PASS\n");
-    }
-
-    printf("\tRom size: ");
-    switch (buf[HEADER_ROMSIZE]) {
-        case 0:
-        case 1:
-        case 2:
-        case 3:
-        case 4:
-        case 5:
-        case 6:
-        case 7:
-            printf("%u KB ROM\n", 32 << buf[HEADER_ROMSIZE]);
-            break;
-        case 0x52:
-            printf("1152 KB ROM\n");
-            break;
-        case 0x53:
-            printf("1280 KB ROM\n");
-            break;
-        case 0x54:
-            printf("1536 KB ROM\n");
+    pthread_mutex_lock(&st->lock);
+    st->received += count;
+    failed = st->failed;
+    pthread_cond_signal(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+
+    // stop reading once nothing more can be saved
+    return failed;
+}
+
+/**
+ * Saver thread: write blocks into the file as read_block reports them, until
+ * the read is done.
+ */
+void *save_blocks(void *arg) {
+    read_state_t *st = arg;
+    uint32_t avail;
+
+    opts = *st->opts;
+
+    while (1) {
+        pthread_mutex_lock(&st->lock);
+        while (st->received == st->offset && !st->done)
+            pthread_cond_wait(&st->cond, &st->lock);
+        avail = st->received - st->offset;
+        pthread_mutex_unlock(&st->lock);
+
+        if (avail == 0)
             break;
-        default:
-            printf("Unknown ROM size code\n");
+
+        if (st->archive != NULL ? archive_add(st->archive, st->buf + st->offset, avail) < 0 :
+                fwrite(st->buf + st->offset, avail, 1, st->file) != 1) {
+            warn("Can't write %u bytes into file at offset %u", avail, st->offset);
+            pthread_mutex_lock(&st->lock);
+            st->failed = 1;
+            pthread_mutex_unlock(&st->lock);
             break;
+        }
+
+        // only this thread moves offset
+        st->crc = crc32_update(st->crc, st->buf + st->offset, avail);
+        st->offset += avail;
+        if (st->journal != NULL)
+            journal_update(st->journal, st->resumed + st->offset, st->crc, st->file);
+        show_progress("Saving", st->offset, st->total);
     }
 
-    printf("\tBoot status: ");
-    switch(willboot) {
-        case 0:
-            printf("This game will not boot on any system.\n");
-            break;
-        case 1:
-            printf("This game will only boot on CGB.\n");
-            break;
-        default:
-            printf("This game will work on any system.\n");
-            break;
-    }   
+    return NULL;
 }
 
 /**
- * Main
+ * Differential write: bulk read what's on the cart, then only write the
+ * flash sectors, or SRAM blocks, that don't match data. A sector that differs anywhere is
+ * rewritten whole from its start, as flash that erases a sector when a write
+ * hits its first byte can only clear bits everywhere else. If the sector
+ * size isn't a multiple of blocksize, a range that differs at all is
+ * written whole.
+ *
+ * Returns:
+ *  >= 0    number of bytes actually written
+ *  < 0     error reading or writing the cart
  */
-int main(int argc, char **argv) {
+int write_diff(ems_dev_t *dev, int space, uint32_t base, unsigned char *data, size_t count, int blocksize) {
+    size_t sector, pos, i, end, len, written = 0;
+    unsigned char *cart, *payload;
+    ems_caps_t caps;
     int r;
-    setbuf(stdout, NULL);
 
-    get_options(argc, argv);
+    cart = malloc(count > 0 ? count : 1);
+    if (cart == NULL)
+        fail(1, "malloc");
 
-    // Force verbose.
-    opts.verbose = 1;
+    printf("Reading cart for comparison\n");
+    r = ems_read_async(dev, space, base, cart, count, BLOCKSIZE_READ, opts.depth, NULL, NULL);
+    if (r < 0) {
+        free(cart);
+        return r;
+    }
 
-    if (opts.verbose)
-        printf("Trying to find EMS cart\n");
+    // SRAM isn't flash, it is compared and written block by block
+    ems_get_caps(dev, &caps);
+    if (space == TO_SRAM)
+        sector = blocksize;
+    else
+        sector = caps.sector > 0 && caps.sector % blocksize == 0 ? caps.sector : 0;
 
-    r = ems_init();
-    if (r < 0)
-        return 1;
+    for (pos = 0; pos < count; pos = end) {
+        // up to the end of the sector pos is in
+        end = sector > 0 ? (base + pos) / sector * sector + sector - base : count;
+        if (end > count)
+            end = count;
+        if (memcmp(cart + pos, data + pos, end - pos) == 0)
+            continue;
 
-    if (opts.verbose)
-        printf("Claimed EMS cart\n");
+        for (i = pos; i < end; i += len) {
+            len = end - i < (size_t)blocksize ? end - i : (size_t)blocksize;
 
-    // we'll need a buffer one way or another
-    int blocksize = opts.blocksize;
-    uint32_t offset = 0;
-    uint32_t base = opts.bank * BANK_SIZE;
-    if (opts.verbose)
-        printf("Base address is 0x%X\n", base);
-    
-    unsigned char *buf = malloc(blocksize);
-    if (buf == NULL)
-        err(1, "malloc");
-
-    // determine what we're reading/writing from/to
-    int space = opts.space;
-    if (space == 0 && opts.file != NULL) {
-        //attempt to autodetect the file
-        //are the last four characters .sav ?
-        size_t namelen = strlen(opts.file);
-
-        if (opts.file[namelen - 4] == '.' &&
-            tolower(opts.file[namelen - 3]) == 's' &&
-            tolower(opts.file[namelen - 2]) == 'a' &&
-            tolower(opts.file[namelen - 1]) == 'v') {
-            space = FROM_SRAM;
-        } else {
-            space = FROM_ROM;
+            payload = ems_write_buf(dev, len);
+            if (payload == NULL)
+                fail(1, "malloc");
+            memcpy(payload, data + i, len);
+
+            r = ems_write_submit(dev, space, base + i, payload, len);
+            if (r < 0) {
+                free(cart);
+                return r;
+            }
+            written += len;
         }
+        show_progress("Writing", end, count);
     }
 
-    // read the ROM and save it into the file
-    if (opts.mode == MODE_READ) {
-        FILE *save_file = fopen(opts.file, "w");
-        if (save_file == NULL)
-            err(1, "Can't open %s for writing", opts.file);
+    free(cart);
 
-        if (opts.verbose && space == FROM_ROM)
-            printf("Saving ROM into %s\n", opts.file);
-        else if (opts.verbose)
-            printf("Saving SAVE into %s\n", opts.file);
+    r = ems_write_flush(dev);
+    return r < 0 ? r : (int)written;
+}
 
-        unsigned int readuntil = limits[space];
-        int untilset = 0;
-        while ((int)(offset + blocksize) <= readuntil) {
-            r = ems_read(space, offset + base, buf, blocksize);
-            if (r < 0) {
-                warnx("Can't read %d bytes at offset %u\n", blocksize, offset);
-                return 1;
-            }
+/**
+ * Name of a cart for messages and per-cart file names: its serial number,
+ * or its bus position if it has none.
+ */
+void device_name(ems_dev_t *dev, char *name, size_t len) {
+    const ems_devinfo_t *info = ems_info(dev);
 
-            r = fwrite(buf, blocksize, 1, save_file);
-            if (r != 1)
-                err(1, "Can't write %d bytes into file at offset %u", blocksize, offset);
-
-            offset += blocksize;
-            printf("Saving: %.2f%%\r", ((float) offset / (float) readuntil) * 100);
-
-            if(offset >= HEADER_ROMSIZE && untilset == 0 && space == FROM_ROM) {
-                switch(buf[HEADER_ROMSIZE - (offset - blocksize)]) {
-                    case 0:
-                    case 1:
-                    case 2:
-                    case 3:
-                    case 4:
-                    case 5:
-                    case 6:
-                    case 7:
-                        readuntil = (32 << buf[HEADER_ROMSIZE - (offset - blocksize)]) * 1024;
-                        break;
-                    case 0x52:
-                        readuntil = 1152 * 1024;
-                        break;
-                    case 0x53:
-                        readuntil = 1280 * 1024;
-                        break;
-                    case 0x54:
-                        readuntil = 1536 * 1024;
-                        break;
-                    default:
-                        break;
-                }
-                untilset = 1;
-            }
-        }
+    if (info->serial[0] != '\0')
+        snprintf(name, len, "%s", info->serial);
+    else
+        snprintf(name, len, "%u-%u", info->bus, info->port);
+}
 
-        fclose(save_file);
+/**
+ * Path of name in the cache directory, optionally creating the directories
+ * leading up to it.
+ *
+ * Returns:
+ *  0       success
+ *  < 0     no $HOME or the directory can't be created
+ */
+int cache_path(const char *name, char *path, size_t len, int create) {
+    const char *home = getenv("HOME");
+    char *slash;
 
-        if (opts.verbose)
-            printf("Successfully wrote %u bytes into %s\n", offset, opts.file);
-    }
+    if (home == NULL || snprintf(path, len, "%s/%s/%s", home, CACHE_DIR, name) >= (int)len)
+        return -1;
 
-    // write ROM in the file to bank 1
-    else if (opts.mode == MODE_WRITE) {
-        FILE *write_file = fopen(opts.file, "r");
-        if (write_file == NULL) {
-            if (space == TO_ROM)
-                err(1, "Can't open ROM file %s", opts.file);
-            else
-                err(1, "Can't open SAVE file %s", opts.file);
+    // mkdir -p everything between $HOME and the file
+    for (slash = path + strlen(home) + 1; create && (slash = strchr(slash, '/')) != NULL; ++slash) {
+        *slash = '\0';
+        if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+            *slash = '/';
+            return -1;
         }
+        *slash = '/';
+    }
+
+    return 0;
+}
+
+/**
+ * Look up the block sizes --calibrate measured for a cart. Lines in the
+ * calibration file are "<cart name> <read blocksize> <write blocksize>".
+ *
+ * Returns:
+ *  1       found, read and write are set
+ *  0       cart not calibrated
+ */
+int load_calibration(ems_dev_t *dev, int *read, int *write) {
+    char path[1024], line[256], name[80], want[80];
+    int found = 0, r, w;
+    FILE *file;
 
-        fseek(write_file, 0L, SEEK_END);
-        int size = ftell(write_file);
-        rewind(write_file);
+    if (cache_path(CALIBRATION_FILE, path, sizeof(path), 0) < 0 || (file = fopen(path, "r")) == NULL)
+        return 0;
 
-        if(size > 4*1024*1024 && space == TO_ROM) {
-            err(1, "ROM file %s is %d bytes large, max is %d", opts.file, size, (4*1024*1024));
-        } else if(size > 128*1024 && space == TO_SRAM) {
-            err(1, "SAVE file %s is %d bytes large, max is %d", opts.file, size, (128*1024));
+    device_name(dev, want, sizeof(want));
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "%79s %d %d", name, &r, &w) == 3 &&
+                strcmp(name, want) == 0 && r > 0 && w > 0) {
+            *read = r;
+            *write = w;
+            found = 1;
         }
+    }
 
-        if (opts.verbose && space == TO_ROM)
-            printf("Writing ROM file %s\n", opts.file);
-        else if (opts.verbose)
-            printf("Writing SAVE file %s\n", opts.file);
+    fclose(file);
+    return found;
+}
 
-        while ((int)(offset + blocksize) <= limits[space] && fread(buf, blocksize, 1, write_file) == 1) {
-            r = ems_write(space, offset + base, buf, blocksize);
-            if (r < 0) {
-                warnx("Can't write %d bytes at offset %u", blocksize, offset);
-                return 1;
-            }
+/**
+ * Store a cart's measured block sizes, replacing its previous entry.
+ *
+ * Returns:
+ *  0       success
+ *  < 0     the file can't be written, errno is set
+ */
+int save_calibration(ems_dev_t *dev, int read, int write, char *path, size_t len) {
+    char tmp[1100], line[256], name[80], want[80];
+    FILE *in, *out;
 
-            offset += blocksize;
-            printf("Writing: %.2f%%\r", ((float) offset / (float) size) * 100);
-        }
+    if (cache_path(CALIBRATION_FILE, path, len, 1) < 0)
+        return -1;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
 
-        fclose(write_file);
+    out = fopen(tmp, "w");
+    if (out == NULL)
+        return -1;
 
-        if (opts.verbose)
-            printf("Successfully wrote %u bytes from %s\n", offset, opts.file);
+    // keep every other cart's entry
+    device_name(dev, want, sizeof(want));
+    if ((in = fopen(path, "r")) != NULL) {
+        while (fgets(line, sizeof(line), in) != NULL)
+            if (sscanf(line, "%79s", name) != 1 || strcmp(name, want) != 0)
+                fputs(line, out);
+        fclose(in);
+    }
+    fprintf(out, "%s %d %d\n", want, read, write);
+
+    if (fclose(out) != 0 || rename(tmp, path) < 0)
+        return -1;
+    return 0;
+}
+
+/**
+ * Block size to use on a cart: --blocksize if given, else what --calibrate
+ * measured for it, else the defaults. Reads are cut to whole packets, and to
+ * the longest read the firmware answers, as probed when the cart was opened.
+ */
+int cart_blocksize(ems_dev_t *dev, int write) {
+    ems_caps_t caps;
+    int r, w, size;
+
+    if (opts.blocksize != 0)
+        size = opts.blocksize;
+    else if (load_calibration(dev, &r, &w))
+        size = write ? w : r;
+    else
+        size = write ? BLOCKSIZE_WRITE : BLOCKSIZE_READ;
+    if (write)
+        return size;
+
+    ems_get_caps(dev, &caps);
+    if (caps.max_read > 0 && (size_t)size > caps.max_read)
+        size = caps.max_read;
+    if (caps.packet_in > 0 && (size_t)size > caps.packet_in)
+        size -= size % caps.packet_in;
+    return size;
+}
+
+/**
+ * Monotonic clock in seconds.
+ */
+double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Time reads and writes over a range of power of two block sizes on SRAM and
+ * store the fastest ones the cart handles correctly. SRAM is backed up first
+ * and restored afterwards.
+ *
+ * Returns:
+ *  0       success
+ *  1       failure, already reported
+ */
+int calibrate_cart(ems_dev_t *dev) {
+    unsigned char *backup, *test, *check;
+    int size, r, i, best_read = 0, best_write = 0, ret = 1;
+    double t, rate, best_read_rate = 0, best_write_rate = 0;
+    char path[1024];
+
+    backup = malloc(SRAM_SIZE);
+    test = malloc(SRAM_SIZE);
+    check = malloc(SRAM_SIZE);
+    if (backup == NULL || test == NULL || check == NULL)
+        fail(1, "malloc");
+
+    printf("Backing up SRAM\n");
+    r = ems_read_async(dev, FROM_SRAM, 0, backup, SRAM_SIZE, BLOCKSIZE_READ, opts.depth, NULL, NULL);
+    if (r < 0) {
+        warnx("Can't read SRAM");
+        goto out;
     }
 
-    // read the ROM header
-    else if (opts.mode == MODE_TITLE) {
-        unsigned char buf[512];
+    // reads: the data must match the backup
+    printf("%8s  %10s\n", "read", "MB/s");
+    for (size = CALIBRATE_READ_MIN; size <= CALIBRATE_READ_MAX; size *= 2) {
+        memset(check, 0, SRAM_SIZE);
+        t = now();
+        r = ems_read_async(dev, FROM_SRAM, 0, check, SRAM_SIZE, size, opts.depth, NULL, NULL);
+        t = now() - t;
 
-        r = ems_read(FROM_ROM, 0, buf, 512);
-        if (r < 0)
-            errx(1, "Couldn't read ROM header at bank 0, offset 0, len 512\n");
-        
-        printf("Bank 0: \n");
-        header_info(buf);
+        if (r != SRAM_SIZE || memcmp(check, backup, SRAM_SIZE) != 0) {
+            printf("%8d  %10s\n", size, "rejected");
+            continue;
+        }
 
-        // readability.
-        printf("\n");
+        rate = SRAM_SIZE / t / 1e6;
+        printf("%8d  %10.3f\n", size, rate);
+        if (rate > best_read_rate) {
+            best_read_rate = rate;
+            best_read = size;
+        }
+    }
 
-        r = ems_read(FROM_ROM, BANK_SIZE, (unsigned char *)buf, 512);
-        if (r < 0)
-            errx(1, "Couldn't read ROM header at bank 1, offset 0, len 512\n");
-        
-        printf("Bank 1: \n");
-        header_info(buf);
+    if (best_read == 0) {
+        warnx("The cart didn't accept any read block size");
+        goto out;
     }
 
-    // should never reach here
-    else
-        errx(1, "Unknown mode %d, file a bug report", opts.mode);
+    // writes: a different pattern each round, read back to check it stuck
+    printf("%8s  %10s\n", "write", "MB/s");
+    for (size = CALIBRATE_WRITE_MIN; size <= CALIBRATE_WRITE_MAX; size *= 2) {
+        for (i = 0; i < CALIBRATE_WRITE_SIZE; ++i)
+            test[i] = backup[i] ^ (size & 0xff ? size & 0xff : size >> 8);
 
-    // belt and suspenders
-    free(buf);
+        t = now();
+        r = ems_write_async(dev, TO_SRAM, 0, test, CALIBRATE_WRITE_SIZE, size, NULL, NULL);
+        t = now() - t;
 
-    return 0;
+        if (r == CALIBRATE_WRITE_SIZE)
+            r = ems_read_async(dev, FROM_SRAM, 0, check, CALIBRATE_WRITE_SIZE, best_read, opts.depth, NULL, NULL);
+        if (r != CALIBRATE_WRITE_SIZE || memcmp(check, test, CALIBRATE_WRITE_SIZE) != 0) {
+            printf("%8d  %10s\n", size, "rejected");
+            continue;
+        }
+
+        rate = CALIBRATE_WRITE_SIZE / t / 1e6;
+        printf("%8d  %10.3f\n", size, rate);
+        if (rate > best_write_rate) {
+            best_write_rate = rate;
+            best_write = size;
+        }
+    }
+
+    printf("Restoring SRAM\n");
+    r = ems_write_async(dev, TO_SRAM, 0, backup, SRAM_SIZE, BLOCKSIZE_WRITE, NULL, NULL);
+    if (r == SRAM_SIZE)
+        r = ems_read_async(dev, FROM_SRAM, 0, check, SRAM_SIZE, BLOCKSIZE_READ, opts.depth, NULL, NULL);
+    if (r != SRAM_SIZE || memcmp(check, backup, SRAM_SIZE) != 0) {
+        warnx("Couldn't restore SRAM! Back up your save with --read before retrying");
+        goto out;
+    }
+
+    if (best_write == 0) {
+        warnx("The cart didn't accept any write block size");
+        goto out;
+    }
+
+    printf("Fastest: %d bytes read, %d bytes write\n", best_read, best_write);
+    if (save_calibration(dev, best_read, best_write, path, sizeof(path)) < 0) {
+        warn("Can't save calibration");
+        goto out;
+    }
+    printf("Saved to %s\n", path);
+    ret = 0;
+
+out:
+    free(backup);
+    free(test);
+    free(check);
+    return ret;
+}
+
+/**
+ * Write a whole image into file, as an archive with --compress.
+ *
+ * Returns:
+ *  0 on success, -1 on error (already reported)
+ */
+int write_image(FILE *file, const unsigned char *image, size_t count) {
+    archive_writer_t *archive;
+
+    if (!opts.compress) {
+        if (count > 0 && fwrite(image, count, 1, file) != 1) {
+            warn("Can't write %zu bytes into file", count);
+            return -1;
+        }
+        return 0;
+    }
+
+    archive = archive_create(file, count);
+    if (archive == NULL)
+        return -1;
+    if (archive_add(archive, image, count) < 0) {
+        archive_finish(archive);
+        return -1;
+    }
+    return archive_finish(archive);
+}
+
+/**
+ * Look for a dump of the ROM named key in the cache and check it against a
+ * sample of blocks from the cart: the first and last block and some in between
+ * at random. On a match the cached image is written into file, compressed
+ * with --compress.
+ *
+ * Returns:
+ *  0       hit, file holds the image
+ *  1       miss or mismatch, the ROM has to be dumped
+ *  -1      hit, but file couldn't be written, already reported
+ */
+int dump_lookup(ems_dev_t *dev, const char *key, uint32_t base, size_t count, FILE *file) {
+    unsigned char *image, block[BLOCKSIZE_READ];
+    char name[128], path[PATH_MAX];
+    size_t nblocks = count / BLOCKSIZE_READ, pos;
+    const char *serial = ems_info(dev)->serial;
+    struct timespec now;
+    unsigned int seed;
+    FILE *cached;
+    int i, ret = 1;
+
+    snprintf(name, sizeof(name), "%s/%s.gb", DUMP_DIR, key);
+    if (count % BLOCKSIZE_READ != 0 || cache_path(name, path, sizeof(path), 0) < 0 ||
+            (cached = fopen(path, "r")) == NULL)
+        return 1;
+
+    image = malloc(count + 1);
+    if (image == NULL)
+        fail(1, "malloc");
+
+    // must be exactly count bytes long
+    if (fread(image, 1, count + 1, cached) != count)
+        goto out;
+
+    // carts are looked up from several threads, each call gets its own seed
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    seed = now.tv_sec ^ now.tv_nsec ^ crc32_update(0, (const unsigned char *)serial, strlen(serial));
+
+    for (i = 0; i < DUMP_SAMPLES && i < (int)nblocks; ++i) {
+        if (i == 0)
+            pos = 0;
+        else if (i == 1)
+            pos = nblocks - 1;
+        else
+            pos = rand_r(&seed) % nblocks;
+        pos *= BLOCKSIZE_READ;
+
+        if (ems_read(dev, FROM_ROM, base + pos, block, BLOCKSIZE_READ) != BLOCKSIZE_READ ||
+                memcmp(block, image + pos, BLOCKSIZE_READ) != 0) {
+            if (opts.verbose)
+                printf("Cached dump %s doesn't match the cart\n", key);
+            goto out;
+        }
+    }
+
+    if (write_image(file, image, count) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    if (opts.verbose)
+        printf("Cart matches cached dump %s\n", key);
+    ret = 0;
+
+out:
+    free(image);
+    fclose(cached);
+    return ret;
+}
+
+/**
+ * Put a freshly dumped ROM image into the cache under key. The image goes in
+ * under a temporary name first, so carts dumped in parallel never see half a
+ * file. Failures only cost the next dump its shortcut and aren't fatal.
+ */
+void dump_store(const char *key, const unsigned char *image, size_t count) {
+    char name[128], path[PATH_MAX], tmp[PATH_MAX];
+    int fd;
+
+    snprintf(name, sizeof(name), "%s/%s.gb", DUMP_DIR, key);
+    if (cache_path(name, path, sizeof(path), 1) < 0 ||
+            snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp) ||
+            (fd = mkstemp(tmp)) < 0) {
+        warnx("Can't create the dump cache");
+        return;
+    }
+
+    if (write(fd, image, count) != (ssize_t)count || close(fd) < 0 || rename(tmp, path) < 0) {
+        warn("Can't add %s to the dump cache", key);
+        unlink(tmp);
+    }
+}
+
+/**
+ * Work out where an interrupted transfer between the cart and file picks up.
+ * The journal has to be for the same transfer, and the first bytes of file it
+ * claims are done have to match its CRC. A write then reads back the window
+ * that may still have been in flight and resumes at its first block that
+ * didn't reach the cart. file is left positioned at the result.
+ *
+ * Returns:
+ *  bytes already done, 0 to start over; *crc is their CRC-32
+ */
+uint32_t resume_offset(ems_dev_t *dev, journal_t *j, FILE *file, const char *name,
+        int blocksize, uint32_t *crc) {
+    unsigned char *data, *cart;
+    uint32_t offset, from, pos, len;
+
+    *crc = 0;
+    if (journal_load(j) < 0) {
+        if (opts.verbose)
+            printf("No journal for %s, starting from the beginning\n", name);
+        return 0;
+    }
+
+    offset = j->offset;
+    data = malloc(offset > 0 ? offset : 1);
+    if (data == NULL)
+        fail(1, "malloc");
+
+    rewind(file);
+    if ((offset > 0 && fread(data, offset, 1, file) != 1) || crc32_update(0, data, offset) != j->crc) {
+        warnx("%s changed since the interrupted run, starting from the beginning", name);
+        free(data);
+        rewind(file);
+        return 0;
+    }
+
+    if (j->write && offset > 0) {
+        from = offset > j->window ? (offset - j->window) / blocksize * blocksize : 0;
+        cart = malloc(offset - from);
+        if (cart == NULL)
+            fail(1, "malloc");
+
+        if (ems_read_async(dev, j->space, j->base + from, cart, offset - from,
+                    cart_blocksize(dev, 0), opts.depth, NULL, NULL) < 0) {
+            // can't tell how much of the window made it, write all of it
+            offset = from;
+        } else {
+            for (pos = from; pos < offset; pos += len) {
+                len = offset - pos < (uint32_t)blocksize ? offset - pos : (uint32_t)blocksize;
+                if (memcmp(cart + pos - from, data + pos, len) != 0)
+                    break;
+            }
+            offset = pos;
+        }
+        free(cart);
+    }
+
+    *crc = crc32_update(0, data, offset);
+    j->offset = offset;
+    j->crc = *crc;
+    free(data);
+
+    fseek(file, offset, SEEK_SET);
+    if (opts.verbose)
+        printf("Resuming %s at offset %u\n", name, offset);
+    return offset;
+}
+
+/**
+ * A transfer failed part way: save its journal for --resume.
+ */
+void keep_journal(journal_t *j) {
+    // nothing to pick up
+    if (j->offset == 0) {
+        journal_remove(j);
+        return;
+    }
+
+    journal_save(j);
+    if (!j->failed)
+        warnx("Run again with --resume to continue from offset %u", j->offset);
+}
+
+/* one file of a MODE_READ run and the part of the cart that goes into it */
+typedef struct _dump_t {
+    const char *file;
+    uint32_t base;
+    size_t count;
+    char key[64];               // dump cache key, empty for none
+    unsigned char header[HEADER_GLOBALCHKSUM + 2];  // read by plan_dump
+    int planned;
+    FILE *out;
+    unsigned char *map;         // with --mmap
+    read_state_t st;
+    pthread_t saver;
+    journal_t journal;
+    uint32_t resume;            // bytes kept from an interrupted run
+    archive_writer_t *archive;  // with --compress
+} dump_t;
+
+/* the dumps of a run, for the block callback */
+typedef struct _dump_set_t {
+    dump_t *dumps;
+    int n;
+} dump_set_t;
+
+/**
+ * Read the header block of the ROM at base. A batch keeps the headers of
+ * both banks, and only reads them again after a step writes the bank.
+ *
+ * Returns:
+ *  0       success
+ *  < 0     error reading the cart
+ */
+int read_header(ems_dev_t *dev, uint32_t base, unsigned char *buf) {
+    int bank = base / BANK_SIZE;
+    int cached = batching && base % BANK_SIZE == 0 && bank < 2;
+    int r;
+
+    if (cached && header_cache[bank].valid) {
+        memcpy(buf, header_cache[bank].buf, HEADER_BLOCK);
+        return 0;
+    }
+
+    r = ems_read(dev, FROM_ROM, base, buf, HEADER_BLOCK);
+    if (r < 0)
+        return r;
+
+    if (cached) {
+        memcpy(header_cache[bank].buf, buf, HEADER_BLOCK);
+        header_cache[bank].valid = 1;
+    }
+    return 0;
+}
+
+/**
+ * Plan the dump of a ROM: read its header to trim the transfer to the size it
+ * gives and to get its cache key.
+ *
+ * Returns:
+ *  0       success
+ *  1       the header can't be read, already reported
+ */
+int plan_dump(ems_dev_t *dev, dump_t *d) {
+    unsigned char header[HEADER_BLOCK];
+    int r;
+
+    r = read_header(dev, d->base, header);
+    if (r < 0) {
+        warnx("Couldn't read ROM header at offset %u, len %d", d->base, HEADER_BLOCK);
+        return 1;
+    }
+
+    memcpy(d->header, header, sizeof(d->header));
+    d->planned = 1;
+
+    if (header_romsize(header) != 0 && header_romsize(header) < d->count)
+        d->count = header_romsize(header);
+    else if (header_romsize(header) == 0 && opts.verbose)
+        printf("Unknown ROM size code at 0x%X, reading the whole bank\n", d->base);
+
+    // the same cart dumped before can come from the cache
+    if (!opts.cache || header_key(header, d->key, sizeof(d->key)) < 0 ||
+            header_romsize(header) != d->count)
+        d->key[0] = '\0';
+
+    return 0;
+}
+
+/**
+ * Called by ems_read_vec for each block: pass it on to the dump it belongs to.
+ */
+int dump_block(uint32_t addr, unsigned char *block, size_t count, void *arg) {
+    dump_set_t *set = arg;
+    int i;
+
+    for (i = 0; i < set->n; ++i)
+        if (addr >= set->dumps[i].base && addr < set->dumps[i].base + set->dumps[i].count)
+            return read_block(addr, block, count, &set->dumps[i].st);
+    return 1;
+}
+
+/**
+ * Report the checks a ROM dump went through on its way in: logo, global
+ * checksum and CRC-32. Only a dump whose header passed its checksum when it
+ * was planned is checked, an empty bank or one of unknown size has no
+ * checksums to go by; a dump cut short has nothing to report. Plenty of
+ * ROMs carry a wrong global checksum, so that is only a warning; a header
+ * that changed during the dump is what makes it bad.
+ *
+ * Returns:
+ *  0       the dump checks out, or wasn't checked
+ *  1       it's bad, already reported
+ */
+int check_dump(dump_t *d) {
+    static const char *logos[] = { "FAIL", "CGB only", "OK" };
+    const header_check_t *c = &d->st.check;
+    int global;
+
+    if (d->st.mismatch) {
+        warnx("The ROM header changed while dumping into %s, bad dump", d->file);
+        return 1;
+    }
+    if (d->st.expect == NULL || c->len != d->count)
+        return 0;
+
+    global = header_check_global(c);
+    if (opts.verbose || !global)
+        printf("Checked %s: logo %s, global checksum %s, CRC-32 %08x\n", d->file,
+                logos[header_logo(c->head)], global ? "OK" : "FAIL", d->st.crc);
+
+    if (!global)
+        warnx("%s fails its global checksum, a bad dump unless the ROM has a wrong one", d->file);
+    return 0;
+}
+
+/**
+ * Save several parts of the cart into their files, all in one transfer so
+ * the link doesn't idle between them. Cached ROMs are copied instead.
+ *
+ * Returns:
+ *  0       success
+ *  1       failure, already reported
+ */
+int read_dumps(ems_dev_t *dev, int space, dump_t *dumps, int n) {
+    int blocksize = cart_blocksize(dev, 0);
+    ems_extent_t ext[n];
+    dump_set_t set = { dumps, 0 };
+    size_t total = 0;
+    uint32_t crc = 0;
+    char name[80];
+    int i, r, next = 0, ret = 0, bad;
+
+    device_name(dev, name, sizeof(name));
+
+    for (i = 0; i < n; ++i) {
+        dump_t *d = &dumps[i];
+
+        // mapping needs the file open for reading as well, so does resuming
+        d->out = NULL;
+        if (opts.resume)
+            d->out = fopen(d->file, "r+");
+        if (d->out == NULL)
+            d->out = fopen(d->file, opts.mmap ? "w+" : "w");
+        if (d->out == NULL) {
+            warn("Can't open %s for writing", d->file);
+            ret = 1;
+            break;
+        }
+
+        if (opts.verbose && space == FROM_ROM)
+            printf("Saving ROM into %s\n", d->file);
+        else if (opts.verbose)
+            printf("Saving SAVE into %s\n", d->file);
+
+        if (d->key[0] != '\0') {
+            r = dump_lookup(dev, d->key, d->base, d->count, d->out);
+            if (r <= 0) {
+                if (fclose(d->out) != 0 && r == 0) {
+                    warn("Can't write %s", d->file);
+                    r = -1;
+                }
+                d->out = NULL;
+                if (r == 0 && opts.verbose)
+                    printf("Successfully wrote %zu bytes into %s\n", d->count, d->file);
+                ret |= r < 0;
+                continue;
+            }
+        }
+
+        // dumps that get a transfer go first, moved before the saver holds on to them
+        if (next != i) {
+            dump_t tmp = *d;
+            *d = dumps[next];
+            dumps[next] = tmp;
+            d = &dumps[next];
+        }
+
+        journal_init(&d->journal, d->file, name, 0, space, d->base, d->count);
+        d->archive = NULL;
+        d->resume = 0;
+        if (opts.resume) {
+            d->resume = resume_offset(dev, &d->journal, d->out, d->file, blocksize, &crc);
+            if (ftruncate(fileno(d->out), d->resume) < 0) {
+                warn("Can't truncate %s", d->file);
+                d->resume = 0;
+            }
+        }
+
+        d->st = (read_state_t) {
+            .file       = d->out,
+            .total      = d->count - d->resume,
+            .journal    = opts.compress ? NULL : &d->journal,
+            .resumed    = d->resume,
+            .crc        = crc,
+            .expect     = d->planned && d->resume == 0 && header_checksum_ok(d->header) &&
+                header_romsize(d->header) == d->count ? d->header : NULL,
+            .opts       = &opts,
+        };
+        pthread_mutex_init(&d->st.lock, NULL);
+        pthread_cond_init(&d->st.cond, NULL);
+
+        if (opts.mmap) {
+            // read straight into the file's pages
+            int fd = fileno(d->out);
+
+            if (ftruncate(fd, d->count) < 0 || (d->map = mmap(NULL, d->count,
+                            PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+                warn("Can't map %s", d->file);
+                fclose(d->out);
+                d->out = NULL;
+                ret = 1;
+                break;
+            }
+            d->st.file = NULL;
+            ext[next] = (ems_extent_t) { d->base + d->resume, d->map + d->resume, d->count - d->resume };
+        } else {
+            // the whole transfer lands in buf, blocks are saved as they arrive
+            d->st.buf = malloc(d->count - d->resume + 1);
+            if (d->st.buf == NULL) {
+                warn("malloc");
+                fclose(d->out);
+                d->out = NULL;
+                ret = 1;
+                break;
+            }
+            if (opts.compress && (d->archive = d->st.archive = archive_create(d->out, d->count)) == NULL) {
+                free(d->st.buf);
+                d->st.buf = NULL;
+                fclose(d->out);
+                d->out = NULL;
+                ret = 1;
+                break;
+            }
+            if (pthread_create(&d->saver, NULL, save_blocks, &d->st) != 0) {
+                warnx("Can't start saving %s", d->file);
+                if (d->archive != NULL)
+                    archive_finish(d->archive);
+                free(d->st.buf);
+                d->st.buf = NULL;
+                fclose(d->out);
+                d->out = NULL;
+                ret = 1;
+                break;
+            }
+            ext[next] = (ems_extent_t) { d->base + d->resume, d->st.buf, d->count - d->resume };
+        }
+
+        total += d->count - d->resume;
+        ++next;
+    }
+
+    set.n = next;
+    r = 0;
+    if (ret == 0 && next > 0)
+        r = ems_read_vec(dev, space, ext, next, blocksize, opts.depth, dump_block, &set);
+    if (r < 0) {
+        warnx("Can't read %d bytes from the cart", blocksize);
+        ret = 1;
+    }
+
+    for (i = 0; i < next; ++i) {
+        dump_t *d = &dumps[i];
+
+        if (d->map == NULL) {
+            pthread_mutex_lock(&d->st.lock);
+            d->st.done = 1;
+            pthread_cond_signal(&d->st.cond);
+            pthread_mutex_unlock(&d->st.lock);
+            pthread_join(d->saver, NULL);
+        }
+
+        bad = check_dump(d);
+        ret |= bad;
+
+        // a resumed read only has the whole image when it's mapped
+        if (d->key[0] != '\0' && r == (int)total && !bad && (d->map != NULL || d->resume == 0))
+            dump_store(d->key, d->map != NULL ? d->map : d->st.buf, d->count);
+
+        if (d->map != NULL)
+            munmap(d->map, d->count);
+        free(d->st.buf);
+
+        if (d->archive != NULL) {
+            // an archive cut short is left without an index
+            if (archive_finish(d->archive) < 0 && d->st.offset == d->count)
+                d->st.failed = 1;
+        } else if (d->resume + d->st.offset == d->count) {
+            journal_remove(&d->journal);
+        } else if (fflush(d->out) == 0) {
+            keep_journal(&d->journal);
+        }
+        fclose(d->out);
+
+        if (d->st.failed) {
+            ret = 1;
+        } else if (r >= 0 && d->resume + d->st.offset == d->count && opts.verbose) {
+            printf("Successfully wrote %zu bytes into %s\n", d->count, d->file);
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * Read the ROM or SAVE from the cart and save it into file.
+ *
+ * Returns:
+ *  0       success
+ *  1       failure, already reported
+ */
+int read_cart(ems_dev_t *dev, const char *file, uint32_t base) {
+    int space = file_space(file);
+    dump_t d = { .file = file, .base = base, .count = limits[space] };
+
+    // a ROM is read up to the size its header gives
+    if (space == FROM_ROM && plan_dump(dev, &d) != 0)
+        return 1;
+
+    return read_dumps(dev, space, &d, 1);
+}
+
+/* running checksums of what --verify reads back, one per range */
+typedef struct _verify_state_t {
+    const ems_extent_t *ext;
+    uint32_t *crc;
+    int n;
+    uint32_t done;
+    uint32_t size;
+} verify_state_t;
+
+/**
+ * Called by ems_read_vec for each block read back: hash it into its range
+ * and move on, the block's buffer is reused right away.
+ */
+int verify_block(uint32_t addr, unsigned char *block, size_t count, void *arg) {
+    verify_state_t *st = arg;
+    int i;
+
+    // blocks come in the order of the ranges, and never straddle two
+    for (i = 0; i < st->n - 1 && addr >= st->ext[i].offset + st->ext[i].count; ++i)
+        ;
+    st->crc[i] = crc32_update(st->crc[i], block, count);
+    st->done += count;
+    show_progress("Verifying", st->done, st->size);
+    return 0;
+}
+
+/**
+ * Read n ranges back from the cart in one queue and check each hashes to its
+ * crc, the CRC-32 of what was written there. Only the streaming ring is
+ * allocated.
+ *
+ * Returns:
+ *  0       the cart matches
+ *  1       mismatch or read error, already reported
+ */
+int verify_ranges(ems_dev_t *dev, int space, const ems_extent_t *ext, const uint32_t *crc, int n) {
+    uint32_t *got = calloc(n, sizeof(*got));
+    verify_state_t st = { .ext = ext, .crc = got, .n = n, .done = 0, .size = 0 };
+    int i, r, ret = 0;
+
+    if (got == NULL)
+        fail(1, "calloc");
+    for (i = 0; i < n; ++i)
+        st.size += ext[i].count;
+
+    if (opts.verbose)
+        printf("Verifying %u bytes\n", st.size);
+
+    r = ems_read_vec(dev, space, ext, n, cart_blocksize(dev, 0), opts.depth, verify_block, &st);
+    if (r < 0) {
+        warnx("Can't read back %u bytes at offset %u", st.size, ext[0].offset);
+        free(got);
+        return 1;
+    }
+
+    for (i = 0; i < n; ++i) {
+        if (got[i] != crc[i]) {
+            warnx("Verify failed at offset %u: cart has CRC32 %08x, file has %08x",
+                    ext[i].offset, got[i], crc[i]);
+            ret = 1;
+        } else if (opts.verbose) {
+            printf("Verified, CRC32 %08x\n", crc[i]);
+        }
+    }
+
+    free(got);
+    return ret;
+}
+
+/**
+ * Read count bytes at base back from the cart and check they hash to crc.
+ */
+int verify_cart(ems_dev_t *dev, int space, uint32_t base, uint32_t count, uint32_t crc) {
+    ems_extent_t ext = { base, NULL, count };
+
+    return verify_ranges(dev, space, &ext, &crc, 1);
+}
+
+/**
+ * Read the next count bytes of a write's input, a plain file or an archive.
+ *
+ * Returns:
+ *  1       all count bytes were read
+ *  0       the input ends before that
+ *  -1      a damaged archive, already reported
+ */
+int read_input(FILE *file, archive_reader_t *archive, unsigned char *buf, size_t count) {
+    int r;
+
+    if (archive == NULL)
+        return fread(buf, count, 1, file) == 1;
+
+    r = archive_read(archive, buf, count);
+    return r < 0 ? -1 : r == (int)count;
+}
+
+/**
+ * Close the input of a write.
+ */
+void close_input(FILE *file, archive_reader_t *archive) {
+    if (archive != NULL)
+        archive_close(archive);
+    fclose(file);
+}
+
+/**
+ * Write count bytes of 0xFF at addr, in blocks.
+ *
+ * Returns:
+ *  >= 0    number of bytes written (== count)
+ *  < 0     error writing the cart
+ */
+int write_fill(ems_dev_t *dev, int space, uint32_t addr, uint32_t count, int blocksize) {
+    unsigned char *payload;
+    uint32_t pos;
+    int r;
+
+    for (pos = 0; pos < count; pos += blocksize) {
+        payload = ems_write_buf(dev, blocksize);
+        if (payload == NULL)
+            fail(1, "malloc");
+        memset(payload, 0xff, blocksize);
+
+        r = ems_write_submit(dev, space, addr + pos, payload, blocksize);
+        if (r < 0)
+            return r;
+    }
+    return count;
+}
+
+/**
+ * Write a run of count erased bytes at addr. The flash sectors the run covers
+ * whole are read back and skipped where the cart has them erased already,
+ * the rest is written as it is. Only whole sectors are skipped because
+ * reading 0xFF only shows a block is erased now: flash that erases a sector
+ * when a write hits its first byte would leave the rest of a sector stale if
+ * its first block were skipped. A sector that isn't skipped is written from
+ * its start.
+ *
+ * Returns:
+ *  >= 0    number of bytes actually written
+ *  < 0     error reading or writing the cart
+ */
+int write_erased(ems_dev_t *dev, int space, uint32_t addr, uint32_t count, int blocksize) {
+    unsigned char *cart;
+    ems_caps_t caps;
+    uint32_t first, end, pos, written;
+    int r, readsize = cart_blocksize(dev, 0);
+
+    ems_get_caps(dev, &caps);
+    if (caps.sector == 0 || caps.sector % blocksize != 0)
+        return write_fill(dev, space, addr, count, blocksize);
+
+    first = (addr + caps.sector - 1) / caps.sector * caps.sector;
+    end = (addr + count) / caps.sector * caps.sector;
+    if (first >= end)
+        return write_fill(dev, space, addr, count, blocksize);
+
+    // up to the first whole sector, and what the cart holds there may still
+    // be on its way
+    r = write_fill(dev, space, addr, first - addr, blocksize);
+    if (r >= 0)
+        r = ems_write_flush(dev);
+    if (r < 0)
+        return r;
+    written = first - addr;
+
+    cart = malloc(caps.sector);
+    if (cart == NULL)
+        fail(1, "malloc");
+
+    for (pos = first; pos < end; pos += caps.sector) {
+        r = ems_read_async(dev, space, pos, cart, caps.sector, readsize, opts.depth, NULL, NULL);
+        if (r >= 0 && ems_erased(cart, caps.sector))
+            continue;
+        if (r >= 0)
+            r = write_fill(dev, space, pos, caps.sector, blocksize);
+        if (r < 0) {
+            free(cart);
+            return r;
+        }
+        written += caps.sector;
+    }
+    free(cart);
+
+    r = write_fill(dev, space, end, addr + count - end, blocksize);
+    if (r < 0)
+        return r;
+    written += r;
+    return written;
+}
+
+/* one file of a MODE_WRITE run on its way to the cart */
+typedef struct _write_job_t {
+    const char *file;
+    int space;
+    uint32_t base;
+    uint32_t limit;             // most bytes the file may have
+    int size;                   // of the input, decompressed
+    FILE *input;
+    archive_reader_t *archive;  // NULL for a plain file
+    journal_t journal;
+    int journaled;              // not with --diff or an archive
+    uint32_t offset;            // bytes sent so far
+    uint32_t crc;               // CRC-32 of those bytes
+    uint32_t skipped;           // of them, 0xFF the cart had erased already
+} write_job_t;
+
+/**
+ * Open the ROM or SAVE in file for writing to the cart at base, set up the
+ * write pool and work out where --resume picks up. Nothing is sent yet, so
+ * several jobs can be opened and then sent into the pool back to back.
+ *
+ * Params:
+ *  limit   most bytes the file may have, 0 for a bank or the SRAM
+ *
+ * Returns:
+ *  0       success, the job has to be closed with write_close
+ *  1       failure, already reported
+ */
+int write_open(ems_dev_t *dev, write_job_t *job, const char *file, uint32_t base, uint32_t limit) {
+    int r, blocksize = cart_blocksize(dev, 1);
+    char name[80];
+
+    memset(job, 0, sizeof(*job));
+    job->file = file;
+    job->space = file_space(file);
+    job->base = base;
+    job->limit = limit != 0 ? limit : limits[job->space];
+
+    job->input = fopen(file, "r");
+    if (job->input == NULL) {
+        if (job->space == TO_ROM)
+            warn("Can't open ROM file %s", file);
+        else
+            warn("Can't open SAVE file %s", file);
+        return 1;
+    }
+
+    fseek(job->input, 0L, SEEK_END);
+    job->size = ftell(job->input);
+    rewind(job->input);
+
+    // archives are decompressed on the fly
+    if (archive_is(job->input)) {
+        job->archive = archive_open(job->input);
+        if (job->archive == NULL) {
+            warnx("Can't read the archive %s", file);
+            fclose(job->input);
+            return 1;
+        }
+        job->size = archive_size(job->archive);
+    }
+
+    if(job->size > (int)job->limit && job->space == TO_ROM) {
+        warnx("ROM file %s is %d bytes large, max is %u", file, job->size, job->limit);
+        close_input(job->input, job->archive);
+        return 1;
+    } else if(job->size > (int)job->limit && job->space == TO_SRAM) {
+        warnx("SAVE file %s is %d bytes large, max is %u", file, job->size, job->limit);
+        close_input(job->input, job->archive);
+        return 1;
+    }
+
+    if (opts.verbose && job->space == TO_ROM)
+        printf("Writing ROM file %s\n", file);
+    else if (opts.verbose)
+        printf("Writing SAVE file %s\n", file);
+
+    r = ems_write_batch(dev, opts.batch);
+    if (r == 0)
+        r = ems_write_pool(dev, opts.depth, blocksize);
+    if (r < 0) {
+        warnx("Can't set up write buffers");
+        close_input(job->input, job->archive);
+        return 1;
+    }
+
+    // --diff already skips whatever made it onto the cart, so it has no
+    // journal; nor does an archive, whose CRC is of the compressed file
+    job->journaled = !opts.diff && job->archive == NULL;
+    device_name(dev, name, sizeof(name));
+    journal_init(&job->journal, file, name, 1, job->space, base, job->size);
+    job->journal.window = opts.depth * (opts.batch > blocksize ? opts.batch : blocksize);
+    if (opts.resume && job->journaled)
+        job->offset = resume_offset(dev, &job->journal, job->input, file, blocksize, &job->crc);
+
+    return 0;
+}
+
+/**
+ * A write stopped part way: keep its journal for --resume.
+ */
+void write_failed(write_job_t *job) {
+    if (job->journaled)
+        keep_journal(&job->journal);
+}
+
+/**
+ * Send an open job into the write pool. The pool isn't flushed at the end,
+ * so the next job's blocks follow right behind and the link doesn't idle in
+ * between; write_finish waits for all of them.
+ *
+ * Returns:
+ *  0       the whole file is queued
+ *  1       failure, already reported
+ */
+int write_send(ems_dev_t *dev, write_job_t *job) {
+    int r, space = job->space, size = job->size;
+    int blocksize = cart_blocksize(dev, 1);
+    uint32_t base = job->base, limit = job->limit;
+
+    if (opts.mmap || opts.diff) {
+        // the whole image is addressable: mapped, or read into buf
+        size_t count = size < (int)limit ? size : limit, len;
+        unsigned char *data = NULL, *map = NULL, *buf = NULL, *payload;
+
+        if (count > 0 && opts.mmap && job->archive == NULL) {
+            map = mmap(NULL, count, PROT_READ, MAP_PRIVATE, fileno(job->input), 0);
+            if (map == MAP_FAILED) {
+                warn("Can't map %s", job->file);
+                return 1;
+            }
+            data = map;
+        } else if (count > 0) {
+            data = buf = malloc(count);
+            if (buf == NULL)
+                fail(1, "malloc");
+            if (read_input(job->input, job->archive, buf, count) != 1) {
+                warn("Can't read %zu bytes from %s", count, job->file);
+                free(buf);
+                return 1;
+            }
+        }
+
+        if (opts.diff) {
+            r = write_diff(dev, space, base, data, count, blocksize);
+            if (r >= 0 && opts.verbose)
+                printf("Rewrote %d of %zu bytes where the cart differed\n", r, count);
+            job->crc = crc32_update(job->crc, data, count);
+            job->offset = count;
+        } else {
+            for (r = 0; job->offset < count; job->offset += len) {
+                len = count - job->offset < (size_t)blocksize ? count - job->offset : (size_t)blocksize;
+
+                payload = ems_write_buf(dev, len);
+                if (payload == NULL) {
+                    r = -1;
+                    break;
+                }
+                memcpy(payload, data + job->offset, len);
+                r = ems_write_submit(dev, space, base + job->offset, payload, len);
+                if (r < 0)
+                    break;
+
+                job->crc = crc32_update(job->crc, payload, len);
+                if (job->journaled)
+                    journal_update(&job->journal, job->offset + len, job->crc, NULL);
+                show_progress("Writing", job->offset + len, size);
+            }
+        }
+
+        if (map != NULL)
+            munmap(map, count);
+        free(buf);
+
+        if (r < 0) {
+            warnx("Can't write %zu bytes at offset %u", count, base);
+            write_failed(job);
+            return 1;
+        }
+    } else {
+        // blocks are read straight into the write pool's payload slots
+        unsigned char *payload, *held = NULL;
+        uint32_t offset = job->offset, crc = job->crc, len;
+        uint32_t run = 0;       // erased bytes before offset, not written yet
+        int sparse = space == TO_ROM;
+        int got = 0;
+
+        while (offset < (uint32_t)size) {
+            // a file that doesn't fill its last block ends in a short one
+            len = size - offset < (uint32_t)blocksize ? size - offset : (uint32_t)blocksize;
+            payload = ems_write_buf(dev, len);
+            if (payload == NULL)
+                fail(1, "malloc");
+            if ((got = read_input(job->input, job->archive, payload, len)) != 1)
+                break;
+
+            // hash while the payload is still hot in cache
+            crc = crc32_update(crc, payload, len);
+
+            // 0xFF padding is only written where the flash isn't erased, the
+            // payload slot is simply handed out again for the next block
+            if (sparse && len == (uint32_t)blocksize && ems_erased(payload, len)) {
+                run += len;
+                offset += len;
+                show_progress("Writing", offset, size);
+                continue;
+            }
+
+            r = 0;
+            if (run > 0) {
+                // the run goes through the pool too, keep this block aside
+                if (held == NULL && (held = malloc(blocksize)) == NULL)
+                    fail(1, "malloc");
+                memcpy(held, payload, len);
+
+                r = write_erased(dev, space, base + offset - run, run, blocksize);
+                if (r >= 0) {
+                    job->skipped += run - r;
+                    run = 0;
+                    payload = ems_write_buf(dev, len);
+                    if (payload == NULL)
+                        fail(1, "malloc");
+                    memcpy(payload, held, len);
+                }
+            }
+
+            if (r >= 0)
+                r = ems_write_submit(dev, space, offset + base, payload, len);
+            if (r < 0) {
+                warnx("Can't write %u bytes at offset %u", len, offset);
+                job->offset = offset;
+                write_failed(job);
+                free(held);
+                return 1;
+            }
+
+            offset += len;
+            if (job->journaled)
+                journal_update(&job->journal, offset, crc, NULL);
+            show_progress("Writing", offset, size);
+        }
+        free(held);
+
+        r = run > 0 ? write_erased(dev, space, base + offset - run, run, blocksize) : 0;
+        if (r >= 0)
+            job->skipped += run - r;
+        job->offset = offset;
+        job->crc = crc;
+        if (r < 0) {
+            warnx("Can't write %d bytes before offset %u", blocksize, offset);
+            write_failed(job);
+            return 1;
+        }
+        if (offset < (uint32_t)size) {
+            warnx("Stopped at offset %u, the rest of %s can't be read", offset, job->file);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Wait for the n jobs sent into the write pool to reach the cart, and drop
+ * their journals.
+ *
+ * Returns:
+ *  0       success
+ *  1       failure, already reported
+ */
+int write_finish(ems_dev_t *dev, write_job_t *jobs, int n) {
+    int i, r = ems_write_flush(dev);
+
+    for (i = 0; i < n; ++i) {
+        if (r < 0) {
+            warnx("Can't write %s before offset %u", jobs[i].file, jobs[i].offset);
+            write_failed(&jobs[i]);
+            continue;
+        }
+
+        if (jobs[i].journaled)
+            journal_remove(&jobs[i].journal);
+        if (opts.verbose && jobs[i].skipped > 0)
+            printf("Skipped %u bytes of 0xFF the cart has erased already\n", jobs[i].skipped);
+        if (opts.verbose)
+            printf("Successfully wrote %u bytes from %s\n", jobs[i].offset, jobs[i].file);
+    }
+
+    return r < 0;
+}
+
+/**
+ * Close the input of a job.
+ */
+void write_close(write_job_t *job) {
+    close_input(job->input, job->archive);
+}
+
+/**
+ * Write the ROM or SAVE in file to the cart.
+ *
+ * Params:
+ *  limit   most bytes the file may have, 0 for a bank or the SRAM
+ *
+ * Returns:
+ *  0       success
+ *  1       failure, already reported
+ */
+int write_cart(ems_dev_t *dev, const char *file, uint32_t base, uint32_t limit) {
+    write_job_t job;
+    int r;
+
+    if (write_open(dev, &job, file, base, limit) != 0)
+        return 1;
+
+    r = write_send(dev, &job);
+    if (r == 0)
+        r = write_finish(dev, &job, 1);
+    else
+        ems_write_flush(dev);
+    write_close(&job);
+
+    if (r == 0 && opts.verify)
+        return verify_cart(dev, job.space, base, job.offset, job.crc);
+
+    return r;
+}
+
+/**
+ * Load the region hashes of the last sync of file with this cart.
+ *
+ * Returns:
+ *  0       success
+ *  -1      no usable manifest: missing, or for a file of another size
+ */
+int load_manifest(const char *path, uint32_t *hash, size_t regions) {
+    char magic[sizeof(SYNC_MAGIC) - 1];
+    uint32_t count;
+    size_t i;
+    int ret = -1;
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+
+    if (fread(magic, sizeof(magic), 1, file) == 1 &&
+            memcmp(magic, SYNC_MAGIC, sizeof(magic)) == 0 &&
+            fread(&count, sizeof(count), 1, file) == 1 && ntohl(count) == regions &&
+            fread(hash, sizeof(*hash), regions, file) == regions) {
+        for (i = 0; i < regions; ++i)
+            hash[i] = ntohl(hash[i]);
+        ret = 0;
+    }
+
+    fclose(file);
+    return ret;
+}
+
+/**
+ * Replace the manifest at path with the region hashes in hash.
+ */
+void save_manifest(const char *path, const uint32_t *hash, size_t regions) {
+    char tmp[PATH_MAX];
+    uint32_t word;
+    size_t i;
+    FILE *file = NULL;
+    int fd, ok;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp) ||
+            (fd = mkstemp(tmp)) < 0 || (file = fdopen(fd, "w")) == NULL) {
+        warn("Can't save the sync manifest %s", path);
+        return;
+    }
+
+    word = htonl(regions);
+    ok = fwrite(SYNC_MAGIC, sizeof(SYNC_MAGIC) - 1, 1, file) == 1 &&
+        fwrite(&word, sizeof(word), 1, file) == 1;
+    for (i = 0; ok && i < regions; ++i) {
+        word = htonl(hash[i]);
+        ok = fwrite(&word, sizeof(word), 1, file) == 1;
+    }
+
+    if (fclose(file) != 0 || !ok || rename(tmp, path) < 0) {
+        warn("Can't save the sync manifest %s", path);
+        unlink(tmp);
+    }
+}
+
+/**
+ * Keep the count bytes a sync is about to overwrite in file as
+ * FILE.YYYYMMDD-HHMMSS, next to it.
+ *
+ * Returns:
+ *  0       success
+ *  -1      failure, already reported
+ */
+int keep_history(const char *file, const unsigned char *data, size_t count) {
+    char path[PATH_MAX], stamp[32];
+    time_t t = time(NULL);
+    FILE *out;
+    int n = snprintf(path, sizeof(path), "%s", file);
+
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&t));
+    if (n + strlen(stamp) + 1 >= sizeof(path)) {
+        warnx("Can't keep the previous %s, its name is too long", file);
+        return -1;
+    }
+    snprintf(path + n, sizeof(path) - n, ".%s", stamp);
+
+    out = fopen(path, "wx");
+    if (out == NULL) {
+        warn("Can't keep the previous %s as %s", file, path);
+        return -1;
+    }
+    n = fwrite(data, 1, count, out) == count;
+    if (fclose(out) != 0 || !n) {
+        warn("Can't keep the previous %s as %s", file, path);
+        unlink(path);
+        return -1;
+    }
+
+    if (opts.verbose)
+        printf("Kept the previous %s as %s\n", file, path);
+    return 0;
+}
+
+/**
+ * Sync the SAVE in file with the cart's SRAM. Each region is hashed in the
+ * file and on the cart, and compared against its hash at the last sync: a
+ * region changed on one side only is copied to the other, one changed on
+ * both takes the cart's version unless --prefer file. Without a manifest
+ * there is no telling which side changed, so a file that differs from the
+ * cart needs --prefer. The file as it was is kept before the cart's SRAM
+ * goes into it, see keep_history.
+ *
+ * Returns:
+ *  0       success
+ *  1       failure, already reported
+ */
+int sync_save(ems_dev_t *dev, const char *file) {
+    char name[80], path[PATH_MAX];
+    unsigned char *cart, *data, *payload;
+    uint32_t *last, *now;
+    size_t count = SRAM_SIZE, regions, i, pos, len, j, chunk;
+    size_t up = 0, down = 0, conflicts = 0;
+    int blocksize = cart_blocksize(dev, 1);
+    int r, havefile, havelast;
+    long size;
+
+    FILE *save = fopen(file, "r+");
+    havefile = save != NULL;
+    if (save == NULL && (errno != ENOENT || (save = fopen(file, "w+")) == NULL)) {
+        warn("Can't open SAVE file %s", file);
+        return 1;
+    }
+
+    // an existing save is synced at its own size
+    if (havefile) {
+        fseek(save, 0L, SEEK_END);
+        size = ftell(save);
+        rewind(save);
+        if (size > SRAM_SIZE) {
+            warnx("SAVE file %s is %ld bytes large, max is %d", file, size, SRAM_SIZE);
+            fclose(save);
+            return 1;
+        }
+        count = size;
+    }
+    regions = (count + SYNC_REGION - 1) / SYNC_REGION;
+
+    cart = malloc(count > 0 ? count : 1);
+    data = calloc(count > 0 ? count : 1, 1);
+    last = malloc((regions > 0 ? regions : 1) * sizeof(*last));
+    now = malloc((regions > 0 ? regions : 1) * sizeof(*now));
+    if (cart == NULL || data == NULL || last == NULL || now == NULL)
+        fail(1, "malloc");
+
+    if (havefile && count > 0 && fread(data, count, 1, save) != 1) {
+        warn("Can't read %zu bytes from %s", count, file);
+        r = -1;
+        goto out;
+    }
+
+    // the hash sweep: the whole range in large read blocks
+    if (opts.verbose)
+        printf("Reading SRAM for comparison\n");
+    r = ems_read_async(dev, FROM_SRAM, 0, cart, count, cart_blocksize(dev, 0), opts.depth, NULL, NULL);
+    if (r < 0) {
+        warnx("Can't read %zu bytes of SRAM", count);
+        goto out;
+    }
+
+    device_name(dev, name, sizeof(name));
+    snprintf(path, sizeof(path), "%s.%s.sync", file, name);
+    havelast = havefile && load_manifest(path, last, regions) == 0;
+
+    r = ems_write_batch(dev, opts.batch);
+    if (r == 0)
+        r = ems_write_pool(dev, opts.depth, blocksize);
+    if (r < 0) {
+        warnx("Can't set up write buffers");
+        goto out;
+    }
+
+    for (i = 0; i < regions; ++i) {
+        uint32_t incart, infile;
+
+        pos = i * SYNC_REGION;
+        len = count - pos < SYNC_REGION ? count - pos : SYNC_REGION;
+        incart = crc32_update(0, cart + pos, len);
+        infile = crc32_update(0, data + pos, len);
+        now[i] = incart;
+
+        if (havefile && incart == infile)
+            continue;
+
+        // a first sync can't tell which side changed, it has to be told
+        if (havefile && !havelast && opts.prefer == 0) {
+            warnx("%s has never been synced with this cart and differs from it, "
+                    "give --prefer cart or --prefer file", file);
+            r = -1;
+            goto out;
+        }
+
+        // only the file changed, or both did and the file is preferred
+        if (havefile && ((havelast && incart == last[i]) ||
+                    ((!havelast || infile != last[i]) && opts.prefer == SYNC_FILE))) {
+            if (havelast && incart != last[i])
+                ++conflicts;
+
+            // send it up
+            for (j = 0; j < len; j += chunk) {
+                chunk = len - j < (size_t)blocksize ? len - j : (size_t)blocksize;
+                payload = ems_write_buf(dev, chunk);
+                if (payload == NULL) {
+                    warnx("Can't get a write buffer of %zu bytes", chunk);
+                    r = -1;
+                    goto out;
+                }
+                memcpy(payload, data + pos + j, chunk);
+                r = ems_write_submit(dev, TO_SRAM, pos + j, payload, chunk);
+                if (r < 0) {
+                    warnx("Can't write %zu bytes at offset %zu", chunk, pos + j);
+                    goto out;
+                }
+            }
+            now[i] = infile;
+            up += len;
+            continue;
+        }
+
+        if (havelast && infile != last[i])
+            ++conflicts;
+
+        // the cart changed, or both did: bring it down, after keeping the
+        // file as it was
+        if (down == 0 && havefile && keep_history(file, data, count) < 0) {
+            r = -1;
+            goto out;
+        }
+        if (fseek(save, pos, SEEK_SET) != 0 || fwrite(cart + pos, len, 1, save) != 1) {
+            warn("Can't write %zu bytes to %s", len, file);
+            r = -1;
+            goto out;
+        }
+        down += len;
+    }
+
+    r = ems_write_flush(dev);
+    if (r < 0) {
+        warnx("Can't write the changed regions to SRAM");
+        goto out;
+    }
+
+    if (fflush(save) != 0) {
+        warn("Can't write %s", file);
+        r = -1;
+        goto out;
+    }
+
+    save_manifest(path, now, regions);
+
+    if (conflicts > 0)
+        warnx("%zu regions changed in both %s and the cart, kept the %s's", conflicts, file,
+                opts.prefer == SYNC_FILE ? "file" : "cart");
+    if (opts.verbose)
+        printf("Synced %s: %zu bytes to the cart, %zu bytes from it\n", file, up, down);
+
+out:
+    fclose(save);
+    free(cart);
+    free(data);
+    free(last);
+    free(now);
+    return r < 0 ? 1 : 0;
+}
+
+/* the SRAM snapshots a daemon keeps of each of its carts */
+typedef struct _cart_snaps_t {
+    ems_dev_t *dev;
+    snap_store_t *store;
+    struct _cart_snaps_t *next;
+} cart_snaps_t;
+
+cart_snaps_t *cart_snaps = NULL;
+pthread_mutex_t cart_snaps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * The snapshot store of a cart, an empty one made on first use if create is
+ * set. Only the thread running the cart's jobs uses it.
+ *
+ * Returns:
+ *  the store, or NULL if the cart has none
+ */
+snap_store_t *cart_snapshots(ems_dev_t *dev, int create) {
+    cart_snaps_t *c;
+
+    pthread_mutex_lock(&cart_snaps_lock);
+    for (c = cart_snaps; c != NULL && c->dev != dev; c = c->next)
+        ;
+    if (c == NULL && create) {
+        c = calloc(1, sizeof(*c));
+        if (c == NULL) {
+            pthread_mutex_unlock(&cart_snaps_lock);
+            fail(1, "malloc");
+        }
+        c->dev = dev;
+        c->store = snap_create(SRAM_SIZE, SNAP_KEEP);
+        c->next = cart_snaps;
+        cart_snaps = c;
+    }
+    pthread_mutex_unlock(&cart_snaps_lock);
+
+    return c != NULL ? c->store : NULL;
+}
+
+/**
+ * Drop the snapshots of a cart that is about to be closed.
+ */
+void drop_snapshots(ems_dev_t *dev) {
+    cart_snaps_t *c, **cp;
+
+    pthread_mutex_lock(&cart_snaps_lock);
+    for (cp = &cart_snaps; *cp != NULL && (*cp)->dev != dev; cp = &(*cp)->next)
+        ;
+    c = *cp;
+    if (c != NULL)
+        *cp = c->next;
+    pthread_mutex_unlock(&cart_snaps_lock);
+
+    if (c != NULL) {
+        snap_destroy(c->store);
+        free(c);
+    }
+}
+
+/**
+ * Read the whole SRAM into buf, SRAM_SIZE bytes.
+ *
+ * Returns:
+ *  0       success
+ *  -1      failure, already reported
+ */
+int read_sram(ems_dev_t *dev, unsigned char *buf) {
+    int r = ems_read_async(dev, FROM_SRAM, 0, buf, SRAM_SIZE, cart_blocksize(dev, 0), opts.depth, NULL, NULL);
+
+    if (r != SRAM_SIZE) {
+        warnx("Can't read SRAM: %s", r < 0 ? ems_strerror(r) : "short read");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Read SRAM into a new snapshot in the daemon.
+ *
+ * Returns:
+ *  0       success
+ *  1       failure, already reported
+ */
+int snapshot_cart(ems_dev_t *dev) {
+    snap_store_t *store = cart_snapshots(dev, 1);
+    unsigned char *buf = malloc(SRAM_SIZE);
+    snap_info_t info;
+
+    if (buf == NULL)
+        fail(1, "malloc");
+
+    if (read_sram(dev, buf) != 0) {
+        free(buf);
+        return 1;
+    }
+
+    snap_add(store, buf, &info);
+    free(buf);
+
+    printf("Snapshot %u: %d of %d blocks new, %zu KB held\n", info.id, info.fresh,
+            SRAM_SIZE / SNAP_BLOCK, snap_memory(store) / 1024);
+    return 0;
+}
+
+/**
+ * Write a snapshot back to SRAM. Only the blocks that differ from what the
+ * cart holds are written, by what the last snapshot or restore left there;
+ * if that isn't known, SRAM is read first.
+ *
+ * Returns:
+ *  0       success
+ *  1       failure, already reported
+ */
+int restore_cart(ems_dev_t *dev, unsigned int id) {
+    snap_store_t *store = cart_snapshots(dev, 1);
+    int blocksize = cart_blocksize(dev, 1);
+    const unsigned char *want, *have;
+    unsigned char *buf, *payload;
+    size_t i, len, written = 0;
+    int block, blocks = SRAM_SIZE / SNAP_BLOCK, changed = 0, r;
+
+    if (snap_block(store, id, 0) == NULL) {
+        warnx("No snapshot %u, see --snapshots", id);
+        return 1;
+    }
+
+    if (snap_known(store, 0) == NULL) {
+        if (opts.verbose)
+            printf("Reading SRAM for comparison\n");
+        buf = malloc(SRAM_SIZE);
+        if (buf == NULL)
+            fail(1, "malloc");
+        r = read_sram(dev, buf);
+        if (r == 0)
+            snap_track(store, buf);
+        free(buf);
+        if (r != 0)
+            return 1;
+    }
+
+    r = ems_write_batch(dev, opts.batch);
+    if (r == 0)
+        r = ems_write_pool(dev, opts.depth, blocksize);
+    if (r < 0) {
+        warnx("Can't set up write buffers");
+        return 1;
+    }
+
+    for (block = 0; block < blocks && r >= 0; ++block) {
+        want = snap_block(store, id, block);
+        have = snap_known(store, block);
+        // blocks are shared, the same contents are the same block
+        if (want != have)
+            ++changed;
+
+        for (i = 0; want != have && i < SNAP_BLOCK && r >= 0; i += len) {
+            len = SNAP_BLOCK - i < (size_t)blocksize ? SNAP_BLOCK - i : (size_t)blocksize;
+            if (memcmp(want + i, have + i, len) == 0)
+                continue;
+
+            payload = ems_write_buf(dev, len);
+            if (payload == NULL)
+                fail(1, "malloc");
+            memcpy(payload, want + i, len);
+            r = ems_write_submit(dev, TO_SRAM, (uint32_t)block * SNAP_BLOCK + i, payload, len);
+            written += len;
+        }
+        show_progress("Restoring", (uint64_t)(block + 1) * SNAP_BLOCK, SRAM_SIZE);
+    }
+
+    if (r >= 0)
+        r = ems_write_flush(dev);
+    if (r < 0) {
+        // part of it may have gone out
+        snap_forget(store);
+        warnx("Can't restore snapshot %u: %s", id, ems_strerror(r));
+        return 1;
+    }
+
+    snap_restored(store, id);
+    printf("Restored snapshot %u: %zu bytes in %d of %d blocks written\n", id, written, changed, blocks);
+    return 0;
+}
+
+/**
+ * List the snapshots the daemon has of the cart, oldest first.
+ *
+ * Returns:
+ *  0       success
+ */
+int list_snapshots(ems_dev_t *dev) {
+    snap_store_t *store = cart_snapshots(dev, 0);
+    snap_info_t info;
+    char when[32];
+    int i;
+
+    if (store == NULL || snap_info(store, 0, &info) != 0) {
+        printf("No snapshots\n");
+        return 0;
+    }
+
+    for (i = 0; snap_info(store, i, &info) == 0; ++i) {
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&info.taken));
+        printf("%u\t%s\t%d blocks new\n", info.id, when, info.fresh);
+    }
+    printf("%zu KB held\n", snap_memory(store) / 1024);
+    return 0;
+}
+
+/**
+ * Write one flash sector of a packed bank whole, from its start: the parts of
+ * the ROMs that fall into it, streamed from their files into the write pool,
+ * and 0xFF between them.
+ *
+ * Params:
+ *  files   the open files of the slots
+ *  start   offset of the sector in the bank
+ *
+ * Returns:
+ *  0       success
+ *  1       failure, already reported
+ */
+int pack_write(ems_dev_t *dev, const pack_slot_t *slots, FILE **files, int n, uint32_t base,
+        uint32_t start, uint32_t sector, int blocksize, uint32_t *done, uint32_t total) {
+    unsigned char *payload;
+    uint32_t pos, from, to;
+    int i;
+
+    for (pos = start; pos < start + sector; pos += blocksize) {
+        payload = ems_write_buf(dev, blocksize);
+        if (payload == NULL)
+            fail(1, "malloc");
+        memset(payload, 0xff, blocksize);
+
+        for (i = 0; i < n; ++i) {
+            from = pos > slots[i].offset ? pos : slots[i].offset;
+            to = slots[i].offset + slots[i].length;
+            if (to > pos + blocksize)
+                to = pos + blocksize;
+            if (from >= to)
+                continue;
+
+            if (fseek(files[i], from - slots[i].offset, SEEK_SET) != 0 ||
+                    fread(payload + from - pos, to - from, 1, files[i]) != 1) {
+                warnx("Can't read %u bytes from %s", to - from, slots[i].file);
+                return 1;
+            }
+        }
+
+        if (ems_write_submit(dev, TO_ROM, base + pos, payload, blocksize) < 0) {
+            warnx("Can't write %d bytes at offset %u", blocksize, base + pos);
+            return 1;
+        }
+
+        *done += blocksize;
+        show_progress("Writing", *done, total);
+    }
+
+    return 0;
+}
+
+/**
+ * Pack the ROMs in files into one bank, the first at offset 0 as the menu,
+ * and write them. ROMs that the last pack of this bank already put at the
+ * same offset are left alone, so only the ones that moved or changed are
+ * written. Slots are smaller than a flash sector, so what is written is
+ * every sector a changed ROM touches, whole and from its start, with the
+ * parts of unchanged ROMs that share it.
+ *
+ * Returns:
+ *  0       success
+ *  1       failure, already reported
+ */
+int pack_cart(ems_dev_t *dev, char **files, int nfiles, uint32_t base) {
+    pack_slot_t *slots, old[BANK_SIZE / PACK_ALIGN];
+    unsigned char buf[HEADER_BLOCK];
+    char name[80], key[64], layout[128], path[PATH_MAX];
+    int blocksize = cart_blocksize(dev, 1);
+    int i, nold, r = 1, *dirty, *touched;
+    uint32_t done = 0, total = 0, sector, nsectors, s0, s1, j;
+    unsigned char *rewrite = NULL;
+    FILE **input;
+    ems_caps_t caps;
+
+    slots = calloc(nfiles, sizeof(*slots));
+    dirty = calloc(nfiles, sizeof(*dirty));
+    touched = calloc(nfiles, sizeof(*touched));
+    input = calloc(nfiles, sizeof(*input));
+    if (slots == NULL || dirty == NULL || touched == NULL || input == NULL)
+        fail(1, "malloc");
+
+    // rewrites go by whole sectors, or the whole bank if they don't fit it
+    ems_get_caps(dev, &caps);
+    sector = caps.sector > 0 && caps.sector <= BANK_SIZE && BANK_SIZE % caps.sector == 0 &&
+        caps.sector % blocksize == 0 ? caps.sector : BANK_SIZE;
+    nsectors = BANK_SIZE / sector;
+    rewrite = calloc(nsectors, 1);
+    if (rewrite == NULL)
+        fail(1, "malloc");
+
+    for (i = 0; i < nfiles; ++i)
+        if (pack_slot(&slots[i], files[i]) != 0)
+            goto out;
+
+    if (pack_layout(slots, nfiles, BANK_SIZE) != 0) {
+        warnx("The ROMs don't fit in one bank of %d KB", BANK_SIZE / 1024);
+        goto out;
+    }
+
+    device_name(dev, name, sizeof(name));
+    snprintf(layout, sizeof(layout), "%s/%s-%d", LAYOUT_DIR, name, base / BANK_SIZE + 1);
+    if (cache_path(layout, path, sizeof(path), 1) < 0) {
+        warnx("Can't find a cache directory for the layout, is HOME set?");
+        goto out;
+    }
+    nold = opts.cache ? pack_load(path, old, BANK_SIZE / PACK_ALIGN) : -1;
+
+    // a ROM the last layout has in place is kept if the cart still has its
+    // header there, anything else written over it would have changed that
+    for (i = 0; i < nfiles; ++i) {
+        dirty[i] = 1;
+        if (nold > 0 && pack_unchanged(&slots[i], old, nold) &&
+                ems_read(dev, FROM_ROM, base + slots[i].offset, buf, HEADER_BLOCK) >= 0 &&
+                header_key(buf, key, sizeof(key)) == 0 && strcmp(key, slots[i].key) == 0)
+            dirty[i] = 0;
+
+        // the sectors a changed ROM touches are rewritten
+        for (j = slots[i].offset / sector; dirty[i] && j * sector < slots[i].offset + slots[i].length; ++j)
+            rewrite[j] = 1;
+    }
+
+    // and so is every ROM that shares one of them
+    for (i = 0; i < nfiles; ++i) {
+        s0 = slots[i].offset / sector;
+        s1 = (slots[i].offset + slots[i].length - 1) / sector;
+        for (j = s0; j <= s1; ++j)
+            touched[i] |= rewrite[j];
+
+        printf("0x%06x  %5u KB  %-28s %s\n", slots[i].offset, slots[i].size / 1024,
+                slots[i].key, dirty[i] ? "write" : touched[i] ? "rewrite, shares a sector" : "unchanged");
+    }
+    for (j = 0; j < nsectors; ++j)
+        total += rewrite[j] ? sector : 0;
+
+    // until the new layout is complete, the old one no longer describes the cart
+    if (total > 0 && remove(path) < 0 && errno != ENOENT) {
+        warn("Can't remove the layout %s", path);
+        goto out;
+    }
+
+    if (total > 0 && (ems_write_batch(dev, opts.batch) < 0 ||
+                ems_write_pool(dev, opts.depth, blocksize) < 0)) {
+        warnx("Can't set up write buffers");
+        goto out;
+    }
+
+    for (i = 0; i < nfiles && total > 0; ++i) {
+        input[i] = fopen(slots[i].file, "r");
+        if (input[i] == NULL) {
+            warn("Can't open ROM file %s", slots[i].file);
+            goto out;
+        }
+    }
+
+    for (j = 0; j < nsectors; ++j)
+        if (rewrite[j] && pack_write(dev, slots, input, nfiles, base, j * sector, sector,
+                    blocksize, &done, total) != 0)
+            goto out;
+
+    if (total > 0 && ems_write_flush(dev) < 0) {
+        warnx("Can't write the packed bank");
+        goto out;
+    }
+
+    if (opts.verify)
+        for (i = 0; i < nfiles; ++i)
+            if (touched[i] && verify_cart(dev, TO_ROM, base + slots[i].offset,
+                        slots[i].length, slots[i].crc) != 0)
+                goto out;
+
+    if (pack_save(path, slots, nfiles) != 0)
+        warn("Can't save the layout %s, the next pack writes every ROM", path);
+
+    if (opts.verbose)
+        printf("Successfully wrote %u bytes of %d ROMs\n", done, nfiles);
+
+    r = 0;
+out:
+    for (i = 0; i < nfiles; ++i)
+        if (input[i] != NULL)
+            fclose(input[i]);
+    free(input);
+    free(rewrite);
+    free(touched);
+    free(dirty);
+    free(slots);
+    return r;
+}
+
+/**
+ * Print the header of the ROM in both banks.
+ *
+ * Returns:
+ *  0       success
+ *  1       failure, already reported
+ */
+int title_cart(ems_dev_t *dev) {
+    unsigned char buf[HEADER_BLOCK];
+    int r;
+
+    r = read_header(dev, 0, buf);
+    if (r < 0) {
+        warnx("Couldn't read ROM header at bank 0, offset 0, len 512");
+        return 1;
+    }
+
+    printf("Bank 0: \n");
+    header_info(buf);
+
+    // readability.
+    printf("\n");
+
+    r = read_header(dev, BANK_SIZE, buf);
+    if (r < 0) {
+        warnx("Couldn't read ROM header at bank 1, offset 0, len 512");
+        return 1;
+    }
+
+    printf("Bank 1: \n");
+    header_info(buf);
+
+    return 0;
+}
+
+/**
+ * --bank all: read both banks in one go, into one file each or into a single
+ * image of the whole flash.
+ *
+ * Returns:
+ *  0       success
+ *  1       failure, already reported
+ */
+int read_banks(ems_dev_t *dev, char **files, int nfiles) {
+    dump_t d[2] = {
+        { .file = files[0], .base = 0, .count = nfiles == 1 ? 2 * BANK_SIZE : BANK_SIZE },
+        { .file = nfiles == 2 ? files[1] : NULL, .base = BANK_SIZE, .count = BANK_SIZE },
+    };
+
+    // a whole image keeps both banks at full size, so bank 2 stays in place
+    if (nfiles == 1)
+        return read_dumps(dev, FROM_ROM, d, 1);
+
+    if (plan_dump(dev, &d[0]) != 0 || plan_dump(dev, &d[1]) != 0)
+        return 1;
+    return read_dumps(dev, FROM_ROM, d, 2);
+}
+
+/**
+ * --bank all: write one file to each bank, or a single image of up to the
+ * whole flash across both. Both files go through the write pool as one
+ * schedule, bank 2's blocks right behind bank 1's, and the pool only drains
+ * once at the end. --verify then reads both banks back in one queue.
+ *
+ * Returns:
+ *  0       success
+ *  1       failure, already reported
+ */
+int write_banks(ems_dev_t *dev, char **files, int nfiles) {
+    write_job_t jobs[2];
+    ems_extent_t ext[2];
+    uint32_t crc[2];
+    int i, r;
+
+    if (nfiles == 1)
+        return write_cart(dev, files[0], 0, 2 * BANK_SIZE);
+
+    if (write_open(dev, &jobs[0], files[0], 0, 0) != 0)
+        return 1;
+    if (write_open(dev, &jobs[1], files[1], BANK_SIZE, 0) != 0) {
+        write_close(&jobs[0]);
+        return 1;
+    }
+
+    for (i = 0; i < 2 && write_send(dev, &jobs[i]) == 0; ++i)
+        ;
+    // what made it into the pool is finished either way
+    r = write_finish(dev, jobs, i) || i < 2;
+
+    for (i = 0; i < 2; ++i) {
+        ext[i] = (ems_extent_t){ jobs[i].base, NULL, jobs[i].offset };
+        crc[i] = jobs[i].crc;
+        write_close(&jobs[i]);
+    }
+
+    if (r == 0 && opts.verify)
+        return verify_ranges(dev, TO_ROM, ext, crc, 2);
+
+    return r;
+}
+
+/**
+ * Run the selected mode on one cart.
+ */
+int run_mode(ems_dev_t *dev, const char *file) {
+    int run_batch(ems_dev_t *dev, const char *file);
+    uint32_t base = opts.bank * BANK_SIZE;
+    ems_policy_t policy;
+    // with --all every cart gets a single file, an image of both banks
+    char **files = opts.all ? (char **)&file : opts.files;
+    int nfiles = opts.all ? 1 : opts.nfiles;
+
+    device_name(dev, opts.cart, sizeof(opts.cart));
+
+    // every job starts from the library's policy, a daemon's jobs too
+    ems_set_policy(dev, NULL);
+    ems_get_policy(dev, &policy);
+    if (opts.timeout > 0)
+        policy.command_timeout = policy.data_timeout = opts.timeout;
+    if (opts.retries >= 0)
+        policy.retries = opts.retries;
+    ems_set_policy(dev, &policy);
+
+    // a job writing SRAM leaves it in a state the snapshots don't know
+    if (opts.mode == MODE_SYNC || opts.mode == MODE_CALIBRATE ||
+            (opts.mode == MODE_WRITE && opts.bank != BANK_ALL && file_space(file) == TO_SRAM)) {
+        snap_store_t *store = cart_snapshots(dev, 0);
+        if (store != NULL)
+            snap_forget(store);
+    }
+
+    if (opts.bank == BANK_ALL && opts.mode == MODE_READ)
+        return read_banks(dev, files, nfiles);
+    if (opts.bank == BANK_ALL && opts.mode == MODE_WRITE)
+        return write_banks(dev, files, nfiles);
+
+    switch (opts.mode) {
+        case MODE_READ:
+            return read_cart(dev, file, base);
+        case MODE_WRITE:
+            return write_cart(dev, file, base, 0);
+        case MODE_TITLE:
+            return title_cart(dev);
+        case MODE_CALIBRATE:
+            return calibrate_cart(dev);
+        case MODE_SYNC:
+            return sync_save(dev, file);
+        case MODE_PACK:
+            return pack_cart(dev, opts.files, opts.nfiles, base);
+        case MODE_BATCH:
+            return run_batch(dev, file);
+        case MODE_SNAPSHOT:
+            return snapshot_cart(dev);
+        case MODE_RESTORE:
+            return restore_cart(dev, opts.snapshot);
+        case MODE_SNAPSHOTS:
+            return list_snapshots(dev);
+        default:
+            // should never reach here
+            failx(1, "Unknown mode %d, file a bug report", opts.mode);
+    }
+}
+
+/* one step of a --batch job file */
+typedef struct _batch_step_t {
+    options_t opts;
+    int line;               // in the job file
+    char *text;             // the line as written
+    char *argv[BATCH_MAX_ARGS + 2];
+    int reads, writes;      // BATCH_* parts of the cart
+} batch_step_t;
+
+/**
+ * Split a line of a job file into words, in place. Words are separated by
+ * blanks, may be quoted with ' or ", and a # outside quotes starts a comment.
+ *
+ * Returns:
+ *  >= 0    number of words
+ *  -1      unterminated quote, or more than max words
+ */
+int split_words(char *line, char **words, int max) {
+    char *in = line, *out;
+    int n = 0;
+    char quote;
+
+    while (1) {
+        while (*in == ' ' || *in == '\t' || *in == '\r' || *in == '\n')
+            ++in;
+        if (*in == '\0' || *in == '#')
+            return n;
+        if (n == max)
+            return -1;
+
+        words[n++] = out = in;
+        for (quote = 0; *in != '\0' && (quote || !strchr(" \t\r\n", *in)); ++in) {
+            if (quote == 0 && (*in == '\'' || *in == '"'))
+                quote = *in;
+            else if (*in == quote)
+                quote = 0;
+            else
+                *out++ = *in;
+        }
+        if (quote)
+            return -1;
+        if (*in != '\0')
+            ++in;
+        *out = '\0';
+    }
+}
+
+/**
+ * Work out which parts of the cart a parsed step reads and writes. Uses the
+ * global opts, which hold the step's options.
+ */
+void batch_regions(batch_step_t *step) {
+    int rom = opts.bank == BANK_ALL ? BATCH_BANK1 | BATCH_BANK2 : opts.bank == 0 ? BATCH_BANK1 : BATCH_BANK2;
+    int part = opts.file != NULL && file_space(opts.file) == FROM_SRAM ? BATCH_SRAM : rom;
+
+    step->reads = step->writes = 0;
+    switch (opts.mode) {
+        case MODE_READ:
+            step->reads = part;
+            break;
+        case MODE_WRITE:
+            step->writes = part;
+            break;
+        case MODE_PACK:
+            step->writes = rom;
+            break;
+        case MODE_TITLE:
+            step->reads = BATCH_BANK1 | BATCH_BANK2;
+            break;
+        case MODE_SYNC:
+        case MODE_CALIBRATE:
+            step->reads = step->writes = BATCH_SRAM;
+            break;
+    }
+}
+
+/**
+ * Whether a step that only reads the cart can run before step, which comes
+ * earlier in the job file: step doesn't write what it reads, and the two
+ * don't name the same file.
+ */
+int batch_can_pass(const batch_step_t *reader, const batch_step_t *step) {
+    int i, j;
+
+    if (reader->reads & step->writes)
+        return 0;
+
+    for (i = 0; i < reader->opts.nfiles; ++i)
+        for (j = 0; j < step->opts.nfiles; ++j)
+            if (strcmp(reader->opts.files[i], step->opts.files[j]) == 0)
+                return 0;
+
+    return 1;
+}
+
+/**
+ * Run the steps in a job file on one cart, like a command line each. The
+ * options of the batch's own command line are the defaults of every step.
+ * Steps that only read the cart go ahead of earlier writes they don't
+ * depend on, so all cart reads are done first; everything else keeps its
+ * order. The first failed step ends the batch.
+ *
+ * Returns:
+ *  0       success
+ *  1       failure, already reported
+ */
+int run_batch(ems_dev_t *dev, const char *file) {
+    options_t defaults = opts;
+    batch_step_t **steps = NULL, *step;
+    int *order = NULL;
+    int i, j, n = 0, size = 0, line = 0, argc, status = 0;
+    char buf[4096];
+
+    FILE *jobs = fopen(file, "r");
+    if (jobs == NULL) {
+        warn("Can't open job file %s", file);
+        return 1;
+    }
+
+    // every step is parsed before the first one runs
+    batching = 1;
+    memset(header_cache, 0, sizeof(header_cache));
+    while (fgets(buf, sizeof(buf), jobs) != NULL) {
+        ++line;
+        if (n == size) {
+            size = size ? 2 * size : 16;
+            steps = realloc(steps, size * sizeof(*steps));
+            if (steps == NULL)
+                fail(1, "realloc");
+        }
+        // steps stay put, the options of each point into its argv
+        step = steps[n] = calloc(1, sizeof(*step));
+        if (step == NULL)
+            fail(1, "calloc");
+        step->line = line;
+        step->text = strdup(buf);
+        if (step->text == NULL)
+            fail(1, "strdup");
+        step->text[strcspn(step->text, "\r\n")] = '\0';
+
+        step->argv[0] = "ems-flasher";
+        argc = split_words(buf, step->argv + 1, BATCH_MAX_ARGS);
+        if (argc <= 0) {
+            if (argc < 0) {
+                warnx("%s:%d: unterminated quote or too many arguments", file, line);
+                status = 1;
+            }
+            free(step->text);
+            free(step);
+            if (argc < 0)
+                break;
+            continue;
+        }
+
+        // the words point into buf, which the next line overwrites
+        for (i = 1; i <= argc; ++i)
+            if ((step->argv[i] = strdup(step->argv[i])) == NULL)
+                fail(1, "strdup");
+        step->argv[argc + 1] = NULL;
+        ++n;
+
+        // each step starts from the batch's options, but picks its own mode
+        opts = defaults;
+        opts.mode = 0;
+        opts.file = NULL;
+        opts.files = NULL;
+        opts.nfiles = 0;
+        opts.bank = 0;
+        opts.space = 0;
+        opts.device = NULL;
+        opts.connect = NULL;
+        optind = 0;
+
+        if (setjmp(batch_exit) != 0) {
+            warnx("%s:%d: %s", file, line, step->text);
+            status = 1;
+            break;
+        }
+        get_options(argc + 1, step->argv);
+
+        step->opts = opts;
+        batch_regions(step);
+    }
+    fclose(jobs);
+
+    order = malloc((n > 0 ? n : 1) * sizeof(*order));
+    if (order == NULL)
+        fail(1, "malloc");
+
+    // reads move up past the writes they don't depend on, but not past
+    // another step that only reads, so reads stay in their own order
+    for (i = 0; i < n; ++i) {
+        order[i] = i;
+        if (steps[i]->writes != 0 || steps[i]->reads == 0)
+            continue;
+        for (j = i; j > 0 && steps[order[j - 1]]->writes != 0 &&
+                batch_can_pass(steps[i], steps[order[j - 1]]); --j)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+
+    for (i = 0; i < n && status == 0; ++i) {
+        step = steps[order[i]];
+        printf("Step %d of %d, line %d: %s\n", i + 1, n, step->line, step->text);
+
+        opts = step->opts;
+        if (setjmp(batch_exit) != 0) {
+            status = 1;
+            break;
+        }
+        status = run_mode(dev, opts.file);
+
+        // the headers of the banks it wrote have to be read again
+        if (step->writes & BATCH_BANK1)
+            header_cache[0].valid = 0;
+        if (step->writes & BATCH_BANK2)
+            header_cache[1].valid = 0;
+
+        if (status != 0)
+            warnx("Batch stopped: step %d, line %d of %s failed", i + 1, step->line, file);
+    }
+
+    batching = 0;
+    opts = defaults;
+    for (i = 0; i < n; ++i) {
+        for (j = 1; steps[i]->argv[j] != NULL; ++j)
+            free(steps[i]->argv[j]);
+        free(steps[i]->text);
+        free(steps[i]);
+    }
+    free(steps);
+    free(order);
+    return status;
+}
+
+/* one cart's share of an --all run */
+typedef struct _job_t {
+    ems_dev_t *dev;
+    char *file;
+    const options_t *opts;
+    int result;
+    pthread_t thread;
+} job_t;
+
+/**
+ * Worker thread for --all: run the mode on one cart.
+ */
+void *run_job(void *arg) {
+    job_t *job = arg;
+
+    opts = *job->opts;
+    job->result = run_mode(job->dev, job->file);
+    return NULL;
+}
+
+/**
+ * Dump file name for one of several carts reading into the same file:
+ * the cart's name goes in front of the extension, rom.gb -> rom-NAME.gb.
+ */
+char *device_file(ems_dev_t *dev, const char *file) {
+    char name[80], *out;
+    const char *ext = strrchr(file, '.');
+    size_t stem;
+
+    if (ext == NULL || strchr(ext, '/') != NULL)
+        ext = file + strlen(file);
+    stem = ext - file;
+
+    device_name(dev, name, sizeof(name));
+    out = malloc(strlen(file) + strlen(name) + 2);
+    if (out == NULL)
+        fail(1, "malloc");
+    sprintf(out, "%.*s-%s%s", (int)stem, file, name, ext);
+    return out;
+}
+
+/**
+ * Run the selected mode on every attached cart at once, one thread each.
+ */
+int run_all(void) {
+    ems_devinfo_t info[EMS_MAX_DEVICES];
+    job_t jobs[EMS_MAX_DEVICES];
+    char id[16], name[80];
+    int i, n, r, count = 0, failed = 0;
+
+    // these print a report per cart, so carts take turns
+    int sequential = opts.mode == MODE_TITLE || opts.mode == MODE_CALIBRATE;
+
+    n = ems_list(info, EMS_MAX_DEVICES);
+    if (n > EMS_MAX_DEVICES)
+        n = EMS_MAX_DEVICES;
+
+    for (i = 0; i < n; ++i) {
+        snprintf(id, sizeof(id), "%u:%u", info[i].bus, info[i].port);
+        r = ems_open(id, &jobs[count].dev);
+        if (r < 0) {
+            warnx("Can't claim the cart at %s: %s", id, ems_strerror(r));
+            ++failed;
+            continue;
+        }
+        device_name(jobs[count].dev, name, sizeof(name));
+        if (trace_attach(jobs[count].dev, name) != 0)
+            failx(1, "can't trace cart %s", name);
+        ++count;
+    }
+
+    if (count == 0)
+        failx(1, "No EMS carts could be opened");
+
+    // --pack writes all of its ROMs to every cart
+    if (opts.nfiles > 1 && opts.nfiles != count && opts.mode != MODE_PACK)
+        failx(1, "%d carts but %d files, give one file or one per cart", count, opts.nfiles);
+
+    if (opts.verbose)
+        printf("Claimed %d EMS carts\n", count);
+
+    for (i = 0; i < count; ++i) {
+        jobs[i].file = NULL;
+        jobs[i].opts = &opts;
+        if (opts.mode == MODE_PACK)
+            jobs[i].file = NULL;
+        else if (opts.nfiles > 1)
+            jobs[i].file = opts.files[i];
+        else if (opts.nfiles == 1 && (opts.mode == MODE_READ || opts.mode == MODE_SYNC))
+            jobs[i].file = device_file(jobs[i].dev, opts.file);
+        else if (opts.nfiles == 1)
+            jobs[i].file = opts.file;
+
+        if (sequential) {
+            device_name(jobs[i].dev, name, sizeof(name));
+            printf("Cart %s:\n", name);
+            jobs[i].result = run_mode(jobs[i].dev, NULL);
+            printf("\n");
+        } else if (pthread_create(&jobs[i].thread, NULL, run_job, &jobs[i]) != 0) {
+            fail(1, "pthread_create");
+        }
+    }
+
+    for (i = 0; i < count; ++i) {
+        if (!sequential)
+            pthread_join(jobs[i].thread, NULL);
+
+        device_name(jobs[i].dev, name, sizeof(name));
+        if (!sequential)
+            printf("Cart %s: %s\n", name, jobs[i].result == 0 ? "done" : "FAILED");
+        failed += jobs[i].result != 0;
+
+        if (opts.nfiles == 1 && (opts.mode == MODE_READ || opts.mode == MODE_SYNC))
+            free(jobs[i].file);
+    }
+
+    return failed ? 1 : 0;
+}
+
+/**
+ * Check the headers of every ROM file in the directories given and print the
+ * catalog. Needs no cart, nor USB.
+ */
+int scan_files(void) {
+    scan_entry_t *entries;
+    double start = now();
+    int i, n, bad = 0;
+
+    n = scan_library(opts.files, opts.nfiles, opts.global, &entries);
+    if (scan_catalog(stdout, entries, n) != 0) {
+        warn("Can't write the catalog");
+        scan_free(entries, n);
+        return 1;
+    }
+
+    for (i = 0; i < n; ++i)
+        bad += entries[i].error != 0 || !entries[i].header || entries[i].global == 0;
+    fprintf(stderr, "Scanned %d ROM files in %.2f s, %d with errors or bad checksums\n",
+            n, now() - start, bad);
+
+    scan_free(entries, n);
+    return 0;
+}
+
+/**
+ * Print the attached carts.
+ */
+int list_carts(void) {
+    ems_devinfo_t info[EMS_MAX_DEVICES];
+    int i, n = ems_list(info, EMS_MAX_DEVICES);
+
+    for (i = 0; i < n && i < EMS_MAX_DEVICES; ++i)
+        printf("%u:%u\t%s\n", info[i].bus, info[i].port,
+                info[i].serial[0] != '\0' ? info[i].serial : "(no serial)");
+    if (n == 0)
+        printf("No EMS carts found\n");
+    return n < 0;
+}
+
+/**
+ * Run one job sent to the daemon, with the daemon's options as defaults.
+ * Its output goes wherever stdout and stderr point.
+ *
+ * Returns:
+ *  the job's exit status
+ */
+int serve_job(ems_dev_t *dev, const options_t *defaults, daemon_job_t *job) {
+    char name[80];
+    int status;
+
+    opts = *defaults;
+    optind = 0;
+    serving = 1;
+
+    if ((status = setjmp(job_exit)) != 0) {
+        // usage error, or --help and --version
+        serving = 0;
+        return status - 1;
+    }
+
+    if (chdir(job->cwd) < 0) {
+        warn("Can't change to %s", job->cwd);
+        serving = 0;
+        return 1;
+    }
+
+    get_options(job->argc, job->argv);
+    serving = 0;
+    opts.verbose = 1;
+
+    if (opts.mode == MODE_LIST)
+        return list_carts();
+
+    if (opts.verbose && opts.bank == BANK_ALL)
+        printf("Using both banks\n");
+    else if (opts.verbose)
+        printf("Base address is 0x%X\n", opts.bank * BANK_SIZE);
+
+    if (opts.trace != NULL) {
+        device_name(dev, name, sizeof(name));
+        if (trace_open(opts.trace) != 0 || trace_attach(dev, name) != 0) {
+            trace_close();
+            return 1;
+        }
+    }
+
+    status = run_mode(dev, opts.file);
+
+    if (opts.trace != NULL) {
+        ems_trace_enable(dev, 0, NULL, NULL);
+        trace_close();
+    }
+
+    return status;
+}
+
+/**
+ * Daemon: keep the cart claimed and run the jobs clients send to the socket
+ * one after the other, each with its output sent back to its client.
+ */
+int serve(ems_dev_t *dev) {
+    options_t defaults = opts;
+    daemon_job_t *job;
+    int sock, conn, out, errout, home, status, i;
+
+    // jobs start from the daemon's own options, but pick their mode
+    defaults.mode = 0;
+    defaults.serve = NULL;
+    defaults.trace = NULL;
+
+    job = malloc(sizeof(*job));
+    if (job == NULL)
+        fail(1, "malloc");
+
+    sock = daemon_listen(opts.serve);
+    if (sock < 0)
+        return 1;
+
+    // a client going away must not take the daemon down
+    signal(SIGPIPE, SIG_IGN);
+
+    out = dup(STDOUT_FILENO);
+    errout = dup(STDERR_FILENO);
+    if (out < 0 || errout < 0)
+        fail(1, "dup");
+
+    // each job runs in its client's directory, and the next one starts here
+    home = open(".", O_RDONLY);
+    if (home < 0)
+        fail(1, "Can't open the working directory");
+
+    printf("Serving jobs on %s\n", opts.serve);
+
+    while (1) {
+        conn = accept(sock, NULL, NULL);
+        if (conn < 0 && errno == EINTR)
+            continue;
+        if (conn < 0) {
+            warn("accept");
+            break;
+        }
+
+        if (daemon_read_job(conn, job) < 0) {
+            warnx("Dropped job");
+            close(conn);
+            continue;
+        }
+
+        dup2(conn, STDOUT_FILENO);
+        dup2(conn, STDERR_FILENO);
+        status = serve_job(dev, &defaults, job);
+        dup2(out, STDOUT_FILENO);
+        dup2(errout, STDERR_FILENO);
+        if (fchdir(home) < 0)
+            warn("Can't change back to the working directory");
+
+        daemon_finish_job(conn, status);
+        close(conn);
+
+        printf("Job");
+        for (i = 1; i < job->argc; ++i)
+            printf(" %s", job->argv[i]);
+        printf(": %s\n", status == 0 ? "done" : "FAILED");
+    }
+
+    close(home);
+    close(sock);
+    free(job);
+    return 1;
+}
+
+// how often a station looks at its socket and, without hotplug, the bus
+#define STATION_POLL_MS 100
+#define STATION_SCAN_MS 1000
+
+/* a job waiting for or running on one of a station's carts */
+typedef struct _station_job_t {
+    options_t opts;
+    int conn;                   // client, gets the result
+    int npaths;
+    char *paths[DAEMON_MAX_ARGS];   // absolute file names, opts.files
+    daemon_job_t req;           // the request, opts points into it
+    struct _station_job_t *next;
+} station_job_t;
+
+/* a cart attached to the station, with the thread running its jobs */
+typedef struct _station_cart_t {
+    ems_dev_t *dev;
+    char name[80];
+    const ems_devinfo_t *info;
+    int busy;                   // running a job
+    int gone;                   // unplugged, the worker ends after its job
+    int done;                   // the worker has ended, cart can be closed
+    pthread_t thread;
+    struct _station_cart_t *next;
+} station_cart_t;
+
+/* everything the station's threads share, under lock */
+struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // a job was queued or a cart went away
+    station_job_t *jobs;        // FIFO
+    station_cart_t *carts;
+    ems_devinfo_t arrived[EMS_MAX_DEVICES];
+    int narrived;               // carts plugged in but not opened yet
+} station = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * Hotplug callback: note new carts for the main loop to open, and tell the
+ * worker of an unplugged one to stop. Can run on any thread.
+ */
+void station_hotplug(const ems_devinfo_t *info, int arrived, void *arg) {
+    station_cart_t *cart;
+
+    pthread_mutex_lock(&station.lock);
+    if (arrived && station.narrived < EMS_MAX_DEVICES) {
+        station.arrived[station.narrived++] = *info;
+    } else if (!arrived) {
+        for (cart = station.carts; cart != NULL; cart = cart->next)
+            if (cart->info->bus == info->bus && cart->info->port == info->port)
+                cart->gone = 1;
+        pthread_cond_broadcast(&station.cond);
+    }
+    pthread_mutex_unlock(&station.lock);
+}
+
+/**
+ * Worker of one cart: take the oldest job this cart can run, run it, repeat
+ * until the cart goes away.
+ */
+void *station_worker(void *arg) {
+    station_cart_t *cart = arg;
+    station_job_t *job, **jp;
+    int status;
+
+    pthread_mutex_lock(&station.lock);
+    while (!cart->gone) {
+        for (jp = &station.jobs; *jp != NULL; jp = &(*jp)->next)
+            if (ems_is(cart->dev, (*jp)->opts.device))
+                break;
+        if (*jp == NULL) {
+            pthread_cond_wait(&station.cond, &station.lock);
+            continue;
+        }
+
+        job = *jp;
+        *jp = job->next;
+        cart->busy = 1;
+        pthread_mutex_unlock(&station.lock);
+
+        dprintf(job->conn, "Running on cart %s\n", cart->name);
+        opts = job->opts;
+
+        // a job that fails fails alone, the other carts carry on
+        serving = 1;
+        if ((status = setjmp(job_exit)) != 0)
+            status -= 1;
+        else
+            status = run_mode(cart->dev, opts.file);
+        serving = 0;
+
+        dprintf(job->conn, "Cart %s: %s\n", cart->name, status == 0 ? "done" : "FAILED");
+        daemon_finish_job(job->conn, status);
+        close(job->conn);
+        printf("Cart %s: job %s %s\n", cart->name, opts.file != NULL ? opts.file : "",
+                status == 0 ? "done" : "FAILED");
+
+        while (job->npaths > 0)
+            free(job->paths[--job->npaths]);
+        free(job);
+
+        pthread_mutex_lock(&station.lock);
+        cart->busy = 0;
+    }
+    cart->done = 1;
+    pthread_mutex_unlock(&station.lock);
+
+    return NULL;
+}
+
+/**
+ * Make a file name of a job absolute, jobs don't run in their client's
+ * directory.
+ */
+char *station_path(station_job_t *job, const char *file) {
+    char *path;
+
+    if (file[0] == '/')
+        path = strdup(file);
+    else if ((path = malloc(strlen(job->req.cwd) + strlen(file) + 2)) != NULL)
+        sprintf(path, "%s/%s", job->req.cwd, file);
+    if (path == NULL)
+        fail(1, "malloc");
+
+    job->paths[job->npaths++] = path;
+    return path;
+}
+
+/**
+ * Take a job from a client and queue it, or answer it right away if it
+ * doesn't need a cart.
+ */
+void station_accept(int sock, const options_t *defaults) {
+    station_job_t *job, **jp;
+    station_cart_t *cart;
+    int i, status, waiting = 1;
+
+    job = calloc(1, sizeof(*job));
+    if (job == NULL)
+        fail(1, "malloc");
+
+    job->conn = accept(sock, NULL, NULL);
+    if (job->conn < 0) {
+        free(job);
+        return;
+    }
+
+    if (daemon_read_job(job->conn, &job->req) < 0) {
+        warnx("Dropped job");
+        goto finish;
+    }
+
+    // jobs don't share a cart's thread-local state with the parser
+    opts = *defaults;
+    optind = 0;
+    serving = 1;
+    if ((status = setjmp(job_exit)) != 0) {
+        serving = 0;
+        status -= 1;
+        goto finish;
+    }
+    get_options(job->req.argc, job->req.argv);
+    serving = 0;
+    opts.verbose = 1;
+
+    status = 1;
+    if (opts.trace != NULL) {
+        dprintf(job->conn, "Error: a station runs jobs in parallel, it can't --trace them\n");
+        goto finish;
+    }
+
+    if (opts.mode == MODE_LIST) {
+        pthread_mutex_lock(&station.lock);
+        for (cart = station.carts; cart != NULL; cart = cart->next)
+            dprintf(job->conn, "%u:%u\t%s\t%s\n", cart->info->bus, cart->info->port, cart->name,
+                    cart->gone ? "gone" : cart->busy ? "busy" : "idle");
+        pthread_mutex_unlock(&station.lock);
+        status = 0;
+        goto finish;
+    }
+
+    if (opts.nfiles > 0) {
+        opts.files = job->paths;
+        for (i = 0; i < opts.nfiles; ++i)
+            station_path(job, job->req.argv[job->req.argc - opts.nfiles + i]);
+        opts.file = opts.files[0];
+    }
+    job->opts = opts;
+
+    pthread_mutex_lock(&station.lock);
+    for (jp = &station.jobs; *jp != NULL; jp = &(*jp)->next)
+        ;
+    *jp = job;
+    for (cart = station.carts; cart != NULL; cart = cart->next)
+        if (!cart->busy && !cart->gone && ems_is(cart->dev, opts.device))
+            waiting = 0;
+    pthread_cond_broadcast(&station.cond);
+    pthread_mutex_unlock(&station.lock);
+
+    if (waiting)
+        dprintf(job->conn, "Queued, waiting for a cart\n");
+    return;
+
+finish:
+    daemon_finish_job(job->conn, status);
+    close(job->conn);
+    while (job->npaths > 0)
+        free(job->paths[--job->npaths]);
+    free(job);
+}
+
+/**
+ * Open the carts that were plugged in and start a worker for each, then
+ * close the carts whose worker has ended.
+ */
+void station_update(void) {
+    ems_devinfo_t arrived[EMS_MAX_DEVICES];
+    station_cart_t *cart, **cp;
+    char id[16];
+    int i, n;
+
+    pthread_mutex_lock(&station.lock);
+    n = station.narrived;
+    memcpy(arrived, station.arrived, n * sizeof(*arrived));
+    station.narrived = 0;
+
+    for (cp = &station.carts; *cp != NULL;) {
+        cart = *cp;
+        if (!cart->done) {
+            cp = &cart->next;
+            continue;
+        }
+        *cp = cart->next;
+        pthread_mutex_unlock(&station.lock);
+
+        pthread_join(cart->thread, NULL);
+        printf("Cart %s went away\n", cart->name);
+        drop_snapshots(cart->dev);
+        ems_close(cart->dev);
+        free(cart);
+
+        pthread_mutex_lock(&station.lock);
+    }
+    pthread_mutex_unlock(&station.lock);
+
+    for (i = 0; i < n; ++i) {
+        // already ours
+        for (cart = station.carts; cart != NULL; cart = cart->next)
+            if (!cart->gone && cart->info->bus == arrived[i].bus && cart->info->port == arrived[i].port)
+                break;
+        if (cart != NULL)
+            continue;
+
+        cart = calloc(1, sizeof(*cart));
+        if (cart == NULL)
+            fail(1, "malloc");
+
+        snprintf(id, sizeof(id), "%u:%u", arrived[i].bus, arrived[i].port);
+        if (ems_open(id, &cart->dev) < 0) {
+            free(cart);
+            continue;
+        }
+        cart->info = ems_info(cart->dev);
+        device_name(cart->dev, cart->name, sizeof(cart->name));
+
+        // the list only changes here, workers are just told what to do
+        pthread_mutex_lock(&station.lock);
+        cart->next = station.carts;
+        station.carts = cart;
+        pthread_mutex_unlock(&station.lock);
+
+        if (pthread_create(&cart->thread, NULL, station_worker, cart) != 0)
+            fail(1, "pthread_create");
+        printf("Cart %s plugged in\n", cart->name);
+    }
+}
+
+/**
+ * Without hotplug support: list the bus now and then, and report what
+ * changed like hotplug would.
+ */
+void station_scan(void) {
+    ems_devinfo_t info[EMS_MAX_DEVICES];
+    station_cart_t *cart;
+    int i, n = ems_list(info, EMS_MAX_DEVICES);
+
+    if (n > EMS_MAX_DEVICES)
+        n = EMS_MAX_DEVICES;
+    for (i = 0; i < n; ++i)
+        station_hotplug(&info[i], 1, NULL);
+
+    pthread_mutex_lock(&station.lock);
+    for (cart = station.carts; cart != NULL; cart = cart->next) {
+        for (i = 0; i < n; ++i)
+            if (cart->info->bus == info[i].bus && cart->info->port == info[i].port)
+                break;
+        if (i == n)
+            cart->gone = 1;
+    }
+    pthread_cond_broadcast(&station.cond);
+    pthread_mutex_unlock(&station.lock);
+}
+
+/**
+ * Cart station: a daemon for every cart that is or will be plugged in. Jobs
+ * queue up in the order they come in and each goes to the first idle cart
+ * that matches its --device, or any cart, as soon as there is one.
+ */
+int serve_station(void) {
+    options_t defaults = opts;
+    struct pollfd pfd;
+    double last_scan = 0;
+    int sock, hotplug;
+
+    defaults.mode = 0;
+    defaults.serve = NULL;
+    defaults.trace = NULL;
+    defaults.all = 0;
+
+    sock = daemon_listen(opts.serve);
+    if (sock < 0)
+        return 1;
+    signal(SIGPIPE, SIG_IGN);
+
+    hotplug = ems_hotplug(station_hotplug, NULL) == 0;
+    printf("Cart station serving jobs on %s%s\n", opts.serve,
+            hotplug ? "" : ", no hotplug support so polling for carts");
+
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+
+    while (1) {
+        if (poll(&pfd, 1, STATION_POLL_MS) > 0)
+            station_accept(sock, &defaults);
+
+        if (hotplug) {
+            ems_handle_events(0);
+        } else if (now() - last_scan >= STATION_SCAN_MS / 1000.0) {
+            station_scan();
+            last_scan = now();
+        }
+
+        station_update();
+    }
+}
+
+/**
+ * Main
+ */
+int main(int argc, char **argv) {
+    int r;
+    setbuf(stdout, NULL);
+
+    get_options(argc, argv);
+
+    // the daemon has the cart, it gets the whole command line
+    if (opts.connect != NULL)
+        return daemon_submit(opts.connect, argc, argv);
+
+    if (opts.mode == MODE_SCAN)
+        return scan_files();
+
+    // an orchestrator that stops reading progress doesn't end the transfer
+    if (opts.progress_fd >= 0)
+        signal(SIGPIPE, SIG_IGN);
+
+    // Force verbose.
+    opts.verbose = 1;
+
+    r = ems_init();
+    if (r < 0) {
+        warnx("Can't initialize libusb: %s", ems_strerror(r));
+        return 1;
+    }
+    atexit(ems_exit);
+
+    if (opts.mode == MODE_LIST)
+        return list_carts();
+
+    if (opts.verbose && opts.bank == BANK_ALL)
+        printf("Using both banks\n");
+    else if (opts.verbose)
+        printf("Base address is 0x%X\n", opts.bank * BANK_SIZE);
+
+    if (opts.trace != NULL && opts.mode != MODE_SERVE) {
+        if (trace_open(opts.trace) != 0)
+            return 1;
+        atexit(trace_close);
+    }
+
+    if (opts.mode == MODE_SERVE && opts.all)
+        return serve_station();
+
+    if (opts.all)
+        return run_all();
+
+    if (opts.verbose)
+        printf("Trying to find EMS cart\n");
+
+    ems_dev_t *dev;
+    r = ems_open(opts.device, &dev);
+    if (r < 0) {
+        warnx("Could not find/open device (%s), is it plugged in?", ems_strerror(r));
+        return 1;
+    }
+
+    if (opts.verbose) {
+        ems_caps_t caps;
+        ems_get_caps(dev, &caps);
+        printf("Claimed EMS cart, %u kbit/s, %zu/%zu byte packets\n", caps.speed,
+                caps.packet_out, caps.packet_in);
+    }
+
+    if (opts.mode == MODE_SERVE)
+        return serve(dev);
+
+    char name[80];
+    device_name(dev, name, sizeof(name));
+    if (trace_attach(dev, name) != 0)
+        return 1;
+
+    return run_mode(dev, opts.file);
 }
@@ -0,0 +1,205 @@
+/*
+ * Packed bank: several ROMs in one bank, each at an offset that is a multiple
+ * of its size, which is where a menu's bank switching expects them. The first
+ * ROM is the one the cart boots, the menu, so it stays at offset 0; the rest
+ * go biggest first into the lowest free slot that fits.
+ *
+ * The layout last written to a cart is kept as a text file, one line per ROM:
+ *
+ *  EMSLAYOUT1
+ *  <offset> <size> <crc> <key>
+ *
+ * so packing the same bank again only writes the ROMs that moved or changed.
+ */
+#include <err.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc32.h"
+#include "header.h"
+#include "pack.h"
+
+#define PACK_MAGIC "EMSLAYOUT1"
+
+/**
+ * Fill in slot for the ROM in file: size and key by its header, length and
+ * CRC-32 of the whole file. The offset is left to pack_layout.
+ *
+ * Returns:
+ *  0       success
+ *  -1      failure, already reported
+ */
+int pack_slot(pack_slot_t *slot, const char *file) {
+    unsigned char buf[PACK_ALIGN];
+    size_t got;
+    int r = -1;
+
+    memset(slot, 0, sizeof(*slot));
+    slot->file = file;
+
+    FILE *in = fopen(file, "r");
+    if (in == NULL) {
+        warn("Can't open ROM file %s", file);
+        return -1;
+    }
+
+    got = fread(buf, 1, sizeof(buf), in);
+    if (got < HEADER_BLOCK) {
+        warnx("ROM file %s is too short to have a header", file);
+        goto out;
+    }
+
+    if (!header_checksum_ok(buf)) {
+        warnx("ROM file %s has a bad header checksum", file);
+        goto out;
+    }
+
+    slot->size = header_romsize(buf);
+    if (slot->size < PACK_ALIGN || header_key(buf, slot->key, sizeof(slot->key)) != 0) {
+        warnx("ROM file %s has an unknown ROM size 0x%02x", file, buf[HEADER_ROMSIZE]);
+        goto out;
+    }
+
+    do {
+        slot->crc = crc32_update(slot->crc, buf, got);
+        slot->length += got;
+    } while (slot->length <= slot->size && (got = fread(buf, 1, sizeof(buf), in)) > 0);
+
+    if (ferror(in)) {
+        warn("Can't read ROM file %s", file);
+        goto out;
+    }
+    if (slot->length > slot->size) {
+        warnx("ROM file %s is larger than the %u KB its header gives", file, slot->size / 1024);
+        goto out;
+    }
+
+    r = 0;
+out:
+    fclose(in);
+    return r;
+}
+
+/**
+ * Place the ROMs in a bank of space bytes: slots[0] at offset 0, the others
+ * biggest first, each at the lowest multiple of its size that is still free.
+ * Sizes are powers of two, so this leaves no holes unless a ROM is smaller
+ * than the one it follows.
+ *
+ * Returns:
+ *  0       success, every offset is filled in
+ *  -1      the ROMs don't fit
+ */
+int pack_layout(pack_slot_t *slots, int n, uint32_t space) {
+    int units = space / PACK_ALIGN;
+    unsigned char *used = calloc(units, 1);
+    int *order = malloc(n * sizeof(*order));
+    int i, j, k, r = 0;
+
+    if (used == NULL || order == NULL)
+        err(1, "malloc");
+
+    // insertion sort keeps ROMs of the same size in the order given
+    order[0] = 0;
+    for (i = 1; i < n; ++i) {
+        for (j = i; j > 1 && slots[order[j - 1]].size < slots[i].size; --j)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+
+    for (i = 0; i < n && r == 0; ++i) {
+        pack_slot_t *slot = &slots[order[i]];
+        int step = slot->size / PACK_ALIGN;
+
+        r = -1;
+        for (j = 0; j + step <= units; j += step) {
+            for (k = j; k < j + step && !used[k]; ++k)
+                ;
+            if (k == j + step) {
+                memset(used + j, 1, step);
+                slot->offset = j * PACK_ALIGN;
+                r = 0;
+                break;
+            }
+        }
+    }
+
+    free(order);
+    free(used);
+    return r;
+}
+
+/**
+ * Load the layout last written, up to max slots. Only offset, size, CRC and
+ * key are kept, file is NULL.
+ *
+ * Returns:
+ *  >= 0    number of slots loaded
+ *  -1      no layout, or a damaged one
+ */
+int pack_load(const char *path, pack_slot_t *slots, int max) {
+    char magic[16];
+    int n = 0;
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+
+    if (fscanf(file, "%15s", magic) != 1 || strcmp(magic, PACK_MAGIC) != 0) {
+        fclose(file);
+        return -1;
+    }
+
+    memset(slots, 0, max * sizeof(*slots));
+    while (n < max && fscanf(file, "%x %x %x %63s", &slots[n].offset, &slots[n].size,
+                &slots[n].crc, slots[n].key) == 4)
+        ++n;
+
+    fclose(file);
+    return n;
+}
+
+/**
+ * Save the layout just written.
+ *
+ * Returns:
+ *  0       success
+ *  -1      failure
+ */
+int pack_save(const char *path, const pack_slot_t *slots, int n) {
+    char tmp[PATH_MAX + 8];
+    FILE *file;
+    int i;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    file = fopen(tmp, "w");
+    if (file == NULL)
+        return -1;
+
+    fprintf(file, "%s\n", PACK_MAGIC);
+    for (i = 0; i < n; ++i)
+        fprintf(file, "%08x %08x %08x %s\n", slots[i].offset, slots[i].size,
+                slots[i].crc, slots[i].key);
+
+    if (fclose(file) != 0 || rename(tmp, path) != 0) {
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Whether the last layout already has this ROM, unchanged, at its offset.
+ */
+int pack_unchanged(const pack_slot_t *slot, const pack_slot_t *old, int nold) {
+    int i;
+
+    for (i = 0; i < nold; ++i)
+        if (old[i].offset == slot->offset && old[i].size == slot->size &&
+                old[i].crc == slot->crc && strcmp(old[i].key, slot->key) == 0)
+            return 1;
+
+    return 0;
+}
@@ -0,0 +1,27 @@
+#ifndef __PACK_H__
+#define __PACK_H__
+
+#include <stdint.h>
+
+// smallest slot of a packed bank, the size of the smallest ROM
+#define PACK_ALIGN 0x8000
+
+/* one ROM of a packed bank */
+typedef struct _pack_slot_t {
+    const char *file;
+    uint32_t size;      // by the header: a power of two, at least PACK_ALIGN
+    uint32_t length;    // bytes in the file, no more than size
+    uint32_t offset;    // in the bank, a multiple of size
+    uint32_t crc;       // CRC-32 of the file
+    char key[64];       // header_key of the ROM
+} pack_slot_t;
+
+int pack_slot(pack_slot_t *slot, const char *file);
+int pack_layout(pack_slot_t *slots, int n, uint32_t space);
+
+int pack_load(const char *path, pack_slot_t *slots, int max);
+int pack_save(const char *path, const pack_slot_t *slots, int n);
+int pack_unchanged(const pack_slot_t *slot, const pack_slot_t *old, int nold);
+
+#endif /* __PACK_H__ */
+// vim: ft=c
@@ -0,0 +1,67 @@
+/*
+ * Progress of a transfer, as a line on the terminal and as JSON lines on a
+ * file descriptor for whatever runs the flasher:
+ *
+ *  {"cart": "EMS0000", "what": "Writing", "done": 65536, "total": 4194304,
+ *   "rate": 301234, "eta": 13.7}
+ *
+ * Transfers report every block, so updates are shown at most every
+ * PROGRESS_INTERVAL seconds, plus the last one; everything else only costs a
+ * clock read.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "progress.h"
+
+static double progress_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Report that done of total bytes of the transfer what are through. A new
+ * transfer starts whenever what or total change, or done goes back.
+ */
+void progress_update(progress_t *p, const char *what, uint64_t done, uint64_t total) {
+    double t = progress_now(), rate, eta;
+    int final = done >= total;
+    char line[256];
+    int len;
+
+    if (p->what == NULL || strcmp(p->what, what) != 0 || p->total != total || done < p->done) {
+        p->what = what;
+        p->total = total;
+        p->first = done;
+        p->start = p->last = t;
+    } else if (t - p->last < PROGRESS_INTERVAL && !final) {
+        p->done = done;
+        return;
+    }
+    p->done = done;
+    p->last = t;
+
+    rate = t > p->start ? (done - p->first) / (t - p->start) : 0;
+    eta = rate > 0 ? (total - (final ? total : done)) / rate : 0;
+
+    if (p->terminal) {
+        printf("%s: %5.1f%%  %7.1f KB/s  ETA %2d:%02d%s", what,
+                total > 0 ? (double)done / total * 100 : 100.0, rate / 1024,
+                (int)eta / 60, (int)eta % 60, final ? "\n" : "\r");
+    }
+
+    if (p->fd >= 0) {
+        len = snprintf(line, sizeof(line), "{\"cart\": %s%s%s, \"what\": \"%s\", \"done\": %llu, "
+                "\"total\": %llu, \"rate\": %.0f, \"eta\": %.1f}\n",
+                p->cart ? "\"" : "", p->cart ? p->cart : "null", p->cart ? "\"" : "", what,
+                (unsigned long long)done, (unsigned long long)total, rate, eta);
+        // one write per line, so lines from several carts don't mix; a
+        // reader that went away doesn't stop the transfer
+        if (len > 0 && len < (int)sizeof(line) && write(p->fd, line, len) < 0)
+            return;
+    }
+}
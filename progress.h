@@ -0,0 +1,25 @@
+#ifndef __PROGRESS_H__
+#define __PROGRESS_H__
+
+#include <stdint.h>
+
+// least seconds between two updates of the same transfer
+#define PROGRESS_INTERVAL 0.2
+
+/* progress of the transfer one thread is running */
+typedef struct _progress_t {
+    int terminal;           // draw a line on stdout
+    int fd;                 // JSON lines go here, -1 for none
+    const char *cart;       // name in the JSON lines, NULL for none
+    const char *what;
+    uint64_t total;
+    uint64_t first;         // done at the first update, resumes start past 0
+    uint64_t done;
+    double start;
+    double last;            // of the last update shown
+} progress_t;
+
+void progress_update(progress_t *p, const char *what, uint64_t done, uint64_t total);
+
+#endif /* __PROGRESS_H__ */
+// vim: ft=c
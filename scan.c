@@ -0,0 +1,290 @@
+/*
+ * Library scan: find every .gb and .gbc file under some directories and check
+ * their headers on a pool of threads, then write a JSON catalog of them to
+ * pick what to flash from.
+ *
+ * Only the header of each file is mapped, so a scan costs one page per ROM;
+ * checking the global checksum maps and sums the whole file.
+ */
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "header.h"
+#include "scan.h"
+
+// bytes of a file that hold the whole header
+#define SCAN_HEADER (HEADER_GLOBALCHKSUM + 2)
+
+// files a worker takes from the list at a time
+#define SCAN_BATCH 16
+
+/* the files of a scan and the next one nobody has taken yet */
+struct scan_list {
+    scan_entry_t *entries;
+    int count;
+    int size;
+    int next;
+    int global;
+    pthread_mutex_t lock;
+};
+
+/**
+ * Whether a file name ends in .gb or .gbc, in any case.
+ */
+static int scan_match(const char *name) {
+    const char *ext = strrchr(name, '.');
+
+    return ext != NULL && (strcasecmp(ext, ".gb") == 0 || strcasecmp(ext, ".gbc") == 0);
+}
+
+/**
+ * Add path to the list of files to check.
+ */
+static void scan_add(struct scan_list *list, const char *path) {
+    scan_entry_t *e;
+
+    if (list->count == list->size) {
+        list->size = list->size ? 2 * list->size : 256;
+        list->entries = realloc(list->entries, list->size * sizeof(*list->entries));
+        if (list->entries == NULL)
+            err(1, "realloc");
+    }
+
+    e = &list->entries[list->count++];
+    memset(e, 0, sizeof(*e));
+    e->path = strdup(path);
+    if (e->path == NULL)
+        err(1, "strdup");
+}
+
+/**
+ * Add every ROM file under dir to the list. Symlinks to files are followed,
+ * symlinks to directories are not, so a link loop can't keep the walk going.
+ */
+static void scan_walk(struct scan_list *list, const char *dir) {
+    struct dirent *d;
+    struct stat st;
+    char *path;
+
+    DIR *dp = opendir(dir);
+    if (dp == NULL) {
+        warn("Can't open directory %s", dir);
+        return;
+    }
+
+    while ((d = readdir(dp)) != NULL) {
+        if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+            continue;
+
+        path = malloc(strlen(dir) + strlen(d->d_name) + 2);
+        if (path == NULL)
+            err(1, "malloc");
+        sprintf(path, "%s/%s", dir, d->d_name);
+
+        if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode))
+            scan_walk(list, path);
+        else if (scan_match(d->d_name) && stat(path, &st) == 0 && S_ISREG(st.st_mode))
+            scan_add(list, path);
+
+        free(path);
+    }
+
+    closedir(dp);
+}
+
+/**
+ * Check the header of one file, and its global checksum if asked to.
+ */
+static void scan_file(scan_entry_t *e, int global) {
+    struct stat st;
+    unsigned char *map;
+    size_t len;
+    int i;
+
+    e->global = -1;
+
+    int fd = open(e->path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        e->error = errno;
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    e->size = st.st_size;
+
+    // a file too short for a header is in the catalog with nothing passing
+    if (st.st_size < SCAN_HEADER) {
+        close(fd);
+        return;
+    }
+
+    len = global ? (size_t)st.st_size : SCAN_HEADER;
+    map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        e->error = errno;
+        return;
+    }
+    if (global)
+        madvise(map, len, MADV_SEQUENTIAL);
+
+    for (i = 0; i < 16 && map[HEADER_TITLE + i] != 0; ++i)
+        e->title[i] = map[HEADER_TITLE + i];
+    e->title[i] = '\0';
+
+    e->romsize = header_romsize(map);
+    e->cgb = map[HEADER_CGBFLAG];
+    e->logo = header_logo(map);
+    e->header = header_checksum_ok(map);
+    if (header_key(map, e->key, sizeof(e->key)) != 0)
+        e->key[0] = '\0';
+    if (global)
+        e->global = header_global_ok(map, len);
+
+    munmap(map, len);
+}
+
+/**
+ * Worker thread: check files from the list until none are left.
+ */
+static void *scan_worker(void *arg) {
+    struct scan_list *list = arg;
+    int i, end;
+
+    while (1) {
+        pthread_mutex_lock(&list->lock);
+        i = list->next;
+        end = list->next = i + SCAN_BATCH < list->count ? i + SCAN_BATCH : list->count;
+        pthread_mutex_unlock(&list->lock);
+
+        if (i >= end)
+            return NULL;
+        for (; i < end; ++i)
+            scan_file(&list->entries[i], list->global);
+    }
+}
+
+static int scan_compare(const void *a, const void *b) {
+    return strcmp(((const scan_entry_t *)a)->path, ((const scan_entry_t *)b)->path);
+}
+
+/**
+ * Find and check every ROM file under dirs, sorted by path.
+ *
+ * Params:
+ *  global      also check the global checksum, which reads every file whole
+ *  entries     set to the list, to be freed with scan_free
+ *
+ * Returns:
+ *  number of ROM files found
+ */
+int scan_library(char **dirs, int ndirs, int global, scan_entry_t **entries) {
+    struct scan_list list = { .global = global };
+    pthread_t threads[SCAN_WORKERS];
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    for (i = 0; i < ndirs; ++i)
+        scan_walk(&list, dirs[i]);
+
+    if (workers < 1)
+        workers = 1;
+    if (workers > SCAN_WORKERS)
+        workers = SCAN_WORKERS;
+    if (workers > (list.count + SCAN_BATCH - 1) / SCAN_BATCH)
+        workers = (list.count + SCAN_BATCH - 1) / SCAN_BATCH;
+
+    pthread_mutex_init(&list.lock, NULL);
+    for (i = 0; i < workers; ++i)
+        if (pthread_create(&threads[i], NULL, scan_worker, &list) != 0)
+            err(1, "pthread_create");
+    for (i = 0; i < workers; ++i)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&list.lock);
+
+    if (list.count > 0)
+        qsort(list.entries, list.count, sizeof(*list.entries), scan_compare);
+
+    *entries = list.entries;
+    return list.count;
+}
+
+/**
+ * Write s as a JSON string. Bytes outside printable ASCII are escaped, a
+ * title is not necessarily text.
+ */
+static void scan_string(FILE *out, const char *s) {
+    const unsigned char *p;
+
+    fputc('"', out);
+    for (p = (const unsigned char *)s; *p; ++p) {
+        if (*p == '"' || *p == '\\')
+            fprintf(out, "\\%c", *p);
+        else if (*p < 0x20 || *p >= 0x7f)
+            fprintf(out, "\\u%04x", *p);
+        else
+            fputc(*p, out);
+    }
+    fputc('"', out);
+}
+
+/**
+ * Write the catalog of a scan as a JSON array, one ROM per line.
+ *
+ * Returns:
+ *  0       success
+ *  -1      write error
+ */
+int scan_catalog(FILE *out, const scan_entry_t *entries, int n) {
+    static const char *logos[] = { "fail", "cgb", "pass" };
+    const scan_entry_t *e;
+    int i;
+
+    fprintf(out, "[\n");
+    for (i = 0; i < n; ++i) {
+        e = &entries[i];
+
+        fprintf(out, "  {\"path\": ");
+        scan_string(out, e->path);
+        if (e->error != 0) {
+            fprintf(out, ", \"error\": ");
+            scan_string(out, strerror(e->error));
+        } else {
+            fprintf(out, ", \"size\": %llu, \"title\": ", (unsigned long long)e->size);
+            scan_string(out, e->title);
+            fprintf(out, ", \"key\": ");
+            if (e->key[0] != '\0')
+                scan_string(out, e->key);
+            else
+                fprintf(out, "null");
+            fprintf(out, ", \"romsize\": %u, \"cgb\": %s, \"logo\": \"%s\", \"header_checksum\": %s, "
+                    "\"global_checksum\": %s", e->romsize, e->cgb & 0x80 ? "true" : "false",
+                    logos[e->logo], e->header ? "true" : "false",
+                    e->global < 0 ? "null" : e->global ? "true" : "false");
+        }
+        fprintf(out, "}%s\n", i + 1 < n ? "," : "");
+    }
+    fprintf(out, "]\n");
+
+    return ferror(out) ? -1 : 0;
+}
+
+/**
+ * Free the list of a scan.
+ */
+void scan_free(scan_entry_t *entries, int n) {
+    int i;
+
+    for (i = 0; i < n; ++i)
+        free(entries[i].path);
+    free(entries);
+}
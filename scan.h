@@ -0,0 +1,29 @@
+#ifndef __SCAN_H__
+#define __SCAN_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+// most threads checking the ROMs of a library
+#define SCAN_WORKERS 16
+
+/* one ROM file of a library */
+typedef struct _scan_entry_t {
+    char *path;
+    uint64_t size;          // of the file
+    char title[17];
+    char key[64];           // header_key, empty if the header is bad
+    uint32_t romsize;       // by the header, 0 for an unknown code
+    unsigned char cgb;      // CGB flag byte
+    unsigned char logo;     // header_logo
+    unsigned char header;   // header checksum matches
+    signed char global;     // global checksum matches, -1 if not checked
+    int error;              // errno if the file can't be read, else 0
+} scan_entry_t;
+
+int scan_library(char **dirs, int ndirs, int global, scan_entry_t **entries);
+int scan_catalog(FILE *out, const scan_entry_t *entries, int n);
+void scan_free(scan_entry_t *entries, int n);
+
+#endif /* __SCAN_H__ */
+// vim: ft=c
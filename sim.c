@@ -0,0 +1,573 @@
+/*
+ * Simulated cart: what ems_open("sim:...") gives instead of a cart on the
+ * bus. It holds both ROM banks and SRAM in memory, parses the command stream
+ * like the firmware does and completes every transfer when a model of the
+ * link says it would, so the pipelined reads, batched writes and diffs can be
+ * measured without a cart:
+ *
+ *  sim:latency=250,bandwidth=1000,max-read=16384,rom=cart.gb,sram=game.sav
+ *
+ * The link moves one transfer at a time at bandwidth KB/s, and each one
+ * completes latency µs after its last byte, so transfers kept in flight hide
+ * the latency of the ones before them. Transfers complete in the order they
+ * were submitted, as they would on the cart.
+ *
+ * With replay=<file>, a Chrome trace written by --trace, each command, data
+ * and write transfer instead takes the time and ends with the status of the
+ * next one of its kind in the trace, so a run on one host can be played back
+ * on another, errors and all. Once the trace runs out the model takes over.
+ *
+ * ROM takes writes like memory unless sector=<bytes> makes it flash: a write
+ * that starts a sector erases it first, taking erase µs of the link, and
+ * programming can only clear bits. A write into a sector that wasn't erased
+ * leaves the AND of old and new, which --verify reports, and is warned about,
+ * so writes that skip blocks (--diff, sparse writes, --pack) can be checked
+ * against a cart that must be erased before it is programmed.
+ */
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "transport.h"
+
+// both banks of the cart
+#define SIM_ROM_SIZE    0x800000
+#define SIM_SRAM_SIZE   0x020000
+
+// link model defaults: a full speed cart's round trip and bulk throughput
+#define SIM_LATENCY     250     // µs
+#define SIM_BANDWIDTH   1000    // KB/s
+
+/* a submitted transfer, waiting for its time */
+struct sim_xfer {
+    struct libusb_transfer *xfer;
+    uint64_t submitted;
+    uint64_t due;
+    int status;             // libusb error it ends with, 0 for success
+    int cancelled;
+    struct sim_xfer *next;
+};
+
+/* the recorded transfers of one phase, for replay */
+struct sim_replay {
+    uint64_t *dur;          // ns
+    int *status;
+    size_t count;
+    size_t size;
+    size_t next;
+};
+
+struct sim {
+    unsigned char *rom;
+    unsigned char *sram;
+    unsigned char *fifo;    // read data the firmware has queued for ep in
+    size_t fifo_len;
+    size_t fifo_size;
+
+    uint64_t latency;       // ns
+    double bandwidth;       // bytes per ns
+    size_t max_read;        // longer reads get no answer, 0 for no limit
+    size_t sector;          // flash sector of ROM, 0 to write it like memory
+    uint64_t erase;         // ns a sector erase takes
+    unsigned long stale;    // writes that programmed flash that wasn't erased
+    uint64_t link_free;     // when the link is done with what it has
+    uint64_t last_due;
+
+    struct sim_xfer *pending;   // in submission order
+    struct sim_replay replay[EMS_TRACE_WRITE + 1];
+};
+
+static uint64_t sim_clock(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sim_sleep_until(uint64_t ns) {
+    struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/**
+ * Load a file into the start of an image.
+ *
+ * Returns:
+ *  0       success
+ *  < 0     libusb error, the file can't be read
+ */
+static int sim_load(unsigned char *image, size_t size, const char *path) {
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL)
+        return LIBUSB_ERROR_NOT_FOUND;
+    if (fread(image, 1, size, file) == 0 && ferror(file)) {
+        fclose(file);
+        return LIBUSB_ERROR_IO;
+    }
+    fclose(file);
+    return 0;
+}
+
+/**
+ * Load the transfers of the first cart in a Chrome trace written by
+ * trace.c, one event per line.
+ *
+ * Returns:
+ *  0       success
+ *  < 0     libusb error, the file can't be read or has no transfers
+ */
+static int sim_load_replay(struct sim *sim, const char *path) {
+    static const char *names[] = {
+        [EMS_TRACE_COMMAND] = "\"name\":\"command\"",
+        [EMS_TRACE_DATA]    = "\"name\":\"data\"",
+        [EMS_TRACE_WRITE]   = "\"name\":\"write\"",
+    };
+    char line[512], *p;
+    struct sim_replay *r;
+    int phase, pid, first = -1, status, total = 0;
+    double dur;
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return LIBUSB_ERROR_NOT_FOUND;
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strstr(line, "\"ph\":\"X\"") == NULL)
+            continue;
+        for (phase = EMS_TRACE_COMMAND; phase <= EMS_TRACE_WRITE; ++phase)
+            if (strstr(line, names[phase]) != NULL)
+                break;
+        if (phase > EMS_TRACE_WRITE ||
+                (p = strstr(line, "\"pid\":")) == NULL || sscanf(p, "\"pid\":%d", &pid) != 1 ||
+                (p = strstr(line, "\"dur\":")) == NULL || sscanf(p, "\"dur\":%lf", &dur) != 1 ||
+                (p = strstr(line, "\"status\":")) == NULL || sscanf(p, "\"status\":%d", &status) != 1)
+            continue;
+
+        // an --all trace has several carts, one is enough
+        if (first < 0)
+            first = pid;
+        if (pid != first)
+            continue;
+
+        r = &sim->replay[phase];
+        if (r->count == r->size) {
+            size_t size = r->size ? 2 * r->size : 256;
+            uint64_t *d = realloc(r->dur, size * sizeof(*d));
+            int *s = d != NULL ? realloc(r->status, size * sizeof(*s)) : NULL;
+
+            if (d != NULL)
+                r->dur = d;
+            if (s == NULL) {
+                fclose(file);
+                return LIBUSB_ERROR_NO_MEM;
+            }
+            r->status = s;
+            r->size = size;
+        }
+        r->dur[r->count] = dur * 1000;
+        r->status[r->count] = status;
+        ++r->count;
+        ++total;
+    }
+
+    fclose(file);
+    return total > 0 ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static void sim_close(void *link) {
+    struct sim *sim = link;
+    struct sim_xfer *x;
+    int i;
+
+    if (sim->stale > 1)
+        warnx("sim: %lu writes programmed ROM that wasn't erased", sim->stale);
+
+    while ((x = sim->pending) != NULL) {
+        sim->pending = x->next;
+        free(x);
+    }
+    for (i = 0; i <= EMS_TRACE_WRITE; ++i) {
+        free(sim->replay[i].dur);
+        free(sim->replay[i].status);
+    }
+    free(sim->rom);
+    free(sim->sram);
+    free(sim->fifo);
+    free(sim);
+}
+
+/**
+ * Make a simulated cart from the part of an id after "sim:", comma separated
+ * key=value settings: latency (µs), bandwidth (KB/s), max-read (bytes), the
+ * flash sector (bytes) and erase time (µs), and files to load into rom and
+ * sram or to replay. ROM starts out erased, SRAM zeroed.
+ *
+ * Returns:
+ *  0       success, link is set
+ *  < 0     libusb error: a bad setting, or a file that can't be read
+ */
+int sim_open(const char *spec, void **link) {
+    struct sim *sim = calloc(1, sizeof(*sim));
+    char *copy = strdup(spec), *item, *save, *value;
+    int r = 0;
+
+    if (sim == NULL || copy == NULL || (sim->rom = malloc(SIM_ROM_SIZE)) == NULL ||
+            (sim->sram = calloc(1, SIM_SRAM_SIZE)) == NULL) {
+        r = LIBUSB_ERROR_NO_MEM;
+        goto out;
+    }
+    memset(sim->rom, 0xff, SIM_ROM_SIZE);
+    sim->latency = SIM_LATENCY * 1000ull;
+    sim->bandwidth = SIM_BANDWIDTH * 1024 / 1e9;
+
+    for (item = strtok_r(copy, ",", &save); item != NULL && r == 0; item = strtok_r(NULL, ",", &save)) {
+        value = strchr(item, '=');
+        if (value == NULL) {
+            r = LIBUSB_ERROR_INVALID_PARAM;
+            break;
+        }
+        *value++ = '\0';
+
+        if (strcmp(item, "latency") == 0)
+            sim->latency = strtoull(value, NULL, 10) * 1000;
+        else if (strcmp(item, "bandwidth") == 0 && atof(value) > 0)
+            sim->bandwidth = atof(value) * 1024 / 1e9;
+        else if (strcmp(item, "max-read") == 0)
+            sim->max_read = strtoul(value, NULL, 10);
+        else if (strcmp(item, "sector") == 0)
+            sim->sector = strtoul(value, NULL, 10);
+        else if (strcmp(item, "erase") == 0)
+            sim->erase = strtoull(value, NULL, 10) * 1000;
+        else if (strcmp(item, "rom") == 0)
+            r = sim_load(sim->rom, SIM_ROM_SIZE, value);
+        else if (strcmp(item, "sram") == 0)
+            r = sim_load(sim->sram, SIM_SRAM_SIZE, value);
+        else if (strcmp(item, "replay") == 0)
+            r = sim_load_replay(sim, value);
+        else
+            r = LIBUSB_ERROR_INVALID_PARAM;
+    }
+
+    if (r == 0 && sim->sector > 0 && SIM_ROM_SIZE % sim->sector != 0)
+        r = LIBUSB_ERROR_INVALID_PARAM;
+
+out:
+    free(copy);
+    if (r < 0) {
+        if (sim != NULL)
+            sim_close(sim);
+        return r;
+    }
+    *link = sim;
+    return 0;
+}
+
+/**
+ * What the simulated link looks like: a full speed cart with the usual
+ * endpoints, and the flash sector it was given.
+ */
+void sim_caps(void *link, ems_caps_t *caps) {
+    struct sim *sim = link;
+
+    memset(caps, 0, sizeof(*caps));
+    caps->sector = sim->sector > 0 ? sim->sector : EMS_SECTOR;
+    caps->speed = 12000;
+    caps->ep_out = 2 | LIBUSB_ENDPOINT_OUT;
+    caps->ep_in = 1 | LIBUSB_ENDPOINT_IN;
+    caps->packet_out = caps->packet_in = 64;
+}
+
+/**
+ * Number of ROM sectors the write records of a transfer start, and so erase.
+ */
+static size_t sim_erases(struct sim *sim, const unsigned char *buf, size_t len) {
+    size_t pos, first, n = 0;
+    uint32_t addr, val;
+
+    for (pos = 0; sim->sector > 0 && len - pos >= 9; pos += 9 + val) {
+        addr = ntohl(*(uint32_t *)(buf + pos + 1));
+        val = ntohl(*(uint32_t *)(buf + pos + 5));
+        if ((buf[pos] != CMD_WRITE && buf[pos] != CMD_WRITE_SRAM) || val > len - pos - 9)
+            break;
+
+        first = (addr + sim->sector - 1) / sim->sector * sim->sector;
+        if (buf[pos] == CMD_WRITE && first < (size_t)addr + val)
+            n += (addr + val - 1 - first) / sim->sector + 1;
+    }
+    return n;
+}
+
+/**
+ * Work out when a transfer of len bytes submitted now completes, and with
+ * what status.
+ */
+static uint64_t sim_schedule(struct sim *sim, unsigned char ep, const unsigned char *buf, int len,
+        uint64_t submitted, int *status) {
+    int phase = ep & LIBUSB_ENDPOINT_IN ? EMS_TRACE_DATA :
+        len > 0 && (buf[0] == CMD_READ || buf[0] == CMD_READ_SRAM) ? EMS_TRACE_COMMAND : EMS_TRACE_WRITE;
+    struct sim_replay *r = &sim->replay[phase];
+    uint64_t due, start;
+
+    *status = 0;
+    if (r->next < r->count) {
+        *status = r->status[r->next];
+        due = submitted + r->dur[r->next++];
+    } else {
+        start = submitted > sim->link_free ? submitted : sim->link_free;
+        sim->link_free = start + (uint64_t)(len / sim->bandwidth);
+        if (phase == EMS_TRACE_WRITE)
+            sim->link_free += sim->erase * sim_erases(sim, buf, len);
+        due = sim->link_free + sim->latency;
+    }
+
+    // the cart answers in order
+    if (due < sim->last_due)
+        due = sim->last_due;
+    sim->last_due = due;
+    return due;
+}
+
+/**
+ * Queue len bytes of a memory for ep in, as the firmware answers a read.
+ */
+static void sim_answer(struct sim *sim, const unsigned char *mem, size_t size, uint32_t addr, size_t len) {
+    size_t need = sim->fifo_len + len;
+
+    if (addr >= size || len > size - addr || (sim->max_read > 0 && len > sim->max_read))
+        return;
+
+    if (need > sim->fifo_size) {
+        unsigned char *fifo = realloc(sim->fifo, need);
+        if (fifo == NULL)
+            return;
+        sim->fifo = fifo;
+        sim->fifo_size = need;
+    }
+    memcpy(sim->fifo + sim->fifo_len, mem + addr, len);
+    sim->fifo_len = need;
+}
+
+/**
+ * Write len bytes to ROM at addr. As flash, the sectors the write starts are
+ * erased first, and the rest can only have bits cleared.
+ */
+static void sim_program(struct sim *sim, uint32_t addr, const unsigned char *data, size_t len) {
+    unsigned char *rom = sim->rom + addr;
+    size_t i, sector;
+    int stale = 0;
+
+    if (sim->sector == 0) {
+        memcpy(rom, data, len);
+        return;
+    }
+
+    for (sector = (addr + sim->sector - 1) / sim->sector * sim->sector; sector < (size_t)addr + len;
+            sector += sim->sector)
+        memset(sim->rom + sector, 0xff, sim->sector);
+
+    for (i = 0; i < len; ++i) {
+        stale |= (rom[i] & data[i]) != data[i];
+        rom[i] &= data[i];
+    }
+
+    if (stale && sim->stale++ == 0)
+        warnx("sim: write of %zu bytes at 0x%06x programmed ROM that wasn't erased", len, addr);
+}
+
+/**
+ * Run the commands of a transfer to ep out: reads queue their data, writes
+ * store their payload.
+ */
+static void sim_commands(struct sim *sim, const unsigned char *buf, size_t len) {
+    size_t pos = 0;
+    uint32_t addr, val;
+
+    while (len - pos >= 9) {
+        addr = ntohl(*(uint32_t *)(buf + pos + 1));
+        val = ntohl(*(uint32_t *)(buf + pos + 5));
+
+        switch (buf[pos]) {
+            case CMD_READ:
+                sim_answer(sim, sim->rom, SIM_ROM_SIZE, addr, val);
+                pos += 9;
+                break;
+            case CMD_READ_SRAM:
+                sim_answer(sim, sim->sram, SIM_SRAM_SIZE, addr, val);
+                pos += 9;
+                break;
+            case CMD_WRITE:
+            case CMD_WRITE_SRAM:
+                if (val > len - pos - 9)
+                    return;
+                if (buf[pos] == CMD_WRITE && addr < SIM_ROM_SIZE && val <= SIM_ROM_SIZE - addr)
+                    sim_program(sim, addr, buf + pos + 9, val);
+                else if (buf[pos] == CMD_WRITE_SRAM && addr < SIM_SRAM_SIZE && val <= SIM_SRAM_SIZE - addr)
+                    memcpy(sim->sram + addr, buf + pos + 9, val);
+                pos += 9 + val;
+                break;
+            default:
+                // the firmware would be out of step from here on
+                return;
+        }
+    }
+}
+
+/**
+ * Carry out a transfer that is due: run its commands, or hand it the read
+ * data waiting. A read with nothing to answer it waits out its timeout.
+ *
+ * Returns:
+ *  0 or a libusb error
+ */
+static int sim_complete(struct sim *sim, unsigned char ep, unsigned char *buf, int len,
+        int *transferred, uint64_t submitted, unsigned int timeout, int status) {
+    size_t n;
+
+    *transferred = 0;
+    if (status < 0)
+        return status;
+
+    if (!(ep & LIBUSB_ENDPOINT_IN)) {
+        sim_commands(sim, buf, len);
+        *transferred = len;
+        return 0;
+    }
+
+    if (sim->fifo_len == 0) {
+        if (timeout > 0)
+            sim_sleep_until(submitted + timeout * 1000000ull);
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+
+    n = sim->fifo_len < (size_t)len ? sim->fifo_len : (size_t)len;
+    memcpy(buf, sim->fifo, n);
+    memmove(sim->fifo, sim->fifo + n, sim->fifo_len - n);
+    sim->fifo_len -= n;
+    *transferred = n;
+    return 0;
+}
+
+/**
+ * The libusb transfer status of a libusb error.
+ */
+static enum libusb_transfer_status sim_status(int r) {
+    switch (r) {
+        case 0:                     return LIBUSB_TRANSFER_COMPLETED;
+        case LIBUSB_ERROR_TIMEOUT:  return LIBUSB_TRANSFER_TIMED_OUT;
+        case LIBUSB_ERROR_PIPE:     return LIBUSB_TRANSFER_STALL;
+        case LIBUSB_ERROR_NO_DEVICE: return LIBUSB_TRANSFER_NO_DEVICE;
+        case LIBUSB_ERROR_OVERFLOW: return LIBUSB_TRANSFER_OVERFLOW;
+        case LIBUSB_ERROR_INTERRUPTED: return LIBUSB_TRANSFER_CANCELLED;
+        default:                    return LIBUSB_TRANSFER_ERROR;
+    }
+}
+
+/**
+ * Complete the first pending transfer, a cancelled one right away, and hand
+ * it to its callback.
+ */
+static void sim_finish_one(struct sim *sim) {
+    struct sim_xfer **xp, *x;
+    struct libusb_transfer *xfer;
+    int r, transferred;
+
+    for (xp = &sim->pending; *xp != NULL && !(*xp)->cancelled; xp = &(*xp)->next)
+        ;
+    if (*xp == NULL)
+        xp = &sim->pending;
+    x = *xp;
+    *xp = x->next;
+    xfer = x->xfer;
+
+    if (x->cancelled) {
+        r = LIBUSB_ERROR_INTERRUPTED;
+        transferred = 0;
+    } else {
+        sim_sleep_until(x->due);
+        r = sim_complete(sim, xfer->endpoint, xfer->buffer, xfer->length, &transferred,
+                x->submitted, xfer->timeout, x->status);
+    }
+    free(x);
+
+    xfer->status = sim_status(r);
+    xfer->actual_length = transferred;
+    xfer->callback(xfer);
+}
+
+static int sim_bulk(void *link, unsigned char ep, unsigned char *buf, int len,
+        int *transferred, unsigned int timeout) {
+    struct sim *sim = link;
+    uint64_t submitted = sim_clock(), due;
+    int status;
+
+    due = sim_schedule(sim, ep, buf, len, submitted, &status);
+
+    // whatever was submitted before goes first
+    while (sim->pending != NULL)
+        sim_finish_one(sim);
+
+    sim_sleep_until(due);
+    return sim_complete(sim, ep, buf, len, transferred, submitted, timeout, status);
+}
+
+static int sim_submit(void *link, struct libusb_transfer *xfer) {
+    struct sim *sim = link;
+    struct sim_xfer *x = calloc(1, sizeof(*x)), **xp;
+
+    if (x == NULL)
+        return LIBUSB_ERROR_NO_MEM;
+
+    x->xfer = xfer;
+    x->submitted = sim_clock();
+    x->due = sim_schedule(sim, xfer->endpoint, xfer->buffer, xfer->length, x->submitted, &x->status);
+
+    for (xp = &sim->pending; *xp != NULL; xp = &(*xp)->next)
+        ;
+    *xp = x;
+    return 0;
+}
+
+static int sim_cancel(void *link, struct libusb_transfer *xfer) {
+    struct sim *sim = link;
+    struct sim_xfer *x;
+
+    for (x = sim->pending; x != NULL; x = x->next)
+        if (x->xfer == xfer) {
+            x->cancelled = 1;
+            return 0;
+        }
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int sim_wait(void *link, int *completed) {
+    struct sim *sim = link;
+
+    do {
+        // nothing would ever complete
+        if (sim->pending == NULL)
+            return completed == NULL ? 0 : LIBUSB_ERROR_OTHER;
+        sim_finish_one(sim);
+    } while (completed != NULL && !*completed);
+
+    return 0;
+}
+
+static int sim_clear_halt(void *link, unsigned char ep) {
+    return 0;
+}
+
+const ems_transport_t sim_transport = {
+    .bulk       = sim_bulk,
+    .submit     = sim_submit,
+    .cancel     = sim_cancel,
+    .wait       = sim_wait,
+    .clear_halt = sim_clear_halt,
+    .close      = sim_close,
+};
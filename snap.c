@@ -0,0 +1,282 @@
+/*
+ * SRAM snapshots a daemon keeps in memory: the last few images of a cart's
+ * save, cut into SNAP_BLOCK blocks that are shared between snapshots, so a
+ * save that changed in one place costs one new block per snapshot, not the
+ * whole image.
+ *
+ * A store also tracks what the cart holds, the blocks of the last image read
+ * or restored. Restoring a snapshot then only needs the blocks that differ
+ * from it, and a block the two share is the same block, so finding them is a
+ * pointer compare.
+ */
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc32.h"
+#include "snap.h"
+
+// hash buckets the blocks of a store are found by
+#define SNAP_HASH 256
+
+/* a block, shared by every snapshot that has the same contents */
+struct snap_blk {
+    struct snap_blk *next;      // in its hash bucket
+    uint32_t crc;
+    int refs;
+    unsigned char data[SNAP_BLOCK];
+};
+
+struct snap {
+    snap_info_t info;
+    struct snap_blk **blocks;
+};
+
+struct snap_store {
+    int blocks;                 // per image
+    int keep;
+    struct snap *snaps;         // ring of keep, oldest at first
+    int first;
+    int count;
+    unsigned int next_id;
+    struct snap_blk **known;    // what the cart holds, NULL if unknown
+    size_t held;                // blocks in the hash
+    struct snap_blk *hash[SNAP_HASH];
+};
+
+/**
+ * Make an empty store for images of size bytes, a multiple of SNAP_BLOCK,
+ * keeping the last keep snapshots.
+ */
+snap_store_t *snap_create(size_t size, int keep) {
+    snap_store_t *s;
+
+    if (size == 0 || size % SNAP_BLOCK != 0 || keep < 1)
+        return NULL;
+
+    s = calloc(1, sizeof(*s));
+    if (s == NULL || (s->snaps = calloc(keep, sizeof(*s->snaps))) == NULL)
+        err(1, "calloc");
+
+    s->blocks = size / SNAP_BLOCK;
+    s->keep = keep;
+    s->next_id = 1;
+    return s;
+}
+
+/**
+ * Find the block with these contents, or add one, and take a reference to it.
+ *
+ * Params:
+ *  fresh       incremented if the block is new
+ */
+static struct snap_blk *snap_intern(snap_store_t *s, const unsigned char *data, int *fresh) {
+    uint32_t crc = crc32_update(0, data, SNAP_BLOCK);
+    struct snap_blk **bucket = &s->hash[crc % SNAP_HASH], *b;
+
+    for (b = *bucket; b != NULL; b = b->next)
+        if (b->crc == crc && memcmp(b->data, data, SNAP_BLOCK) == 0) {
+            ++b->refs;
+            return b;
+        }
+
+    b = malloc(sizeof(*b));
+    if (b == NULL)
+        err(1, "malloc");
+    memcpy(b->data, data, SNAP_BLOCK);
+    b->crc = crc;
+    b->refs = 1;
+    b->next = *bucket;
+    *bucket = b;
+    ++s->held;
+    if (fresh != NULL)
+        ++*fresh;
+    return b;
+}
+
+/**
+ * Drop a reference to a block, freeing it with the last one.
+ */
+static void snap_release(snap_store_t *s, struct snap_blk *b) {
+    struct snap_blk **p;
+
+    if (--b->refs > 0)
+        return;
+
+    for (p = &s->hash[b->crc % SNAP_HASH]; *p != b; p = &(*p)->next)
+        ;
+    *p = b->next;
+    --s->held;
+    free(b);
+}
+
+/**
+ * Drop the references of a list of blocks and free it.
+ */
+static void snap_release_all(snap_store_t *s, struct snap_blk **blocks) {
+    int i;
+
+    if (blocks == NULL)
+        return;
+    for (i = 0; i < s->blocks; ++i)
+        snap_release(s, blocks[i]);
+    free(blocks);
+}
+
+/**
+ * Cut an image into blocks of the store.
+ */
+static struct snap_blk **snap_cut(snap_store_t *s, const unsigned char *image, int *fresh) {
+    struct snap_blk **blocks = malloc(s->blocks * sizeof(*blocks));
+    int i;
+
+    if (blocks == NULL)
+        err(1, "malloc");
+    for (i = 0; i < s->blocks; ++i)
+        blocks[i] = snap_intern(s, image + (size_t)i * SNAP_BLOCK, fresh);
+    return blocks;
+}
+
+/**
+ * Free a store and every snapshot in it.
+ */
+void snap_destroy(snap_store_t *s) {
+    int i;
+
+    if (s == NULL)
+        return;
+
+    for (i = 0; i < s->count; ++i)
+        snap_release_all(s, s->snaps[(s->first + i) % s->keep].blocks);
+    snap_release_all(s, s->known);
+    free(s->snaps);
+    free(s);
+}
+
+/**
+ * Add a snapshot of image, just read from the cart, which is then what the
+ * cart is known to hold. The oldest snapshot goes if the store is full.
+ *
+ * Params:
+ *  info        set to the new snapshot, if not NULL
+ *
+ * Returns:
+ *  id of the snapshot
+ */
+int snap_add(snap_store_t *s, const unsigned char *image, snap_info_t *info) {
+    struct snap *snap;
+
+    if (s->count == s->keep) {
+        snap_release_all(s, s->snaps[s->first].blocks);
+        s->first = (s->first + 1) % s->keep;
+        --s->count;
+    }
+
+    snap = &s->snaps[(s->first + s->count++) % s->keep];
+    snap->info.id = s->next_id++;
+    snap->info.taken = time(NULL);
+    snap->info.fresh = 0;
+    snap->blocks = snap_cut(s, image, &snap->info.fresh);
+
+    // the cart holds this snapshot now
+    snap_restored(s, snap->info.id);
+
+    if (info != NULL)
+        *info = snap->info;
+    return snap->info.id;
+}
+
+/**
+ * The snapshot with an id, or NULL if the store doesn't have it (any more).
+ */
+static struct snap *snap_find(snap_store_t *s, unsigned int id) {
+    int i;
+
+    for (i = 0; i < s->count; ++i)
+        if (s->snaps[(s->first + i) % s->keep].info.id == id)
+            return &s->snaps[(s->first + i) % s->keep];
+    return NULL;
+}
+
+/**
+ * Get the i-th snapshot of the store, oldest first.
+ *
+ * Returns:
+ *  0       success
+ *  -1      there are no more
+ */
+int snap_info(snap_store_t *s, int i, snap_info_t *info) {
+    if (i < 0 || i >= s->count)
+        return -1;
+    *info = s->snaps[(s->first + i) % s->keep].info;
+    return 0;
+}
+
+/**
+ * Bytes held by the blocks of the store.
+ */
+size_t snap_memory(snap_store_t *s) {
+    return s->held * SNAP_BLOCK;
+}
+
+/**
+ * Contents of a block of the snapshot with an id. Two snapshots, or a
+ * snapshot and the cart, have the same block exactly when this is the same
+ * pointer.
+ *
+ * Returns:
+ *  SNAP_BLOCK bytes, or NULL if the store doesn't have the snapshot
+ */
+const void *snap_block(snap_store_t *s, unsigned int id, int block) {
+    struct snap *snap = snap_find(s, id);
+
+    if (snap == NULL || block < 0 || block >= s->blocks)
+        return NULL;
+    return snap->blocks[block]->data;
+}
+
+/**
+ * Contents of a block as the cart holds it, or NULL if that's unknown.
+ */
+const void *snap_known(snap_store_t *s, int block) {
+    if (s->known == NULL || block < 0 || block >= s->blocks)
+        return NULL;
+    return s->known[block]->data;
+}
+
+/**
+ * Track image, just read from the cart, as what it holds, without taking a
+ * snapshot of it.
+ */
+void snap_track(snap_store_t *s, const unsigned char *image) {
+    snap_forget(s);
+    s->known = snap_cut(s, image, NULL);
+}
+
+/**
+ * The snapshot with an id was just written to the cart whole.
+ */
+void snap_restored(snap_store_t *s, unsigned int id) {
+    struct snap *snap = snap_find(s, id);
+    int i;
+
+    snap_forget(s);
+    if (snap == NULL)
+        return;
+
+    s->known = malloc(s->blocks * sizeof(*s->known));
+    if (s->known == NULL)
+        err(1, "malloc");
+    for (i = 0; i < s->blocks; ++i) {
+        s->known[i] = snap->blocks[i];
+        ++s->known[i]->refs;
+    }
+}
+
+/**
+ * What the cart holds isn't known any more, something else wrote to it.
+ */
+void snap_forget(snap_store_t *s) {
+    snap_release_all(s, s->known);
+    s->known = NULL;
+}
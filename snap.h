@@ -0,0 +1,37 @@
+#ifndef __SNAP_H__
+#define __SNAP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// snapshots share identical blocks of this size
+#define SNAP_BLOCK 4096
+
+// snapshots a store keeps by default, older ones are dropped
+#define SNAP_KEEP 64
+
+typedef struct snap_store snap_store_t;
+
+/* one snapshot in a store */
+typedef struct snap_info {
+    unsigned int id;
+    time_t taken;
+    int fresh;          // blocks no earlier snapshot had when it was taken
+} snap_info_t;
+
+snap_store_t *snap_create(size_t size, int keep);
+void snap_destroy(snap_store_t *s);
+
+int snap_add(snap_store_t *s, const unsigned char *image, snap_info_t *info);
+int snap_info(snap_store_t *s, int i, snap_info_t *info);
+size_t snap_memory(snap_store_t *s);
+
+const void *snap_block(snap_store_t *s, unsigned int id, int block);
+const void *snap_known(snap_store_t *s, int block);
+void snap_track(snap_store_t *s, const unsigned char *image);
+void snap_restored(snap_store_t *s, unsigned int id);
+void snap_forget(snap_store_t *s);
+
+#endif /* __SNAP_H__ */
+// vim: ft=c
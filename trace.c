@@ -0,0 +1,129 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "trace.h"
+
+// most devices a trace file tells apart
+#define TRACE_MAX_DEVICES EMS_MAX_DEVICES
+
+/* the Chrome trace being written, shared by every traced cart */
+static struct {
+    FILE *file;
+    int events;             // events written so far, for the commas
+    int devices;            // next pid to hand out
+    int pids[TRACE_MAX_DEVICES];
+    pthread_mutex_t lock;
+} trace = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static const char *phase_names[] = {
+    [EMS_TRACE_COMMAND] = "command",
+    [EMS_TRACE_DATA]    = "data",
+    [EMS_TRACE_WRITE]   = "write",
+};
+
+/**
+ * Write one event object. Caller holds the lock.
+ */
+static void __attribute__((format(printf, 1, 2))) trace_event(const char *fmt, ...) {
+    va_list ap;
+
+    if (trace.events++ > 0)
+        fputs(",\n", trace.file);
+    va_start(ap, fmt);
+    vfprintf(trace.file, fmt, ap);
+    va_end(ap);
+}
+
+/**
+ * Called by ems.c for every finished transfer phase of a traced cart.
+ * Events become complete ("X") events with µs timestamps, one process per
+ * cart so the carts of an --all run stack up in the viewer.
+ */
+static void trace_record(const ems_trace_event_t *ev, void *arg) {
+    int pid = *(int *)arg;
+
+    pthread_mutex_lock(&trace.lock);
+    if (trace.file != NULL)
+        trace_event("{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"offset\":%u,\"bytes\":%u,"
+                "\"status\":%d,\"retries\":%u}}",
+                phase_names[ev->phase], ev->space == FROM_ROM ? "rom" : "sram",
+                pid, ev->phase,
+                ev->start_ns / 1000.0, (ev->end_ns - ev->start_ns) / 1000.0,
+                ev->offset, ev->bytes, ev->status, ev->retries);
+    pthread_mutex_unlock(&trace.lock);
+}
+
+/**
+ * Start a Chrome trace (chrome://tracing, Perfetto) in path.
+ *
+ * Returns:
+ *  0 on success, 1 if the file can't be created
+ */
+int trace_open(const char *path) {
+    trace.file = fopen(path, "w");
+    if (trace.file == NULL) {
+        warn("can't open trace file %s", path);
+        return 1;
+    }
+
+    fputs("{\"traceEvents\":[\n", trace.file);
+    return 0;
+}
+
+/**
+ * Trace every transfer of a cart into the open trace file.
+ *
+ * Params:
+ *  name    label of the cart in the viewer
+ *
+ * Returns:
+ *  0 on success, 1 on failure
+ */
+int trace_attach(ems_dev_t *dev, const char *name) {
+    int *pid;
+
+    if (trace.file == NULL)
+        return 0;
+
+    pthread_mutex_lock(&trace.lock);
+    if (trace.devices == TRACE_MAX_DEVICES) {
+        pthread_mutex_unlock(&trace.lock);
+        warnx("too many carts to trace");
+        return 1;
+    }
+    pid = &trace.pids[trace.devices];
+    *pid = ++trace.devices;
+    trace_event("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}",
+            *pid, name);
+    pthread_mutex_unlock(&trace.lock);
+
+    if (ems_trace_enable(dev, 0, trace_record, pid) < 0) {
+        warnx("can't enable tracing");
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Finish the trace file. Traced carts must be closed or idle.
+ */
+void trace_close(void) {
+    if (trace.file == NULL)
+        return;
+
+    pthread_mutex_lock(&trace.lock);
+    fputs("\n]}\n", trace.file);
+    if (fclose(trace.file) != 0)
+        warn("error writing trace file");
+    trace.file = NULL;
+    trace.events = 0;
+    trace.devices = 0;
+    pthread_mutex_unlock(&trace.lock);
+}
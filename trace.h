@@ -0,0 +1,11 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include "ems.h"
+
+int trace_open(const char *path);
+int trace_attach(ems_dev_t *dev, const char *name);
+void trace_close(void);
+
+#endif /* __TRACE_H__ */
+// vim: ft=c
@@ -0,0 +1,39 @@
+#ifndef __TRANSPORT_H__
+#define __TRANSPORT_H__
+
+#include <libusb.h>
+
+#include "ems.h"
+
+// commands of the cart's protocol, 1 byte code, 4 byte address, 4 byte value
+enum {
+    CMD_READ    = 0xff,
+    CMD_WRITE   = 0x57,
+    CMD_READ_SRAM   = 0x6d,
+    CMD_WRITE_SRAM  = 0x4d,
+};
+
+/*
+ * What carries the transfers of an open cart: libusb, or the simulated cart
+ * of sim.c. Calls take the transport's own link and work like the libusb
+ * calls of the same name; async transfers are libusb transfers either way,
+ * filled in with libusb_fill_bulk_transfer and handed back to their callback.
+ */
+typedef struct ems_transport {
+    int (*bulk)(void *link, unsigned char ep, unsigned char *buf, int len,
+            int *transferred, unsigned int timeout);
+    int (*submit)(void *link, struct libusb_transfer *xfer);
+    int (*cancel)(void *link, struct libusb_transfer *xfer);
+    // complete transfers until *completed is set, or at least one if NULL
+    int (*wait)(void *link, int *completed);
+    int (*clear_halt)(void *link, unsigned char ep);
+    void (*close)(void *link);
+} ems_transport_t;
+
+extern const ems_transport_t sim_transport;
+
+int sim_open(const char *spec, void **link);
+void sim_caps(void *link, ems_caps_t *caps);
+
+#endif /* __TRANSPORT_H__ */
+// vim: ft=c